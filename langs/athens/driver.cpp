@@ -1,222 +1,16 @@
-#include "KaleidoscopeJIT.h"
-#include "codegen.h"
-#include "lexer.h"
-#include "parser.h"
-#include <fstream>
+#include "server.h"
+#include "session.h"
+#include "watch.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
-#include "llvm/IR/PassManager.h"
-#include "llvm/Passes/PassBuilder.h"
-#include "llvm/Passes/StandardInstrumentations.h"
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar/Reassociate.h"
-#include "llvm/Transforms/Scalar/SimplifyCFG.h"
-#include "llvm/Transforms/Utils/Mem2Reg.h"
+using namespace llvm;
+using athens::Mode;
 
-//===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT Driver
-//===----------------------------------------------------------------------===//
-extern std::unique_ptr<FunctionPassManager> TheFPM;
-extern std::unique_ptr<LoopAnalysisManager> TheLAM;
-extern std::unique_ptr<FunctionAnalysisManager> TheFAM;
-std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-std::unique_ptr<ModuleAnalysisManager> TheMAM;
-std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-std::unique_ptr<StandardInstrumentations> TheSI;
 static ExitOnError ExitOnErr;
 
-std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-
-void InitializeModuleAndManagers(void) {
-  // Open a new context and module
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("Athens Top Module", *TheContext);
-  TheModule->setDataLayout(TheJIT->getDataLayout());
-
-  // Create a new builder for the module
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
-
-  // Create new pass and analysis managers
-  TheFPM = std::make_unique<llvm::FunctionPassManager>();
-  TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
-  TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
-  TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
-  TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
-  ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
-  TheSI =
-      std::make_unique<llvm::StandardInstrumentations>(*TheContext,
-                                                       /*DebugLogging*/ true);
-  TheSI->registerCallbacks(*ThePIC, TheMAM.get());
-
-  // Add transform passes.
-
-  // Promote allocas to registers
-  TheFPM->addPass(llvm::PromotePass());
-
-  // Do simple "peephole" optimizations and big-twiddling opts.
-  TheFPM->addPass(llvm::InstCombinePass());
-
-  // Reassociate expressions.
-  TheFPM->addPass(llvm::ReassociatePass());
-
-  // Eliminate common subexpressions
-  TheFPM->addPass(llvm::GVNPass());
-
-  // Simplify the control flow graph (delete unreachable blocks, etc).
-  TheFPM->addPass(llvm::SimplifyCFGPass());
-
-  // Register analysis passes used in these transform passes.
-  llvm::PassBuilder PB;
-  PB.registerModuleAnalyses(*TheMAM);
-  PB.registerFunctionAnalyses(*TheFAM);
-  PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
-}
-
-static void printIfVerbose(bool verbose, const char *str) {
-  if (verbose)
-    std::cerr << str;
-}
-
-enum class Mode { Run, EmitLLVMIR };
-
-static void HandleDefinition(Mode mode, bool verbose) {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      if (mode == Mode::EmitLLVMIR) {
-        FnIR->print(outs());
-      }
-
-      if (verbose) {
-        fprintf(stderr, "Read function definition:\n");
-        FnIR->print(errs());
-        fprintf(stderr, "\n");
-      }
-      ExitOnErr(TheJIT->addModule(
-          orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-      InitializeModuleAndManagers();
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
-
-static void HandleExtern(Mode mode, bool verbose) {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-
-      if (mode == Mode::EmitLLVMIR) {
-        FnIR->print(outs());
-      }
-
-      if (verbose) {
-        fprintf(stderr, "Read extern:\n");
-        FnIR->print(errs());
-        fprintf(stderr, "\n");
-      }
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
-
-static void HandleTopLevelExpression(Mode mode, bool verbose) {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (FnAST->codegen()) {
-      // Create a ResourceTracker to track JITted memory allocated to our
-      // anonymous expression -- that way we can free it after executing.
-      auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-
-      auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule),
-                                             std::move(TheContext));
-      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-      InitializeModuleAndManagers();
-
-      // Search the JIT for the __anon_expr symbol.
-      auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-
-      double (*FP)() = ExprSymbol.toPtr<double (*)()>();
-      fprintf(stderr, "%f\n", FP());
-
-      // FnIR->print(errs());
-      // fprintf(stderr, "\n");
-      //
-      // // Remove the anonymous expression.
-      // FnIR->eraseFromParent();
-
-      // Delete the anonymous expression module from the JIT.
-      ExitOnErr(RT->remove());
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
-
-static void lexerLoop(bool isRepl, Mode mode, bool verbose) {
-  if (isRepl)
-    fprintf(stderr, "Welcome to Athens!\n> ");
-
-  getNextToken();
-
-  while (CurTok != Token::eof) {
-
-    if (isRepl) {
-      fprintf(stderr, "> ");
-    }
-
-    switch (CurTok) {
-    case static_cast<Token>(';'): // ignore top-level semicolons.
-      getNextToken();
-      break;
-    case Token::def:
-      HandleDefinition(mode, verbose);
-      break;
-    case Token::extern_:
-      HandleExtern(mode, verbose);
-      break;
-    default:
-      HandleTopLevelExpression(mode, verbose);
-      break;
-    }
-  }
-}
-
-/// top ::= definition | external | expression | ';'
-static void LoadRepl(Mode mode, bool verbose) {
-  // Make sure the lexer is reading STDIN
-  lexer::ResetLexerInputStreamToSTDIN();
-
-  lexerLoop(true, mode, verbose);
-}
-
-static void LoadFile(const std::string &Path, Mode mode, bool verbose) {
-  std::ifstream in(Path);
-  if (!in.is_open()) {
-    std::string msg = "could not open " + Path + "\n";
-    printIfVerbose(verbose, msg.c_str());
-    return;
-  }
-  lexer::SetLexerInputStream(in);
-
-  lexerLoop(false, mode, verbose);
-
-  std::string msg = "\n" + Path + " loaded.\n\n";
-  printIfVerbose(verbose, msg.c_str());
-
-  // "in" goes out of scope when LoadFile returns, and CurIn inside the lexer
-  // becomes a dangling pointer
-  lexer::ResetLexerInputStreamToSTDIN();
-}
-
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
@@ -226,40 +20,91 @@ const char *HelpText = R"(Usage: athens [options] [file]
 Options:
   --llvmir        Emit LLVM IR instead of executing the program
                   All output except LLVM IR are put in stderr
+  --output-fd N   Write what the program prints to file descriptor N
+                  (default: stdout, stderr with --llvmir)
   -h, --help      Show this help message and exit
   -v, --verbose   Print internal stuff
+  -j, --jobs N    Parse and generate IR for the program on N threads
+                  (0 = one per core), it still runs in source order
+  --parallel-toplevel
+                  Run top-level expressions that can't affect each other
+                  concurrently (on -j threads, default one per core),
+                  what they print still comes out in source order
+  --ffast-math    Let floating point math be reassociated, approximated
+                  and assume no NaNs/infinities (like clang's -ffast-math)
+  --threads N     Run parfor loops on N threads (0 = one per core, the
+                  default)
+  --memo-size N   Remember up to N results per pure function and thread
+                  (default 65536)
+  --memo-evict P  What a full memo table does with new results: replace
+                  (old ones, the default), clear (start over) or keep
+                  (the old ones)
+  --eval-fuel N   Evaluate calls of effect-free functions on constants at
+                  compile time if it takes at most N steps (default
+                  100000, 0 = never)
+  --interp N      Interpret top-level expressions, and definitions until
+                  they're called (or loop) N times (default 100 in the
+                  REPL, 0 = compile everything as it's read, the default
+                  for files)
+  --veclib L      Vector math library vectorized loops call sin, exp...
+                  of: libmvec (glibc's, the default on x86-64 Linux),
+                  sleef (AArch64) or none
+  --pgo-gen FILE  Count how often each function runs and which way its
+                  branches go, and write that profile to FILE at exit
+  --pgo-use FILE  Optimize with the profile in FILE (from --pgo-gen):
+                  hot paths laid out first, inlining and splitting off
+                  of cold code by what the program actually did
+  --serve SOCK    Keep the JIT and the runtime library loaded and run the
+                  programs clients send to the Unix domain socket SOCK
+  --client SOCK   Have the server at SOCK run file (or stdin), with this
+                  process' stdout, stderr and exit status
+  --watch         Run file again every time it changes, compiling only
+                  the definitions that did
 
 Arguments:
   file            Athens source file (.ath).
                   If omitted, the REPL starts.
 
+Language changes:
+  for             The condition is checked before every iteration, like
+                  C's for, so the body may not run at all. It used to be
+                  checked after the body: `for i = 0, i < n` then ran for
+                  i = 0 to n, write `i <= n` for that now.
+
 Examples:
   athens foo.ath          Compile and run foo.ath
   athens --llvmir foo.ath Emit LLVM IR for foo.ath on stdout
+  athens -j 0 big.ath     Compile big.ath's definitions on all cores
+  athens --pgo-gen prof foo.ath; athens --pgo-use prof foo.ath
+                          Run foo.ath once to profile it, then optimized
+                          by that profile
+  athens --serve /tmp/athens.sock &
+  athens --client /tmp/athens.sock foo.ath
+                          Run foo.ath without starting up again
+  athens --watch foo.ath  Run foo.ath every time it's saved
   athens                  Start the REPL
 )";
 
 int main(int argc, char **argv) {
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmPrinter();
-  InitializeNativeTargetAsmParser();
-
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['='] = 2;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
-
-  TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
-
-  // Make the module, which holds all the code.
-  // InitializeModule();
-  InitializeModuleAndManagers();
-
   bool printHelp = false;
   bool verbose = false;
+  int64_t jobs = -1;
+  bool parallelTopLevel = false;
+  bool fastMath = false;
+  unsigned threads = 0;
+  int outputFd = -1;
+  unsigned memoCapacity = 0;
+  AthensMemoEviction memoEviction = AthensEvictReplace;
+  uint64_t evalFuel = athens::SessionOptions().evalFuel;
+  int64_t interpretThreshold = -1;
+  std::string profileGenerate, profileUse;
+  std::string serveSocket, clientSocket;
+  bool watchFile = false;
+#if defined(__linux__) && defined(__x86_64__)
+  VectorLibrary vecLib = VectorLibrary::LibMVec;
+#else
+  VectorLibrary vecLib = VectorLibrary::None;
+#endif
 
   Mode mode = Mode::Run;
   const char *InputFile = nullptr;
@@ -273,6 +118,59 @@ int main(int argc, char **argv) {
     else if ((std::strcmp(argv[i], "-v") == 0) ||
              (std::strcmp(argv[i], "--verbose") == 0))
       verbose = true;
+    else if (((std::strcmp(argv[i], "-j") == 0) ||
+              (std::strcmp(argv[i], "--jobs") == 0)) &&
+             i + 1 < argc)
+      jobs = static_cast<int64_t>(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--parallel-toplevel") == 0)
+      parallelTopLevel = true;
+    else if (std::strcmp(argv[i], "--ffast-math") == 0)
+      fastMath = true;
+    else if (std::strcmp(argv[i], "--output-fd") == 0 && i + 1 < argc)
+      outputFd = static_cast<int>(std::strtol(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--memo-size") == 0 && i + 1 < argc)
+      memoCapacity =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--memo-evict") == 0 && i + 1 < argc) {
+      const char *Policy = argv[++i];
+      if (std::strcmp(Policy, "clear") == 0)
+        memoEviction = AthensEvictClear;
+      else if (std::strcmp(Policy, "keep") == 0)
+        memoEviction = AthensEvictKeep;
+      else if (std::strcmp(Policy, "replace") == 0)
+        memoEviction = AthensEvictReplace;
+      else {
+        std::cerr << "Unknown --memo-evict policy " << Policy << "\n";
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--eval-fuel") == 0 && i + 1 < argc)
+      evalFuel = std::strtoull(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--interp") == 0 && i + 1 < argc)
+      interpretThreshold = std::strtoll(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--veclib") == 0 && i + 1 < argc) {
+      const char *Lib = argv[++i];
+      if (std::strcmp(Lib, "libmvec") == 0)
+        vecLib = VectorLibrary::LibMVec;
+      else if (std::strcmp(Lib, "sleef") == 0)
+        vecLib = VectorLibrary::SLEEF;
+      else if (std::strcmp(Lib, "none") == 0)
+        vecLib = VectorLibrary::None;
+      else {
+        std::cerr << "Unknown --veclib library " << Lib << "\n";
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--pgo-gen") == 0 && i + 1 < argc)
+      profileGenerate = argv[++i];
+    else if (std::strcmp(argv[i], "--pgo-use") == 0 && i + 1 < argc)
+      profileUse = argv[++i];
+    else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+      serveSocket = argv[++i];
+    else if (std::strcmp(argv[i], "--client") == 0 && i + 1 < argc)
+      clientSocket = argv[++i];
+    else if (std::strcmp(argv[i], "--watch") == 0)
+      watchFile = true;
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
     else
       InputFile = argv[i];
   }
@@ -282,19 +180,82 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  // Load the runtime support library (written in Athens)
-  LoadFile("langs/athens/lib/runtime.ath", Mode::Run, verbose);
+  // The server has everything else set up already
+  if (!clientSocket.empty()) {
+    const char *Path = InputFile ? InputFile : "-";
+    auto Source = MemoryBuffer::getFileOrSTDIN(Path);
+    if (!Source) {
+      std::cerr << "Couldn't read " << Path << ": "
+                << Source.getError().message() << "\n";
+      return 1;
+    }
+    return ExitOnErr(
+        athens::runOnServer(clientSocket, (*Source)->getBuffer(), mode));
+  }
 
-  if (InputFile) {
-    LoadFile(InputFile, mode, verbose);
+  if (watchFile && !InputFile) {
+    std::cerr << "--watch needs a file\n";
+    return 1;
+  }
+
+  // Typing into the REPL wants quick answers, a program (also one a client
+  // sends) wants fast code
+  if (interpretThreshold < 0)
+    interpretThreshold = InputFile || !serveSocket.empty() ? 0 : 100;
+
+  // Running expressions side by side wants more than one thread
+  if (jobs < 0)
+    jobs = parallelTopLevel ? 0 : 1;
+
+  // Keep the IR on stdout by itself
+  if (outputFd < 0)
+    outputFd = mode == Mode::EmitLLVMIR ? 2 : 1;
+
+  athens::SessionOptions Opts = {
+      .verbose = verbose,
+      .jobs = static_cast<unsigned>(jobs),
+      .fastMath = fastMath,
+      .threads = threads,
+      .outputFd = outputFd,
+      .memoCapacity = memoCapacity,
+      .memoEviction = memoEviction,
+      .evalFuel = evalFuel,
+      .interpretThreshold = static_cast<uint64_t>(interpretThreshold),
+      .profileGenerate = profileGenerate,
+      .profileUse = profileUse,
+      .vecLib = vecLib,
+      .parallelTopLevel = parallelTopLevel,
+      .forkable = !serveSocket.empty() || watchFile};
+  auto NewSession = [&]() -> Expected<std::unique_ptr<athens::Session>> {
+    auto S = athens::Session::create(Opts);
+    if (!S)
+      return S.takeError();
+    // Load the runtime support library (written in Athens)
+    (*S)->runFile("langs/athens/lib/runtime.ath", Mode::Run);
+    return S;
+  };
+
+  if (watchFile) {
+    ExitOnErr(athens::watch(NewSession, InputFile, mode));
+    return 0;
+  }
+
+  auto TheSession = ExitOnErr(NewSession());
+
+  if (!serveSocket.empty()) {
+    ExitOnErr(athens::serve(*TheSession, serveSocket));
+  } else if (InputFile) {
+    TheSession->runFile(InputFile, mode);
   } else {
     // Run the main "interpreter loop" now.
-    LoadRepl(mode, verbose);
+    TheSession->runRepl(std::cin, mode);
   }
 
   // Print out all of the generated code.
-  if (verbose)
-    TheModule->print(errs(), nullptr);
+  if (verbose) {
+    TheSession->printModule(errs());
+    TheSession->printMemoStats(errs());
+  }
 
   return 0;
 }
@@ -13,6 +13,9 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "jitmemory.h"
+
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
@@ -20,38 +23,79 @@
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace llvm {
 namespace orc {
 
 class KaleidoscopeJIT {
+public:
+  /// What redefine's modules call the function they define.
+  static constexpr StringLiteral BodySuffix = ".body";
+
+  /// MemoryUsage - What the JIT holds on to.
+  struct MemoryUsage {
+    uint64_t CodeBytes, DataBytes;
+    // Of the slabs those are packed into
+    uint64_t SlabBytes;
+    // Functions defined, and how many of those aren't compiled yet
+    size_t Definitions, Unlinked;
+  };
+
 private:
   std::unique_ptr<ExecutionSession> ES;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  athens::SlabAllocator Memory;
   RTDyldObjectLinkingLayer ObjectLayer;
+  ObjectTransformLayer TransformLayer;
   IRCompileLayer CompileLayer;
 
   JITDylib &MainJD;
 
+  /// Definition - The resource tracker of a function's definition.
+  struct Definition {
+    // The latest one, null if it failed to link
+    ResourceTrackerSP Current;
+    // Current isn't linked yet
+    bool Pending = false;
+  };
+
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  // Where the stub of a function that never linked jumps
+  ExecutorAddr NotLinked;
+  std::mutex DefinitionsMutex;
+  StringMap<Definition> Definitions;
+  // Definitions whose Current isn't linked yet
+  std::vector<std::string> Unlinked;
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
                   JITTargetMachineBuilder JTMB, DataLayout DL)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer,
+                    [this]() {
+                      return std::make_unique<athens::SlabMemoryManager>(
+                          Memory);
+                    }),
+        TransformLayer(*this->ES, ObjectLayer),
+        CompileLayer(*this->ES, TransformLayer,
                      std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+        MainJD(this->ES->createBareJITDylib("<main>")),
+        Stubs(createLocalIndirectStubsManagerBuilder(
+            this->ES->getExecutorProcessControl().getTargetTriple())()) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
@@ -66,24 +110,39 @@ public:
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  /// With DispatchInPlace the JIT compiles and links on the thread that
+  /// looks up a symbol instead of threads of its own, so once a lookup
+  /// returned no other thread is left holding any of its locks. A call of
+  /// a function whose definition failed to link goes to NotLinked.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(bool DispatchInPlace = false, ExecutorAddr NotLinked = {}) {
+    auto EPC = SelfExecutorProcessControl::Create(
+        nullptr, DispatchInPlace ? std::make_unique<InPlaceTaskDispatcher>()
+                                 : nullptr);
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    // The host's CPU and features, like the target machine the optimizer's
+    // cost models use: code vectorized for AVX has to be compiled for it,
+    // vector math library functions take their arguments in its registers
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    auto JIT = std::make_unique<KaleidoscopeJIT>(
+        std::move(ES), std::move(*JTMB), std::move(*DL));
+    JIT->NotLinked = NotLinked;
+    return JIT;
   }
 
+  ExecutionSession &getExecutionSession() { return *ES; }
+
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
@@ -94,7 +153,123 @@ public:
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  /// Add an object file compiled before, e.g. by this JIT.
+  Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj,
+                      ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return TransformLayer.add(RT, std::move(Obj));
+  }
+
+  /// The resource tracker to add a new definition of the function Name
+  /// with, whose module has to call it Name + BodySuffix. Name itself is a
+  /// stub jumping to the latest definition, so code linked before calls the
+  /// new one too. The definition it replaces is removed right away, the
+  /// stub is pointed at the new one once it's linked: by the next lookup
+  /// or linkDefinitions, no code calling Name may run before.
+  Expected<ResourceTrackerSP> redefine(StringRef Name) {
+    std::lock_guard<std::mutex> Lock(DefinitionsMutex);
+    auto [It, New] = Definitions.try_emplace(Name);
+    if (New) {
+      Error Err = Stubs->createStub(Name, NotLinked, JITSymbolFlags::Exported);
+      if (!Err)
+        Err = MainJD.define(
+            absoluteSymbols({{Mangle(Name), Stubs->findStub(Name, false)}}));
+      if (Err) {
+        Definitions.erase(It);
+        return Err;
+      }
+    }
+
+    Definition &Def = It->second;
+    if (Def.Current)
+      if (auto Err = Def.Current->remove())
+        return Err;
+    if (!Def.Pending)
+      Unlinked.push_back(Name.str());
+    Def.Pending = true;
+    Def.Current = MainJD.createResourceTracker();
+    return Def.Current;
+  }
+
+  /// Link the definitions added since this was last called, all at once.
+  /// One that fails to is removed again, calls of its function go to
+  /// NotLinked.
+  Error linkDefinitions() {
+    std::lock_guard<std::mutex> Lock(DefinitionsMutex);
+    if (Unlinked.empty())
+      return Error::success();
+    std::vector<std::string> Names = std::move(Unlinked);
+    Unlinked.clear();
+
+    SymbolLookupSet Bodies;
+    for (const std::string &Name : Names)
+      Bodies.add(Mangle(Name + BodySuffix.str()));
+    auto Linked =
+        ES->lookup(makeJITDylibSearchOrder(&MainJD), std::move(Bodies));
+
+    // The error is about the ones that failed, find out which ones did link
+    Error Err = Error::success();
+    SymbolMap Addresses;
+    if (Linked) {
+      Addresses = std::move(*Linked);
+    } else {
+      Err = Linked.takeError();
+      for (const std::string &Name : Names) {
+        auto Body = Mangle(Name + BodySuffix.str());
+        if (auto Sym = ES->lookup({&MainJD}, Body))
+          Addresses[Body] = *Sym;
+        else
+          consumeError(Sym.takeError());
+      }
+    }
+
+    for (const std::string &Name : Names) {
+      Definition &Def = Definitions[Name];
+      Def.Pending = false;
+      auto It = Addresses.find(Mangle(Name + BodySuffix.str()));
+      if (It != Addresses.end()) {
+        Err = joinErrors(std::move(Err),
+                         Stubs->updatePointer(Name, It->second.getAddress()));
+        continue;
+      }
+      Err = joinErrors(std::move(Err), Def.Current->remove());
+      Def.Current = nullptr;
+      Err = joinErrors(std::move(Err), Stubs->updatePointer(Name, NotLinked));
+    }
+    return Err;
+  }
+
+  MemoryUsage getMemoryUsage() {
+    std::lock_guard<std::mutex> Lock(DefinitionsMutex);
+    auto Slabs = Memory.getUsage();
+    MemoryUsage U = {Slabs.Code, Slabs.Data, Slabs.Slabs, 0, Unlinked.size()};
+    for (auto &Entry : Definitions)
+      U.Definitions += bool(Entry.second.Current);
+    return U;
+  }
+
+  /// Define Name as the absolute address Value.
+  Error defineAbsolute(StringRef Name, uint64_t Value,
+                       ResourceTrackerSP RT = nullptr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name),
+          {ExecutorAddr(Value),
+           JITSymbolFlags::Exported | JITSymbolFlags::Absolute}}}),
+        std::move(RT));
+  }
+
+  /// Pass every object file to Transform before it's linked (on the thread
+  /// linking it), the ones addObjectFile adds too.
+  void setObjectTransform(ObjectTransformLayer::TransformFunction Transform) {
+    TransformLayer.setTransform(std::move(Transform));
+  }
+
+  /// Look Name up, after linking the definitions that aren't (errors doing
+  /// that go to the session's error reporter).
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
+    if (auto Err = linkDefinitions())
+      ES->reportError(std::move(Err));
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
 };
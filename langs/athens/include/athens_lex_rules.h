@@ -19,6 +19,7 @@ public:
 
   bool emitNewlineToken() const override { return false; }
   bool emitIndentDedent() const override { return false; }
-  bool allowRationalLiteral() const override { return false; }
+  // every number in athens is a double, 0.05 has to lex as one token
+  bool allowRationalLiteral() const override { return true; }
 };
 } // namespace athens
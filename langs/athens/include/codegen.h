@@ -1,12 +1,182 @@
 #pragma once
 
-#include <map>
-
 #include "KaleidoscopeJIT.h"
+#include "parser.h"
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/StandardInstrumentations.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <optional>
+
+class ConstEvaluator;
+class ProfileData;
+
+/// InlineBodyMap - Bitcode of small, already optimized definitions by name.
+/// Every definition is its own module, so a later module only has a
+/// declaration of a function defined before it. Importing these bodies (as
+/// available_externally) lets the inliner see through calls to small helpers
+/// such as the runtime's operators.
+using InlineBodyMap = llvm::DenseMap<Symbol, llvm::SmallVector<char, 0>>;
+
+/// What CodeGen::emitInterpreterEntry appends to a function's name.
+inline constexpr llvm::StringLiteral InterpreterEntrySuffix = ".interp";
+
+/// A pure function's code gets the id of its memo table as the address of
+/// an absolute symbol, its name with this appended. The session defines it
+/// along with the function, so the same code can be linked again with
+/// another table.
+inline constexpr llvm::StringLiteral MemoTableSuffix = ".memo";
+
+/// VectorLibrary - Where the math functions of a vectorized loop go: the
+/// vector versions of a library (which has to be loaded into the process).
+/// libmvec is glibc's, for x86-64, SLEEF's GNU ABI build is for AArch64.
+enum class VectorLibrary { None, LibMVec, SLEEF };
+
+/// CodeGenOptions - How IR is generated and optimized.
+struct CodeGenOptions {
+  // Set all the fast-math flags on floating point instructions, so e.g.
+  // reductions can be reassociated (and vectorized)
+  bool FastMath = false;
+  // Count how often each function is entered and which way its branches go,
+  // for the profile (see profile.h)
+  bool InstrumentProfile = false;
+  VectorLibrary VecLib = VectorLibrary::None;
+};
+
+/// BranchKind - What in the source a conditional branch comes from, the
+/// kinds of a function's branches in order make up the hash that matches it
+/// with its profile.
+enum class BranchKind : uint8_t { If, LoopGuard, LoopLatch, And, Or };
+
+/// Whether calls of Proto (named Name) are generated as an LLVM intrinsic: it
+/// declares one of the C library's math functions, which have no side
+/// effects.
+bool isMathFunction(const PrototypeAST &Proto, llvm::StringRef Name);
+
+/// CodeGen - IR generation state for the module currently being built. Each
+/// athens::Session has its own, so nothing here is process-wide.
+struct CodeGen {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  // The current function's variables, indexed by the slots resolve() gave
+  // their bindings, and their types (see TypeInference). A variable is an
+  // alloca, or its SSA value if nothing assigns to it (for loop counters).
+  std::vector<llvm::Value *> Slots;
+  std::vector<ValueType> SlotTypes;
+
+  std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+  // Inliner, only run when bodies were imported
+  std::unique_ptr<llvm::ModulePassManager> TheMPM;
+  // Function attribute inference, run once the module is optimized
+  std::unique_ptr<llvm::ModulePassManager> TheAttrMPM;
+  std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+  std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+  std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+  std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+  std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+  std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+  // The host, for the cost models of the loop passes. Created once and kept
+  // across modules.
+  std::unique_ptr<llvm::TargetMachine> TM;
+
+  CodeGenOptions Opts;
+
+  // Folds calls of effect-free functions on constants if set, owned by the
+  // session and only read here
+  const ConstEvaluator *ConstEval = nullptr;
+  // The definition being generated, calls to it are never folded
+  Symbol CurrentFunction;
+
+  // Counts of an earlier run to optimize with (see profile.h), owned by the
+  // session and only read here
+  const ProfileData *Profile = nullptr;
+
+  /// ProfiledFunction - The branches of the function being generated, as
+  /// far as the profile is concerned.
+  struct ProfiledFunction {
+    llvm::Function *F = nullptr;
+    // InstrumentProfile: stands for its table of counters until the number
+    // of them is known
+    llvm::GlobalVariable *Counters = nullptr;
+    uint64_t Hash = 0;
+    unsigned NumCounters = 0;
+    // Each branch with the counter of its true edge, the next one counts the
+    // false edge
+    std::vector<std::pair<llvm::BranchInst *, unsigned>> Branches;
+  } Profiled;
+
+  // Prototypes of everything defined/declared so far, owned by the session.
+  // Only read here, so several CodeGens can share it across threads.
+  const FunctionProtoMap &FunctionProtos;
+  // The session's names, to spell out the symbols in the IR
+  const frontend::lex::SymbolTable &Symbols;
+  // Bodies of earlier definitions that may be inlined, owned by the session
+  // and only read here
+  const InlineBodyMap &InlineBodies;
+
+  CodeGen(const FunctionProtoMap &FunctionProtos,
+          const frontend::lex::SymbolTable &Symbols,
+          const InlineBodyMap &InlineBodies, CodeGenOptions Opts = {})
+      : Opts(Opts), FunctionProtos(FunctionProtos), Symbols(Symbols),
+        InlineBodies(InlineBodies) {}
+
+  /// Open a fresh context/module (with its pass and analysis managers) to
+  /// generate the next top-level item into.
+  void initializeModuleAndManagers(const llvm::DataLayout &DL);
+
+  /// Hand the finished module over (e.g. to the JIT),
+  /// initializeModuleAndManagers has to be called again before the next
+  /// codegen.
+  llvm::orc::ThreadSafeModule takeModule();
+
+  llvm::Function *getFunction(Symbol Name);
+
+  llvm::Type *getType(ValueType Ty);
+
+  /// Convert V (a double or an int) to To, doubles are truncated towards zero
+  /// on the way to int.
+  llvm::Value *convert(llvm::Value *V, llvm::Type *To);
+  llvm::Value *convert(llvm::Value *V, ValueType To) {
+    return convert(V, getType(To));
+  }
+
+  /// Whether V (a double or an int) is non-zero, as an i1.
+  llvm::Value *isTrue(llvm::Value *V, const llvm::Twine &Name);
+
+  /// Link the bodies (InlineBodies) of the functions the module calls in as
+  /// available_externally, and those of the functions they call. Returns
+  /// whether anything was imported.
+  bool importInlineBodies();
+
+  /// Bitcode of F's module if F is small enough to be worth inlining
+  /// elsewhere, call once F is optimized.
+  std::optional<llvm::SmallVector<char, 0>>
+  exportInlineBody(const llvm::Function &F) const;
+
+  /// Add F's entry point for the interpreter (see interp.h) to the module,
+  /// `void F.interp(ptr Args, ptr Result)`. It calls F with the arguments in
+  /// Args, 64 bits for a number and two words (data, length) for an array,
+  /// and stores what F returns to Result the same way.
+  llvm::Function *emitInterpreterEntry(llvm::Function &F);
+
+  /// Start on F's counters (counter 0 is how often it's entered), with the
+  /// builder at the start of its body.
+  void beginProfile(llvm::Function &F);
+
+  /// `br Cond, True, False` for a branch of kind K in the source, counted if
+  /// instrumenting.
+  llvm::BranchInst *createBranch(BranchKind K, llvm::Value *Cond,
+                                 llvm::BasicBlock *True,
+                                 llvm::BasicBlock *False);
+
+  /// The function is generated: give it its table of counters if
+  /// instrumenting, or its counts from the Profile. Call before optimizing
+  /// it, with Generated false if it failed.
+  void finishProfile(bool Generated);
 
-extern std::unique_ptr<llvm::LLVMContext> TheContext;
-extern std::unique_ptr<llvm::Module> TheModule;
-extern std::unique_ptr<llvm::IRBuilder<>> Builder;
-extern std::map<std::string, llvm::AllocaInst *> NamedValues;
+  llvm::StringRef name(Symbol S) const { return Symbols.str(S); }
+};
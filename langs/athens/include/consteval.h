@@ -0,0 +1,64 @@
+#pragma once
+
+#include "eval.h"
+#include "parser.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+/// ConstEvaluator - Evaluates expressions made of constants and calls of
+/// effect-free definitions at compile time, by walking their (typed) ASTs
+/// the way their IR would run. A top-level expression like `fib(10);` then
+/// never goes through the JIT, and a call like that inside a definition is
+/// replaced by its result.
+///
+/// Only definitions whose effects (see FunctionEffects) say they don't
+/// access memory are kept for it, with the ASTContext their body lives in.
+/// Anything whose value depends on more than the expression itself isn't
+/// evaluated: calls of externs or of definitions that weren't kept, arrays
+/// and parfor loops. Neither is anything the compiled code leaves undefined
+/// (converting a double that doesn't fit to an int), nor
+/// anything that takes more than Fuel steps or calls too deep. The caller
+/// falls back to generating code for those.
+class ConstEvaluator {
+public:
+  ConstEvaluator(const FunctionProtoMap &FunctionProtos, uint64_t Fuel)
+      : FunctionProtos(FunctionProtos), Fuel(Fuel) {}
+
+  /// A definition compiled: keep its body for calls to it if it's effect
+  /// free, drop the previous definition of its name otherwise. Call once its
+  /// prototype is in FunctionProtos. SlotTypes are the ones its codegen
+  /// inferred.
+  void define(const PrototypeAST &Proto, ExprAST *Body,
+              ArrayRef<ValueType> SlotTypes, std::shared_ptr<ASTContext> Ctx);
+
+  /// The value of TopLevel (resolved, not compiled yet) if it's a constant.
+  std::optional<EvalValue> evaluate(FunctionAST &TopLevel) const;
+
+  /// The value of E, an expression in the body of the function Self that
+  /// doesn't read any variables, if it's a constant. Calls of Self are never
+  /// evaluated, its body isn't compiled yet.
+  std::optional<EvalValue> evaluate(ExprAST *E, Symbol Self) const;
+
+private:
+  friend class Evaluation;
+
+  /// Definition - The kept body of a definition.
+  struct Definition {
+    // The prototype in FunctionProtos it was compiled with, it's stale once
+    // that's been replaced (by a redefinition or an extern)
+    const PrototypeAST *Proto;
+    ExprAST *Body;
+    std::vector<ValueType> SlotTypes;
+    std::shared_ptr<ASTContext> Ctx;
+  };
+
+  /// The current definition of Name, null if there's none to evaluate.
+  const Definition *lookup(Symbol Name) const;
+
+  const FunctionProtoMap &FunctionProtos;
+  DenseMap<Symbol, Definition> Definitions;
+  uint64_t Fuel;
+};
@@ -1,7 +1,34 @@
 #pragma once
 
+#include "../../../shared/frontend/parse/include/diagnostics.h"
+
+#include <string>
+
 namespace error {
 
 void logError(const char *Str);
 
-}
+/// Diagnostics - Parse errors reported through the shared frontend, printed
+/// like logError does but with the line:column they were found at.
+class Diagnostics final : public frontend::parse::IDiagnostics {
+public:
+  void error(const frontend::lex::SourceLoc &Loc,
+             std::string_view Message) override;
+};
+
+/// ErrorCapture - While one is alive, errors reported on the current thread
+/// (logError and Diagnostics) are appended to Out instead of going to stderr.
+/// Used to print errors of items compiled on worker threads in source order.
+class ErrorCapture {
+public:
+  explicit ErrorCapture(std::string &Out);
+  ~ErrorCapture();
+
+  ErrorCapture(const ErrorCapture &) = delete;
+  ErrorCapture &operator=(const ErrorCapture &) = delete;
+
+private:
+  std::string *Previous;
+};
+
+} // namespace error
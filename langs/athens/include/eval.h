@@ -0,0 +1,132 @@
+#pragma once
+
+#include "parser.h"
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <vector>
+
+class ConstEvaluator;
+class Interpreter;
+
+/// EvalValue - The value of an expression evaluated by walking its AST (see
+/// Evaluation), of the expression's type. Arrays are their elements and
+/// length, like the {ptr, i64} codegen passes around.
+struct EvalValue {
+  ValueType Ty;
+  union {
+    double D;
+    int64_t I;
+    struct {
+      double *Data;
+      int64_t Len;
+    } Arr;
+  };
+
+  static EvalValue ofDouble(double D) {
+    EvalValue V{ValueType::Double, {}};
+    V.D = D;
+    return V;
+  }
+  static EvalValue ofInt(int64_t I) {
+    EvalValue V{ValueType::Int, {}};
+    V.I = I;
+    return V;
+  }
+  static EvalValue ofArray(double *Data, int64_t Len) {
+    EvalValue V{ValueType::Array, {}};
+    V.Arr = {Data, Len};
+    return V;
+  }
+  /// What a variable of type Ty starts out as.
+  static EvalValue zero(ValueType Ty) {
+    switch (Ty) {
+    case ValueType::Int:
+      return ofInt(0);
+    case ValueType::Array:
+      return ofArray(nullptr, 0);
+    default:
+      return ofDouble(0);
+    }
+  }
+
+  double toDouble() const {
+    return Ty == ValueType::Int ? static_cast<double>(I) : D;
+  }
+};
+
+/// Evaluation - The state of one walk over (typed) ASTs, what
+/// ExprAST::evaluate works on. The walk does what the IR of the ASTs would,
+/// in one of two modes:
+///
+///  - Folding constants for a ConstEvaluator. Anything touching memory, or
+///    whose result the compiled code leaves undefined, stops it (None) and
+///    the caller generates code instead.
+///  - Interpreting for an Interpreter. Everything but parfor runs, with the
+///    results the compiled code gives on x86-64 (a double that doesn't fit
+///    converts to INT64_MIN). Calls go through the
+///    Interpreter, which may run them natively. It only stops (None) once
+///    an error has been reported.
+class Evaluation {
+public:
+  /// Fold constants in the body of Self, which is being compiled.
+  Evaluation(const ConstEvaluator &Consts, Symbol Self);
+  /// Interpret for Interp.
+  explicit Evaluation(Interpreter &Interp) : Interp(&Interp) {}
+
+  bool interpreting() const { return Interp; }
+
+  /// Spend one step, false once there's no fuel left (when folding).
+  bool step();
+
+  /// The variable in Slot of the function being evaluated, null if there's
+  /// no such variable (e.g. in an expression that can't read any). It always
+  /// holds a value of the slot's type.
+  EvalValue *slot(unsigned Slot);
+
+  /// V converted to To, like CodeGen::convert. None if it doesn't fit when
+  /// folding.
+  std::optional<EvalValue> convert(EvalValue V, ValueType To) const;
+
+  /// Whether V is non-zero, like CodeGen::isTrue.
+  static bool isTrue(EvalValue V);
+
+  /// Op on two ints, like BinaryExprAST::codegen: wrapping around on
+  /// overflow.
+  std::optional<EvalValue> intOp(BuiltinOp Op, int64_t L, int64_t R) const;
+
+  /// Whether Name is a function (or operator) the expression would call,
+  /// rather than a built-in operator.
+  bool isFunction(Symbol Name) const;
+
+  /// Call Callee with Args (in the order they were evaluated).
+  std::optional<EvalValue> call(Symbol Callee, ArrayRef<EvalValue> Args);
+
+  /// Evaluate Body in a frame of its own, with slots of SlotTypes. Args go
+  /// in the first ones (already converted), the rest start out as 0.
+  std::optional<EvalValue> run(ExprAST *Body, ArrayRef<ValueType> SlotTypes,
+                               ArrayRef<EvalValue> Args = {});
+
+  /// A loop in the function being run went around once more.
+  void iteration();
+
+  /// Whether a call from here would nest too deep for evaluating it, the
+  /// evaluator's own stack is much smaller than what it would use.
+  bool tooDeep() const { return Depth >= MaxCallDepth; }
+
+private:
+  static constexpr unsigned MaxCallDepth = 256;
+
+  const ConstEvaluator *Consts = nullptr;
+  Interpreter *Interp = nullptr;
+  Symbol Self;
+  uint64_t FuelLeft = 0;
+  unsigned Depth = 0;
+  // The variables of the function being evaluated
+  std::vector<EvalValue> *Slots = nullptr;
+  // Results of the calls folded so far, keyed on the callee and its
+  // arguments' bits. Kept bodies have no effects, calling one again gives
+  // the same.
+  std::map<std::vector<int64_t>, EvalValue> Calls;
+};
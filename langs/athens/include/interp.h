@@ -0,0 +1,112 @@
+#pragma once
+
+#include "eval.h"
+#include "parser.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+/// Interpreter - Tier 0 of a session: runs top-level expressions and
+/// definitions that haven't been compiled yet by walking their ASTs (see
+/// Evaluation), which takes microseconds where going through the JIT takes
+/// milliseconds.
+///
+/// A definition it can run is only type checked when it's read, and made
+/// known like a compiled one. It's compiled (promoted) once it's been called
+/// or its loops went around Threshold times, the calls after that run the
+/// compiled code. So do calls of externs and of everything compiled as it
+/// was read, through the entry points CodeGen::emitInterpreterEntry adds.
+/// An interpreted call that's already running stays interpreted.
+///
+/// Code calling a function that isn't compiled can't be compiled before it
+/// is, compileCallees has to be called before generating any.
+class Interpreter {
+public:
+  using NativeEntry = void (*)(const int64_t *Args, int64_t *Result);
+
+  /// Hooks - What the session does for the interpreter.
+  struct Hooks {
+    /// Compile a definition and add it to the JIT (compiling what it calls
+    /// first), false if it failed. The errors are reported.
+    std::function<bool(std::shared_ptr<FunctionAST> Fn,
+                       std::shared_ptr<ASTContext> Ctx)>
+        Compile;
+    /// The entry point of a compiled definition or of an extern, null if it
+    /// can't be found (reported).
+    std::function<NativeEntry(Symbol Name, bool Extern)> Entry;
+  };
+
+  /// Deferred definitions go into FunctionProtos. A Threshold of 0 turns the
+  /// interpreter off, everything is compiled as it's read.
+  Interpreter(FunctionProtoMap &FunctionProtos, uint64_t Threshold, Hooks H)
+      : FunctionProtos(FunctionProtos), Threshold(Threshold),
+        H(std::move(H)) {}
+
+  bool enabled() const { return Threshold; }
+
+  /// Whether Fn (resolved) can be run here: it has no parfor loops, nor any
+  /// loops if it's a TopLevel expression (those run once and wouldn't get
+  /// compiled), what it calls is known and it isn't a redefinition of a
+  /// compiled function. Compiling anything else reports its errors.
+  bool canInterpret(const FunctionAST &Fn, bool TopLevel) const;
+
+  /// Keep Fn to run it here until it's called often enough, false if it
+  /// doesn't type check (reported).
+  bool defer(std::unique_ptr<FunctionAST> Fn, std::shared_ptr<ASTContext> Ctx);
+
+  /// Name was compiled as it was read, or declared as an extern.
+  void compiled(Symbol Name);
+  void declared(Symbol Name);
+
+  /// Compile the deferred definitions Fn calls, false if one failed to.
+  bool compileCallees(const FunctionAST &Fn);
+
+  /// Compile every deferred definition, false if one failed to.
+  bool compileDeferred();
+
+  /// The value of the TopLevel expression (resolved, can be interpreted),
+  /// None if an error was reported.
+  std::optional<double> run(FunctionAST &TopLevel);
+
+  /* For Evaluation */
+
+  bool isFunction(Symbol Name) const { return FunctionProtos.count(Name); }
+  std::optional<EvalValue> call(Evaluation &E, Symbol Callee,
+                                ArrayRef<EvalValue> Args);
+  void iteration();
+
+private:
+  enum class State { Deferred, Compiling, Failed, Compiled, Extern };
+
+  /// FunctionInfo - What the interpreter knows about a function.
+  struct FunctionInfo {
+    FunctionInfo(State St = State::Deferred) : St(St) {}
+
+    State St;
+    // A deferred definition, the arena its body lives in and its slot types.
+    // Kept once it's compiled, calls that were running it still are.
+    std::shared_ptr<FunctionAST> Def;
+    std::shared_ptr<ASTContext> Ctx;
+    std::vector<ValueType> SlotTypes;
+    // Calls and loop iterations so far
+    uint64_t Count = 0;
+    // Compiled or Extern: once it's been looked up
+    NativeEntry Native = nullptr;
+  };
+
+  /// Compile the deferred Fn.
+  bool promote(FunctionInfo &Fn);
+  std::optional<EvalValue> callNative(Symbol Callee, FunctionInfo &Fn,
+                                      const PrototypeAST &Proto,
+                                      ArrayRef<EvalValue> Args);
+
+  FunctionProtoMap &FunctionProtos;
+  uint64_t Threshold;
+  Hooks H;
+  DenseMap<Symbol, FunctionInfo> Functions;
+  // The deferred definition being interpreted, invalid at the top level
+  Symbol Running;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/* Memory of JIT-linked code.
+ *
+ * Every definition is an object file of its own, most of them a function of
+ * a few dozen bytes. Giving each its own pages of code and data (and an
+ * mprotect for each) wastes most of every page and spreads the code over
+ * many of them. Instead the sections of all objects are packed into slabs
+ * shared by the whole JIT, and freed space in them is used again.
+ *
+ * Code and read-only data slabs are mapped twice: a writable view the
+ * linker writes sections to, and the view they run or are read from, which
+ * is never writable. So no permissions change once a slab is mapped.
+ * Slabs are placed in one reservation of address space, code can reach its
+ * data with 32 bit displacements.
+ *
+ * A fork shares the code and read-only slabs with its parent, so the child
+ * doesn't put anything in the ones mapped before the fork. The parent keeps
+ * using them: it waits for the child (see watch), or doesn't compile
+ * anymore (see serve).
+ */
+
+namespace athens {
+
+/// SlabAllocator - Allocates memory for the sections of JIT-linked objects
+/// from shared slabs. Thread safe.
+class SlabAllocator {
+public:
+  enum class Kind { Code, ReadOnly, ReadWrite };
+  static constexpr unsigned NumKinds = 3;
+
+  /// Block - A section's memory.
+  struct Block {
+    // Where it's written, null if no memory was left
+    uint8_t *Addr = nullptr;
+    // Where it's run or read from
+    uint64_t TargetAddress = 0;
+    size_t Size = 0;
+    Kind K = Kind::ReadWrite;
+  };
+
+  /// Usage - Bytes in blocks, and in slabs.
+  struct Usage {
+    uint64_t Code = 0, Data = 0, Slabs = 0;
+  };
+
+  SlabAllocator();
+  ~SlabAllocator();
+  SlabAllocator(const SlabAllocator &) = delete;
+  SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+  Block allocate(Kind K, size_t Size, unsigned Alignment);
+  void release(const Block &B);
+  Usage getUsage();
+
+private:
+  struct Slab {
+    uint8_t *Addr;
+    uint8_t *Target;
+    size_t Size;
+    // Everything from here on is free
+    size_t Used = 0;
+    // Free ranges before Used, by offset
+    std::map<size_t, size_t> Free;
+    // The fork generation it was mapped in
+    unsigned Generation;
+  };
+
+  bool mapSlab(Kind K, size_t Size);
+  Block take(Slab &S, Kind K, size_t Offset, size_t Size);
+
+  std::mutex Mutex;
+  std::vector<Slab> Slabs[NumKinds];
+  // The address space slabs are placed in, and how much of it is taken
+  uint8_t *Reserved = nullptr;
+  size_t ReservedUsed = 0;
+  uint64_t Live[NumKinds] = {};
+};
+
+/// SlabMemoryManager - The memory manager of one object linked by
+/// RuntimeDyld, which frees its sections when it's destroyed.
+class SlabMemoryManager : public llvm::RTDyldMemoryManager {
+public:
+  explicit SlabMemoryManager(SlabAllocator &Slabs) : Slabs(Slabs) {}
+  ~SlabMemoryManager() override;
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               llvm::StringRef SectionName) override;
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, llvm::StringRef SectionName,
+                               bool IsReadOnly) override;
+
+  using RTDyldMemoryManager::notifyObjectLoaded;
+  void notifyObjectLoaded(llvm::RuntimeDyld &RTDyld,
+                          const llvm::object::ObjectFile &Obj) override;
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override;
+
+  void registerEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                        size_t Size) override;
+  void deregisterEHFrames() override;
+
+private:
+  uint8_t *allocate(SlabAllocator::Kind K, uintptr_t Size, unsigned Alignment);
+
+  SlabAllocator &Slabs;
+  std::vector<SlabAllocator::Block> Blocks;
+  struct EHFrame {
+    uint8_t *Addr;
+    size_t Size;
+  };
+  std::vector<EHFrame> EHFrames;
+};
+
+} // namespace athens
@@ -1,176 +1,571 @@
 
-#include "lexer.h"
+#pragma once
+
+#include "../../../shared/frontend/parse/include/parser_engine.h"
+#include "../../../shared/frontend/lex/include/symbol_table.h"
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/Casting.h>
 
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 using namespace llvm;
+using frontend::lex::Symbol;
+
+struct CodeGen;
+class Resolver;
+class TypeInference;
+class Evaluation;
+struct EvalValue;
+
+/// ValueType - The types an Athens value can have. Values are doubles unless
+/// declared (parameters and returns) or inferred (see typecheck.h) to be ints,
+/// which are 64 bit and signed. Arrays (of doubles) are created by array(n)
+/// and are passed around by reference.
+enum class ValueType : unsigned char { Double, Int, Array };
+
+namespace llvm {
+class StructType;
+
+template <> struct DenseMapInfo<Symbol> {
+  static Symbol getEmptyKey() { return Symbol(~0u); }
+  static Symbol getTombstoneKey() { return Symbol(~0u - 1); }
+  static unsigned getHashValue(Symbol S) {
+    return DenseMapInfo<uint32_t>::getHashValue(S.id());
+  }
+  static bool isEqual(Symbol LHS, Symbol RHS) { return LHS == RHS; }
+};
+} // namespace llvm
+
+/// ASTContext - Owns every expression node of one compilation unit (a single
+/// top-level item). Nodes are bump-allocated and trivially destructible, names
+/// are Symbols and child lists are arena-backed spans, so the whole tree goes
+/// away in one step when the context is destroyed (right after codegen).
+class ASTContext {
+  BumpPtrAllocator Alloc;
+
+public:
+  ASTContext() = default;
+  ASTContext(const ASTContext &) = delete;
+  ASTContext &operator=(const ASTContext &) = delete;
+
+  template <typename T, typename... ArgTs> T *create(ArgTs &&...Args) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "arena nodes are never destroyed individually");
+    return new (Alloc.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+  }
+
+  /// Copy a (temporary) child list into the arena.
+  template <typename T> MutableArrayRef<T> copyArray(ArrayRef<T> Elts) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    if (Elts.empty())
+      return {};
+    T *Mem = Alloc.Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return MutableArrayRef<T>(Mem, Elts.size());
+  }
+};
 
 /// ExprAST - Base class for all expression nodes.
+/// There's no vtable, nodes carry a kind tag instead so we can use LLVM-style
+/// isa<>/cast<>/dyn_cast<> on them (LLVM builds without RTTI by default) and
+/// resolve()/codegen() dispatch with a switch.
+///
+/// Variables are referred to by slot: resolve() (see resolve.h) gives every
+/// binding of a function its own slot number and points each reference at the
+/// binding it sees, codegen only indexes CodeGen::Slots with them. infer()
+/// (see typecheck.h) then leaves every node's type on it, which evaluate()
+/// (see eval.h) relies on too.
 class ExprAST {
 public:
-  virtual ~ExprAST() = default;
+  enum ExprKind {
+    EK_Number,
+    EK_Variable,
+    EK_Var,
+    EK_Binary,
+    EK_Unary,
+    EK_If,
+    EK_For,
+    EK_Parfor,
+    EK_Call,
+    EK_Array,
+    EK_Index,
+    EK_Length,
+  };
+
+private:
+  const ExprKind Kind;
+  ValueType Ty = ValueType::Double;
 
-  virtual Value *codegen() = 0;
+protected:
+  ExprAST(ExprKind Kind) : Kind(Kind) {}
+
+public:
+  ExprKind getKind() const { return Kind; }
+  ValueType getType() const { return Ty; }
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
 };
 
-/// NumberExprAST - Expression class for numeric literals like "1.0".
+/// NumberExprAST - Expression class for numeric literals like "1.0" (a double)
+/// or "1" (an int).
 class NumberExprAST : public ExprAST {
-  double Val;
+  double Val = 0;
+  int64_t IntVal = 0;
+  bool IsInt;
 
 public:
-  NumberExprAST(double Val) : Val(Val) {}
+  NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val), IsInt(false) {}
+  NumberExprAST(int64_t IntVal)
+      : ExprAST(EK_Number), IntVal(IntVal), IsInt(true) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
 
-  Value *codegen() override;
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  Symbol Name;
+  unsigned Slot = 0;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(Symbol Name) : ExprAST(EK_Variable), Name(Name) {}
 
-  Value *codegen() override;
-  const std::string &getName() const { return Name; }
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
+  Symbol getName() const { return Name; }
+  unsigned getSlot() const { return Slot; }
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
+};
+
+/// VarBinding - One `name (= init)?` entry of a var/in, Init may be null.
+struct VarBinding {
+  Symbol Name;
+  ExprAST *Init;
+  unsigned Slot = 0;
 };
 
 // VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-  std::unique_ptr<ExprAST> Body;
+  MutableArrayRef<VarBinding> VarNames;
+  ExprAST *Body;
 
 public:
-  VarExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+  VarExprAST(MutableArrayRef<VarBinding> VarNames, ExprAST *Body)
+      : ExprAST(EK_Var), VarNames(VarNames), Body(Body) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
 
-  Value *codegen() override;
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
 };
 
-/// BinaryExprAST - Expression class for a binary operator.
+/// BuiltinOp - Operators codegen lowers to instructions itself. Defining one
+/// (e.g. `def binary> ...`) overloads it, uses then call the definition.
+enum class BuiltinOp : unsigned char {
+  None, // user-defined, always a call
+  Assign,
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Less,
+  Greater,
+  LessEqual,
+  GreaterEqual,
+  Equal,
+  NotEqual,
+  And, // short circuits
+  Or,  // short circuits
+  Not,
+  Seq, // a : b evaluates a, then b and gives b
+};
+
+/// BinaryExprAST - Expression class for a binary operator. OpFn is the
+/// function ("binary<op>") the operator calls if it isn't built in or has
+/// been overloaded.
 class BinaryExprAST : public ExprAST {
-  char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  BuiltinOp Op;
+  Symbol OpFn;
+  ExprAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  BinaryExprAST(BuiltinOp Op, Symbol OpFn, ExprAST *LHS, ExprAST *RHS)
+      : ExprAST(EK_Binary), Op(Op), OpFn(OpFn), LHS(LHS), RHS(RHS) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
 
-  Value *codegen() override;
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
 
 private:
-  Value *handleAssignment();
+  Value *handleAssignment(CodeGen &CG);
+  Value *codegenShortCircuit(CodeGen &CG);
 };
 
+/// UnaryExprAST - Expression class for a unary operator, only '!' is built
+/// in. OpFn is the ("unary<op>") function it calls otherwise.
 class UnaryExprAST : public ExprAST {
-  char Op;
-  std::unique_ptr<ExprAST> Operand;
+  BuiltinOp Op;
+  Symbol OpFn;
+  ExprAST *Operand;
 
 public:
-  UnaryExprAST(char Op, std::unique_ptr<ExprAST> Operand)
-      : Op(Op), Operand(std::move(Operand)) {}
+  UnaryExprAST(BuiltinOp Op, Symbol OpFn, ExprAST *Operand)
+      : ExprAST(EK_Unary), Op(Op), OpFn(OpFn), Operand(Operand) {}
 
-  Value *codegen() override;
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Unary; }
 };
 
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Cond, Then, Else;
+  ExprAST *Cond, *Then, *Else;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : ExprAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
 
-  Value *codegen() override;
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
 };
 
+/// ForExprAST - `for i = start, cond, step in body`, like C's for loop the
+/// condition is checked before every iteration (including the first).
 class ForExprAST : public ExprAST {
-  std::string VarName;
-  std::unique_ptr<ExprAST> Start, End, Step, Body;
+  Symbol VarName;
+  unsigned Slot = 0;
+  // Assigned to (in the body, condition or step), set by resolve()
+  bool VarAssigned = true;
+  ExprAST *Start, *End, *Step, *Body;
 
 public:
-  ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-             std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+  ForExprAST(Symbol VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+             ExprAST *Body)
+      : ExprAST(EK_For), VarName(VarName), Start(Start), End(End), Step(Step),
+        Body(Body) {}
 
-  Value *codegen() override;
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+};
+
+/// ParforExprAST - `parfor i = start, end (, op)? in body` runs body for every
+/// (int) i in [start, end), spread over the runtime's thread pool. The body is
+/// outlined into a function of its own: it gets the values the enclosing
+/// variables it reads (Captures) have when the loop starts, and can't assign
+/// them. With a reduction operator ('+' or '*') the parfor gives the sum (or
+/// product) of all the bodies' values, otherwise 0.
+class ParforExprAST : public ExprAST {
+  Symbol VarName;
+  unsigned Slot = 0;
+  BuiltinOp Reduce; // None, Add or Mul
+  ExprAST *Start, *End, *Body;
+  // Slots of the variables from outside the body it reads, set by resolve()
+  ArrayRef<unsigned> Captures;
+
+public:
+  ParforExprAST(Symbol VarName, ExprAST *Start, ExprAST *End,
+                BuiltinOp Reduce, ExprAST *Body)
+      : ExprAST(EK_Parfor), VarName(VarName), Reduce(Reduce), Start(Start),
+        End(End), Body(Body) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Parfor; }
+
+private:
+  Function *codegenBody(CodeGen &CG, StructType *EnvTy);
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  Symbol Callee;
+  ArrayRef<ExprAST *> Args;
+
+public:
+  CallExprAST(Symbol Callee, ArrayRef<ExprAST *> Args)
+      : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+/// ArrayExprAST - `array(n)`, a new array of n doubles, all 0.
+class ArrayExprAST : public ExprAST {
+  ExprAST *Size;
+
+public:
+  ArrayExprAST(ExprAST *Size) : ExprAST(EK_Array), Size(Size) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Array; }
+};
+
+/// IndexExprAST - `a[i]`, an element of the array in variable a. Either read,
+/// or assigned to as the lhs of '='. Indices are checked against the length.
+class IndexExprAST : public ExprAST {
+  VariableExprAST *Array;
+  ExprAST *Index;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
+  IndexExprAST(VariableExprAST *Array, ExprAST *Index)
+      : ExprAST(EK_Index), Array(Array), Index(Index) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
 
-  Value *codegen() override;
+  /// Address of the element, once the index is checked.
+  Value *codegenAddress(CodeGen &CG);
+  double *evaluateAddress(Evaluation &CE);
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
+};
+
+/// LengthExprAST - `len(a)`, the number of elements of an array (an int).
+class LengthExprAST : public ExprAST {
+  ExprAST *Array;
+
+public:
+  LengthExprAST(ExprAST *Array) : ExprAST(EK_Length), Array(Array) {}
+
+  bool resolve(Resolver &R);
+  ValueType infer(TypeInference &TI);
+  std::optional<EvalValue> evaluate(Evaluation &CE);
+  Value *codegen(CodeGen &CG);
+
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Length; }
+};
+
+/// FunctionEffects - What's known about what a call to a function can do
+/// besides giving its result. Definitions have theirs inferred once they're
+/// compiled (see FunctionAST::codegen), externs can do anything unless
+/// they're declared pure. Later modules get them as attributes on the
+/// function's declaration, so calls can be CSE'd, hoisted or deleted.
+struct FunctionEffects {
+  bool DoesNotAccessMemory = false; // memory(none)
+  bool OnlyReadsMemory = false;     // memory(read)
+  bool DoesNotThrow = false;        // nounwind
+  bool WillReturn = false;          // willreturn
+  bool Speculatable = false;        // speculatable
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
+/// of arguments the function takes) and the argument and return types.
+/// Prototypes outlive their compilation unit (they end up in FunctionProtos),
+/// so unlike expression nodes they're not arena allocated.
 class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
-  bool IsOperator;
+  Symbol Name;
+  std::vector<Symbol> Args;
+  std::vector<ValueType> ArgTypes; // one per argument
+  ValueType RetType;
+  // @ for binary@, == for binary==, etc. Empty if not an operator
+  std::string OperatorName;
   unsigned Precedence; // precedence if it's a binary_ op (unary don't need for
                        // obvious reasons)
+  // Declared `pure`: it only depends on its arguments and only calls pure
+  // functions, so its results can be memoized
+  bool Pure;
+  // Declared with `extern`, it's defined somewhere in the process (e.g. the C
+  // library's sin)
+  bool Extern = false;
+  // The runtime's memo table for a pure definition, set by its codegen
+  int64_t MemoTable = -1;
+  FunctionEffects Effects;
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0)
-      : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec) {}
+  PrototypeAST(Symbol Name, std::vector<Symbol> Args,
+               std::vector<ValueType> ArgTypes,
+               ValueType RetType = ValueType::Double,
+               std::string OperatorName = {}, unsigned Prec = 0,
+               bool Pure = false)
+      : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)),
+        RetType(RetType), OperatorName(std::move(OperatorName)),
+        Precedence(Prec), Pure(Pure) {
+    assert(this->Args.size() == this->ArgTypes.size());
+  }
 
-  Function *codegen();
-  const std::string &getName() const { return Name; }
+  Function *codegen(CodeGen &CG);
+  Symbol getName() const { return Name; }
+  ArrayRef<Symbol> getArgs() const { return Args; }
+  ArrayRef<ValueType> getArgTypes() const { return ArgTypes; }
+  ValueType getReturnType() const { return RetType; }
 
-  bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
-  bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
+  bool isUnaryOp() const { return !OperatorName.empty() && Args.size() == 1; }
+  bool isBinaryOp() const { return !OperatorName.empty() && Args.size() == 2; }
 
-  char getOperatorName() const {
+  StringRef getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return Name[Name.size() - 1]; // binary@, unary^, etc.
+    return OperatorName;
   }
 
   unsigned getBinaryPrecedence() const { return Precedence; }
+
+  bool isPure() const { return Pure; }
+  bool isExtern() const { return Extern; }
+  void setExtern() { Extern = true; }
+  int64_t getMemoTable() const { return MemoTable; }
+  void setMemoTable(int64_t Id) { MemoTable = Id; }
+
+  const FunctionEffects &getEffects() const { return Effects; }
+  void setEffects(const FunctionEffects &E) { Effects = E; }
+};
+
+/// CalleeRef - A function a definition's body calls, and with how many
+/// arguments. Overloadable ones are the functions of built-in operators,
+/// they're only called if they're defined.
+struct CalleeRef {
+  Symbol Name;
+  unsigned NumArgs;
+  bool Overloadable;
 };
 
 /// FunctionAST - This class represents a function definition itself.
+/// The Body lives in the ASTContext the definition was parsed into.
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
+  ExprAST *Body;
+  // Slots the arguments and every var/for binding need, set by resolve()
+  unsigned NumSlots = 0;
+  bool Resolved = false;
+  // What the body calls (each function once) and whether it has for or
+  // parfor loops, set by resolve()
+  ArrayRef<CalleeRef> Callees;
+  bool HasLoops = false;
+  bool HasParfor = false;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body)
+      : Proto(std::move(Proto)), Body(Body) {}
+
+  const PrototypeAST &getProto() const { return *Proto; }
+  ExprAST *getBody() const { return Body; }
+  unsigned getNumSlots() const { return NumSlots; }
+  ArrayRef<CalleeRef> getCallees() const { return Callees; }
+  bool hasLoops() const { return HasLoops; }
+  bool hasParfor() const { return HasParfor; }
+
+  /// Resolve all the variable references in the body, has to succeed before
+  /// codegen.
+  bool resolve(Resolver &R);
+
+  /// Doesn't register the prototype anywhere, so the FunctionProtos table is
+  /// only read while generating code.
+  Function *codegen(CodeGen &CG);
+};
 
-  Function *codegen();
+using FunctionProtoMap = DenseMap<Symbol, std::unique_ptr<PrototypeAST>>;
+
+namespace athens {
+
+/// ASTBuilder - The BuilderT the shared ParserEngine is instantiated with.
+/// Athens has no statements, everything (including top-level items) is an
+/// expression. Ctx is pointed at the current top-level item's arena, names
+/// are interned into the session's Symbols.
+struct ASTBuilder {
+  using Expr = ExprAST *;
+  using Stmt = ExprAST *;
+  using Item = ExprAST *;
+
+  ASTContext *Ctx = nullptr;
+  frontend::lex::SymbolTable *Symbols = nullptr;
 };
 
-// CurTok/getNextToken - provide a simple token buffer. Curtok is the current
-// token the parser is looking at. getNextToken reads another token from the
-// lexer and updates CurTok with its results.
-extern Token CurTok;
-// This CurTok is like in the tetris game you'd see the next piece that's
-// coming. Parser can look ahead.
-Token getNextToken();
+using ParserRegistry = frontend::parse::ParserRegistry<ASTBuilder>;
+
+// Precedence of the built-in binary operators, 1 is the lowest.
+// User-defined binary operators default to DefaultBinaryPrecedence.
+constexpr int DefaultBinaryPrecedence = 30;
+
+/// Registers the Athens expression grammar (primaries, if/for/var, unary
+/// operators and the built-in binary operators) in R.
+void registerAthensGrammar(ParserRegistry &R);
+
+/// Installs (or re-installs with a new precedence) a binary operator, this is
+/// what a `def binary<op> <prec>` does to the grammar.
+void installBinaryOperator(ParserRegistry &R, std::string_view Op,
+                           int Precedence);
+void removeBinaryOperator(ParserRegistry &R, std::string_view Op);
+
+/// Installs every binary operator a lexed program defines (`def binary<op>`
+/// prototypes) up front, so its items can be parsed in any order. Malformed
+/// prototypes are skipped here, parsing them reports the error.
+void installBinaryOperators(ParserRegistry &R,
+                            std::span<const frontend::lex::Token> Tokens);
+
+/// Parser - Top-level Athens parser. Expressions go through the shared
+/// frontend::parse::ParserEngine, so precedences live in the (per session)
+/// ParserRegistry instead of a global table. The tokens have to come from a
+/// Lexer interning identifiers into Symbols.
+class Parser {
+public:
+  Parser(frontend::parse::TokenStream &Tokens, const ParserRegistry &Registry,
+         frontend::lex::SymbolTable &Symbols,
+         frontend::parse::IDiagnostics &Diag);
+
+  frontend::parse::TokenStream &tokens() { return Tokens; }
+
+  std::unique_ptr<FunctionAST> parseDefinition(ASTContext &Ctx);
+  std::unique_ptr<FunctionAST> parseTopLevelExpr(ASTContext &Ctx);
+  std::unique_ptr<PrototypeAST> parseExtern();
 
-// BinopPrecedence
-extern std::map<char, int> BinopPrecedence;
+private:
+  std::unique_ptr<PrototypeAST> parsePrototype();
 
-std::unique_ptr<FunctionAST> ParseDefinition();
-std::unique_ptr<FunctionAST> ParseTopLevelExpr();
-std::unique_ptr<PrototypeAST> ParseExtern();
+  frontend::parse::TokenStream &Tokens;
+  frontend::parse::IDiagnostics &Diag;
+  ASTBuilder Builder;
+  frontend::parse::ParseContext<ASTBuilder> PCtx;
+  frontend::parse::ParserEngine<ASTBuilder> Engine;
+};
 
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+} // namespace athens
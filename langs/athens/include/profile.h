@@ -0,0 +1,70 @@
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/ProfileSummary.h>
+#include <llvm/Support/Error.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Profile-guided optimization.
+ *
+ * Code generated with CodeGenOptions::InstrumentProfile counts, per
+ * function, how often it was entered and which way each of the conditional
+ * branches its source has went (an if, the guard and the latch of a for
+ * loop, && and ||). The counters are written to a profile when the process
+ * exits. Code generated with the ProfileData read back from one gets those
+ * counts as entry counts and branch weights, the module a summary of them
+ * and the functions that are hot or cold an attribute saying so. That's
+ * what block placement (hot paths first, cold code at the end) and the
+ * inliner go by.
+ *
+ * A profile is a text file with a line per function:
+ *
+ *   <name> <hash> <number of counters> <entry count> <true> <false>...
+ *
+ * The hash is over the kinds of the function's branches in the order
+ * they're generated. A function whose code changed since the profile was
+ * written doesn't match its line and is compiled without counts.
+ */
+
+/// Zeroed counters of a function Name being generated with instrumentation,
+/// the generated code increments them in place. They're never freed, so
+/// their counts make it into the profile even if the function was replaced.
+uint64_t *newProfileCounters(llvm::StringRef Name, uint64_t Hash,
+                             size_t NumCounters);
+
+/// Write the counters to the profile at Path when the process exits (also on
+/// an exit() or quick_exit() in generated code), the counts of functions with
+/// the same name and code added up. Process-wide, the last path set wins.
+void writeProfileAtExit(std::string Path);
+
+/// ProfileData - The profile of an earlier run, read back to optimize with.
+class ProfileData {
+public:
+  static llvm::Expected<std::unique_ptr<ProfileData>>
+  read(const std::string &Path);
+
+  /// The counts of the function Name if the profile has them for code with
+  /// this Hash and number of counters, empty otherwise.
+  llvm::ArrayRef<uint64_t> lookup(llvm::StringRef Name, uint64_t Hash,
+                                  size_t NumCounters) const;
+
+  /// The summary of all the counts, for a module's ProfileSummary.
+  llvm::Metadata *getSummaryMD(llvm::LLVMContext &Ctx) const {
+    return Summary->getMD(Ctx);
+  }
+
+private:
+  struct Record {
+    uint64_t Hash;
+    std::vector<uint64_t> Counts;
+  };
+
+  llvm::StringMap<std::vector<Record>> Functions;
+  std::unique_ptr<llvm::ProfileSummary> Summary;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "parser.h"
+
+#include <llvm/ADT/SmallBitVector.h>
+#include <llvm/ADT/SmallVector.h>
+
+#include <optional>
+
+/// Resolver - Name resolution for one function, run between parsing and
+/// codegen. Every binding (argument, var/in name, for variable) gets its own
+/// slot, numbered densely from 0 per function, and every variable reference
+/// gets the slot of the binding it sees. Shadowing is just a later binding
+/// with a new slot, so codegen never has to save/restore anything.
+///
+/// References to unknown variables (and assignments to something that isn't
+/// a variable or an array element) are reported here, before any IR is built.
+///
+/// It also notes what the function calls and whether it loops, for the
+/// interpreter (see interp.h) to decide whether it can run it.
+///
+/// Ctx is the arena of the function being resolved, results that need memory
+/// (the captures of a parfor body, the callees) go there.
+class Resolver {
+public:
+  Resolver(const frontend::lex::SymbolTable &Symbols, ASTContext &Ctx)
+      : Symbols(Symbols), Ctx(Ctx) {}
+
+  /// Bring Name into scope with a fresh slot.
+  unsigned bind(Symbol Name);
+  /// Drop the N innermost bindings.
+  void unbind(unsigned N) { Scope.resize(Scope.size() - N); }
+  /// Slot of the innermost binding of Name, if any.
+  std::optional<unsigned> lookup(Symbol Name) const;
+
+  unsigned getNumSlots() const { return NumSlots; }
+
+  /// Slot is the lhs of an assignment.
+  void assign(unsigned Slot);
+  bool isAssigned(unsigned Slot) const {
+    return Slot < Assigned.size() && Assigned[Slot];
+  }
+
+  /// A variable reference resolved to Slot.
+  void reference(unsigned Slot);
+
+  /// The body of a parfor whose counter has slot Counter is resolved between
+  /// these. Every slot before the counter is outside the body, exitParfor
+  /// returns the ones the body referenced.
+  void enterParfor(unsigned Counter);
+  ArrayRef<unsigned> exitParfor();
+
+  /// Slot belongs to the enclosing function (or is the counter) of the parfor
+  /// body being resolved, so all its iterations share it.
+  bool isShared(unsigned Slot) const {
+    return !Parfors.empty() && Slot <= Parfors.back().Counter;
+  }
+
+  /// The function calls Name with NumArgs arguments, see CalleeRef.
+  void call(Symbol Name, unsigned NumArgs, bool Overloadable);
+  /// The callees so far, copied to the arena.
+  ArrayRef<CalleeRef> getCallees();
+
+  /// The function has a for loop, or a parfor if Parallel.
+  void loop(bool Parallel) { (Parallel ? HasParfor : HasLoops) = true; }
+  bool hasLoops() const { return HasLoops; }
+  bool hasParfor() const { return HasParfor; }
+
+  bool error(const char *Msg, Symbol Name);
+  bool error(const char *Msg);
+
+private:
+  struct ParforScope {
+    unsigned Counter;
+    SmallVector<unsigned, 8> Captures;
+  };
+
+  const frontend::lex::SymbolTable &Symbols;
+  ASTContext &Ctx;
+  // Innermost binding last. Scopes are shallow, so looking up by scanning
+  // back beats hashing.
+  SmallVector<std::pair<Symbol, unsigned>, 16> Scope;
+  unsigned NumSlots = 0;
+  SmallBitVector Assigned;
+  // Innermost parfor last
+  SmallVector<ParforScope, 2> Parfors;
+  SmallVector<CalleeRef, 8> Callees;
+  bool HasLoops = false;
+  bool HasParfor = false;
+};
@@ -1,14 +1,132 @@
+#pragma once
+
 #ifdef _WIN32
 #define DLLEXPORT __ddeclspec(dllexport)
 #else
 #define DLLEXPORT
 #endif
 
+#include <cstdint>
 #include <iostream>
+#include <string>
 
 /* Some library functions that can be "extern"ed form user code.
  *
+ * Output goes to stdout (or the file descriptor set by athens_set_output_fd)
+ * through a buffer per thread, it's written out when the buffer fills up, on
+ * flush() and when the thread (or the program) exits. Sessions flush after
+ * every top-level expression.
  * */
 
 extern "C" DLLEXPORT double putchard(double X);
+/// X in the shortest form that reads back the same, and a newline.
 extern "C" DLLEXPORT double printd(double X);
+/// The elements of an array as characters, `extern printstr(s: array)`.
+/// Arrays are passed as their data pointer and length.
+extern "C" DLLEXPORT double printstr(const double *Chars, int64_t Length);
+/// Write out what this thread printed so far.
+extern "C" DLLEXPORT double flush();
+extern "C" DLLEXPORT void athens_set_output_fd(int Fd);
+
+/// AthensCapture - What a thread printed while capturing, and what to do
+/// about a runtime error instead of exiting. Sessions run top-level
+/// expressions concurrently like this and report both in source order.
+struct AthensCapture {
+  std::string Output;
+  /// Called with the error's message, mustn't return.
+  void (*Fatal)(AthensCapture &Capture, const char *Message);
+};
+
+/// Capture what the calling thread prints (and its runtime errors) in
+/// *Capture instead of writing it out, until it's called with null.
+extern "C" DLLEXPORT void athens_capture_output(AthensCapture *Capture);
+/// Print Size bytes at Data, as if the program printed them.
+extern "C" DLLEXPORT void athens_print(const char *Data, int64_t Size);
+/// Report a runtime error with Message and exit, after what this thread
+/// printed before it.
+extern "C" [[noreturn]] DLLEXPORT void athens_fatal(const char *Message);
+/// Like athens_fatal, but with quick_exit: for when other threads may still
+/// be running generated code, which static destructors would pull the
+/// runtime out from under.
+extern "C" [[noreturn]] DLLEXPORT void athens_fatal_now(const char *Message);
+/// Where calls of a function whose definition failed to link end up, reports
+/// that as a runtime error.
+extern "C" [[noreturn]] DLLEXPORT void athens_not_linked();
+
+/* Array support, called by generated code only.
+ *
+ * Array elements live in a per-thread arena and are never freed one by one.
+ * A function that creates arrays (and doesn't return one) takes a mark on
+ * entry and releases everything allocated after it when it returns. Top-level
+ * expressions return numbers, so all arrays are gone once one finishes.
+ * */
+
+/// N zeroed doubles, reports an error and exits if N is negative (or too
+/// big).
+extern "C" DLLEXPORT double *athens_array_new(int64_t N);
+extern "C" DLLEXPORT int64_t athens_arena_mark();
+/// Free everything allocated since Mark was taken.
+extern "C" DLLEXPORT void athens_arena_release(int64_t Mark);
+/// Reports an out of bounds index and exits.
+extern "C" [[noreturn]] DLLEXPORT void athens_bounds_fail(int64_t Index,
+                                                          int64_t Length);
+
+/* Parallel loops, called by generated code for parfor.
+ *
+ * The iterations are cut into chunks which a process-wide pool of threads
+ * (the calling one included) runs, idle threads steal half of the chunks
+ * another one has left. Output printed by the bodies is buffered per chunk
+ * and written in iteration order once the loop is done, and the chunks'
+ * values are combined in order too, so a parfor prints and gives the same
+ * thing on any number of threads. A parfor started while the pool is busy
+ * (from a body, or another session's thread) runs on the calling thread.
+ * */
+
+/// How athens_parfor combines the values the chunks give.
+enum AthensReduction : int64_t { AthensNoReduction, AthensSum, AthensProduct };
+
+/// Body(Env, Begin, End) runs the iterations [Begin, End) and gives their
+/// sum or product (0 without a reduction). Gives the reduction of every
+/// iteration in [Start, End).
+extern "C" DLLEXPORT double athens_parfor(double (*Body)(void *, int64_t,
+                                                         int64_t),
+                                          void *Env, int64_t Start,
+                                          int64_t End, int64_t Reduce);
+/// Size of the pool parfors run on, 0 means one thread per core.
+extern "C" DLLEXPORT void athens_set_threads(int64_t N);
+
+/* Memo tables of pure functions, called by generated code.
+ *
+ * A pure function looks the bit patterns of its arguments up on entry and
+ * returns the stored result if it finds them, otherwise it stores its result
+ * before returning. Every thread has tables of its own, so parfor bodies
+ * don't contend for them. A table grows up to its capacity, then the
+ * eviction policy decides what happens to new results.
+ * */
+
+enum AthensMemoEviction : int64_t {
+  AthensEvictReplace, // Overwrite an entry where the new one belongs
+  AthensEvictClear,   // Start over with an empty table
+  AthensEvictKeep     // Stop storing results
+};
+
+/// A table for a pure function with NumArgs arguments, gives its id.
+extern "C" DLLEXPORT int64_t athens_memo_new(int64_t NumArgs);
+/// If Key is in Table, 1 with its result's bits in *Result. 0 otherwise.
+extern "C" DLLEXPORT int64_t athens_memo_lookup(int64_t Table,
+                                               const int64_t *Key,
+                                               int64_t *Result);
+extern "C" DLLEXPORT void athens_memo_store(int64_t Table, const int64_t *Key,
+                                           int64_t Result);
+/// Entries per table (0 keeps the current capacity) and the eviction policy,
+/// for the tables threads create from now on.
+extern "C" DLLEXPORT void athens_memo_configure(int64_t Capacity,
+                                               int64_t Eviction);
+/// Free Table on every thread, a thread calling its function again starts
+/// over with an empty one. Nothing may be using it.
+extern "C" DLLEXPORT void athens_memo_free(int64_t Table);
+/// Memory Table takes up, on all threads.
+extern "C" DLLEXPORT int64_t athens_memo_bytes(int64_t Table);
+/// Lookups of Table that hit and missed so far, on all threads.
+extern "C" DLLEXPORT void athens_memo_stats(int64_t Table, int64_t *Hits,
+                                           int64_t *Misses);
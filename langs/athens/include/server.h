@@ -0,0 +1,35 @@
+#pragma once
+
+#include "session.h"
+
+#include <llvm/Support/Error.h>
+
+#include <string>
+
+/* Compile server.
+ *
+ * Starting athens sets up the JIT and compiles the runtime library before it
+ * gets to the program. A server does that once: it listens on a Unix domain
+ * socket, and every program a client sends it runs in a fork of the server,
+ * with the JIT and the runtime already there. Whatever the program defines
+ * (or a runtime error it exits on) goes away with the fork.
+ *
+ * A client sends a Request header together with its stdout and stderr (as
+ * SCM_RIGHTS), then the source. The program writes to those directly, the
+ * server answers with its exit status once it's done.
+ */
+
+namespace athens {
+
+/// Serve programs on the socket at Path until the process is killed, each
+/// one run by a fork of S. S must have been created with
+/// SessionOptions::forkable and not be used by any other thread. Only
+/// returns if it couldn't listen on Path.
+llvm::Error serve(Session &S, const std::string &Path);
+
+/// Run Source on the server listening on SocketPath, with this process'
+/// stdout and stderr. Returns the program's exit status.
+llvm::Expected<int> runOnServer(const std::string &SocketPath,
+                                llvm::StringRef Source, Mode M);
+
+} // namespace athens
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "../../../shared/frontend/lex/include/char_stream.h"
+#include "KaleidoscopeJIT.h"
+#include "codegen.h"
+#include "consteval.h"
+#include "error.h"
+#include "interp.h"
+#include "parser.h"
+#include "profile.h"
+#include "runtime.h"
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/StringMap.h>
+
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llvm {
+class ThreadPoolInterface;
+} // namespace llvm
+
+namespace athens {
+
+enum class Mode { Run, EmitLLVMIR };
+
+/// UpdateResult - What Session::update did with a new version of a program.
+enum class UpdateResult {
+  Updated,
+  // Some items failed, the others are in
+  Failed,
+  // Nothing changed: a definition's argument or return types changed (or an
+  // extern did), code compiled against the old one can't follow, or one
+  // was removed and would live on in the session. It takes a new session.
+  Incompatible,
+};
+
+struct SessionOptions {
+  bool verbose = false;
+  // Threads to parse and generate IR on. 1 compiles item by item as they're
+  // read, 0 means one thread per core.
+  unsigned jobs = 1;
+  // Generate floating point code with all the fast-math flags
+  bool fastMath = false;
+  // Threads parfor loops run on, 0 means one per core. The pool is shared by
+  // the whole process, the last session created with a nonzero count sets it.
+  unsigned threads = 0;
+  // File descriptor programs print to (putchard, printd...), -1 leaves it
+  // as it is (stdout unless a session set another one). Process-wide too.
+  int outputFd = -1;
+  // Entries in each memo table of a pure function (per thread), 0 keeps the
+  // runtime's default, and what happens once one is full. Process-wide.
+  unsigned memoCapacity = 0;
+  AthensMemoEviction memoEviction = AthensEvictReplace;
+  // Steps the compile-time evaluation of a call on constants (see
+  // ConstEvaluator) may take before it's left to the JIT, 0 turns it off
+  uint64_t evalFuel = 100000;
+  // Calls (and loop iterations) after which a definition the Interpreter
+  // runs is compiled. 0 compiles everything as it's read, so does running
+  // with jobs other than 1, parallelTopLevel or generating a profile.
+  uint64_t interpretThreshold = 0;
+  // Profile-guided optimization (see profile.h): if set, generate code that
+  // counts where it goes and write the profile here at exit (process-wide),
+  // or optimize with the profile read from here
+  std::string profileGenerate;
+  std::string profileUse;
+  // Library the math functions of vectorized loops call the vector versions
+  // of, loaded into the process
+  VectorLibrary vecLib = VectorLibrary::None;
+  // Compile whole sources up front (like jobs other than 1 does) and run
+  // top-level expressions that can't affect each other concurrently, on the
+  // jobs threads
+  bool parallelTopLevel = false;
+  // Keep the JIT from running threads of its own between calls, so the
+  // process can fork (see serve)
+  bool forkable = false;
+};
+
+struct ParallelItem;
+struct ParallelChunk;
+
+/// Session - One Athens compiler instance. It owns everything a compilation
+/// needs: the operator precedences the parser uses, the codegen state, the
+/// known prototypes and its own JIT. Independent programs can be compiled and
+/// run concurrently (one session each, e.g. on a worker pool). Calls on the
+/// same session are serialized, so a session can also be handed between
+/// threads.
+///
+/// What sessions do share is the runtime library's process-wide state, set
+/// by each session as it's created: the output file descriptor, the size of
+/// the parfor pool, the memo tables' capacity and eviction policy and where
+/// a profile is written (see SessionOptions for which of these an option
+/// leaves as it is).
+///
+///   auto S = cantFail(athens::Session::create());
+///   S->runFile("langs/athens/lib/runtime.ath");
+///   std::vector<double> Results;
+///   S->run("def twice(x) x*2; twice(21);", Mode::Run, &Results);
+class Session {
+public:
+  static llvm::Expected<std::unique_ptr<Session>>
+  create(SessionOptions Opts = {});
+
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  /// Compile (and, in Mode::Run, execute) Source one top-level item at a
+  /// time. Values of top-level expressions are printed to stderr and appended
+  /// to Results if given, after flushing what the expression printed.
+  /// Returns false if any item failed.
+  ///
+  /// With SessionOptions::jobs other than 1 the whole source is lexed first
+  /// and its items are parsed and compiled in parallel, they're still added
+  /// to the JIT and run in source order. Binary operators are installed up
+  /// front then, so an operator can be used before the `def` defining it.
+  ///
+  /// With SessionOptions::parallelTopLevel set, consecutive top-level
+  /// expressions run concurrently if all they do besides giving a value is
+  /// print: they only call definitions that do the same, the runtime's
+  /// output functions, math functions and pure externs (there are no global
+  /// variables). What each one prints is kept and written out in source
+  /// order, so the output is the same as running them one by one. A
+  /// runtime error is reported after everything before it, as it would be.
+  ///
+  /// With SessionOptions::interpretThreshold set, top-level expressions and
+  /// definitions are interpreted (see Interpreter) until they're worth
+  /// compiling.
+  bool run(std::string_view Source, Mode M = Mode::Run,
+           std::vector<double> *Results = nullptr);
+
+  /// Same as run for the contents of the file at Path.
+  bool runFile(const std::string &Path, Mode M = Mode::Run,
+               std::vector<double> *Results = nullptr);
+
+  /// Watch mode (see watch.h): bring the definitions and externs up to
+  /// Source, a new version of the program the session was last updated with.
+  /// Only definitions whose tokens changed are compiled again (with the ones
+  /// that called their old code, see recompileCallers), the session keeps
+  /// the others as they are. Its top-level expressions are kept for
+  /// runExpressions. Operators are installed up front, like with
+  /// SessionOptions::jobs other than 1.
+  UpdateResult update(std::string_view Source, Mode M = Mode::Run);
+
+  /// Run the top-level expressions of the last update in source order, as
+  /// run does, all of them after its definitions. Returns false if any
+  /// failed.
+  bool runExpressions(std::vector<double> *Results = nullptr);
+
+  /// Interactive loop reading In. An input is submitted once it ends with a
+  /// ';' or an empty line is entered. A line starting with ':' is a
+  /// command: `:save FILE` writes what was defined in the loop so far to a
+  /// snapshot, `:load FILE` defines what a snapshot has (see snapshot.h),
+  /// `:mem` prints printMemoryUsage.
+  void runRepl(std::istream &In, Mode M = Mode::Run);
+
+  /// Print the module currently being built.
+  void printModule(llvm::raw_ostream &OS);
+
+  /// Print how often the memo tables of the pure functions defined so far
+  /// (the latest definition of each) had the result.
+  void printMemoStats(llvm::raw_ostream &OS);
+
+  /// Print the memory the session's code takes up: the JIT's code and data,
+  /// the definitions (modules) in it, the IR kept to inline them and their
+  /// memo tables (on all threads).
+  void printMemoryUsage(llvm::raw_ostream &OS);
+
+private:
+  Session(SessionOptions Opts, std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT,
+          std::unique_ptr<ProfileData> Profile);
+
+  bool runLocked(frontend::lex::CharStream &CS, Mode M,
+                 std::vector<double> *Results);
+  bool runParallelLocked(frontend::lex::CharStream &CS, Mode M,
+                         std::vector<double> *Results);
+
+  bool handleDefinition(Parser &P, Mode M);
+  // Interpret or compile a parsed definition, the rest of handleDefinition
+  bool define(std::unique_ptr<FunctionAST> FnAST,
+              std::shared_ptr<ASTContext> Ctx, Mode M);
+  bool compileDefinition(std::shared_ptr<FunctionAST> FnAST,
+                         std::shared_ptr<ASTContext> Ctx, Mode M);
+  // Generate a definition's code and add it to the JIT
+  bool emitDefinition(FunctionAST &FnAST, std::shared_ptr<ASTContext> Ctx,
+                      Mode M);
+  // Keep FnAST once it's in the JIT (see Compiled), compiling the callers of
+  // the definition it replaces again
+  bool keepCompiled(std::shared_ptr<FunctionAST> FnAST,
+                    std::shared_ptr<ASTContext> Ctx);
+  // The compiled definitions calling Name, directly or not, may have inlined
+  // its previous definition or relied on its effects
+  bool recompileCallers(Symbol Name);
+  bool handleExtern(Parser &P, Mode M);
+  bool declareExtern(std::unique_ptr<PrototypeAST> ProtoAST, Mode M);
+  bool handleTopLevelExpression(Parser &P, std::vector<double> *Results);
+  bool runExpression(FunctionAST &FnAST, std::vector<double> *Results);
+
+  // Lex all of CS into Tokens (pointing into CS), install the operators it
+  // defines and split it into Chunks to parse
+  void splitProgram(frontend::lex::CharStream &CS,
+                    std::vector<frontend::lex::Token> &Tokens,
+                    std::vector<ParallelChunk> &Chunks);
+
+  // Parallel mode, run on the worker threads
+  void parseItems(std::span<const frontend::lex::Token> Tokens,
+                  ASTContext &Ctx, std::vector<ParallelItem> &Items);
+  void codegenItem(ParallelItem &Item);
+  bool runTopLevelBatch(llvm::ArrayRef<ParallelItem *> Batch,
+                        llvm::ThreadPoolInterface &Pool,
+                        std::vector<double> *Results);
+
+  // Shared by both modes, once an item's IR is ready. Proto is the
+  // definition's, after its codegen.
+  void printIR(llvm::Function *FnIR, const char *Heading, Mode M);
+  bool addDefinition(llvm::orc::ThreadSafeModule TSM,
+                     const PrototypeAST *Proto = nullptr);
+  // Give Proto's definition, added with RT, its memo table (if it has one)
+  // in place of the one of the definition it replaces
+  bool finishDefinition(const PrototypeAST &Proto,
+                        llvm::orc::ResourceTrackerSP RT);
+  bool runTopLevel(llvm::orc::ThreadSafeModule TSM,
+                   std::vector<double> *Results);
+  void printResult(double Result, std::vector<double> *Results);
+
+  // The interpreter's entry point into the JIT for Name
+  Interpreter::NativeEntry interpreterEntry(Symbol Name);
+
+  // Whether all Fn (resolved) does besides giving a value is print, calls
+  // of it can run concurrently (see run)
+  bool isSelfContained(const FunctionAST &Fn) const;
+
+  // REPL commands
+  void runCommand(llvm::StringRef Command);
+  bool saveSnapshot(const std::string &Path);
+  bool loadSnapshot(const std::string &Path);
+  // What a snapshot's objects were compiled for
+  std::string snapshotTarget() const;
+  // Keep the object file Obj for a snapshot (see Objects)
+  void recordObject(const llvm::MemoryBuffer &Obj);
+
+  // Report a JIT error, returns true if there was one
+  bool logIfError(llvm::Error Err);
+
+  CodeGenOptions codegenOptions() const {
+    return {.FastMath = Opts.fastMath,
+            .InstrumentProfile = !Opts.profileGenerate.empty(),
+            .VecLib = Opts.vecLib};
+  }
+
+  std::mutex Mutex;
+  SessionOptions Opts;
+
+  std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+  // Every name the session has seen, tokens/AST/tables only carry Symbols
+  frontend::lex::SymbolTable Symbols;
+  FunctionProtoMap FunctionProtos;
+  InlineBodyMap InlineBodies;
+  // Definitions isSelfContained, by name
+  llvm::DenseSet<Symbol> SelfContained;
+  // Every definition in the JIT, with its memo table (-1 if it has none)
+  llvm::DenseMap<Symbol, int64_t> MemoTables;
+  /// CompiledDefinition - What a definition in the JIT was compiled from.
+  struct CompiledDefinition {
+    std::shared_ptr<FunctionAST> Fn;
+    std::shared_ptr<ASTContext> Ctx;
+    // Definitions are numbered as they're compiled, so callees come first
+    uint64_t Order;
+  };
+  llvm::DenseMap<Symbol, CompiledDefinition> Compiled;
+  uint64_t NextCompiled = 0;
+  /// WatchedProgram - What update keeps of the program it was given last.
+  struct WatchedProgram {
+    // The tokens of each definition and extern it has in the session, hashed
+    llvm::DenseMap<Symbol, llvm::hash_code> Hashes;
+    // Its top-level expressions, with the context they were parsed into
+    std::vector<
+        std::pair<std::shared_ptr<ASTContext>, std::unique_ptr<FunctionAST>>>
+        Expressions;
+  } Watched;
+  // SessionOptions::profileUse, if set
+  std::unique_ptr<ProfileData> Profile;
+  // The functions there were before the REPL started, a snapshot has the
+  // others
+  llvm::DenseSet<Symbol> Preloaded;
+  // Once the REPL started: the object file every symbol was linked from,
+  // by name (without the global prefix). Filled on the JIT's threads.
+  std::mutex ObjectsMutex;
+  llvm::StringMap<std::shared_ptr<const std::string>> Objects;
+  ConstEvaluator Evaluator;
+  Interpreter Interp;
+  ParserRegistry Registry;
+  CodeGen CG;
+  error::Diagnostics Diag;
+};
+
+} // namespace athens
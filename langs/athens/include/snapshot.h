@@ -0,0 +1,61 @@
+#pragma once
+
+#include "parser.h"
+
+#include <llvm/Support/Error.h>
+
+#include <string>
+#include <vector>
+
+/* REPL session snapshots.
+ *
+ * A snapshot holds what a REPL session defined: every definition's
+ * prototype, its compiled object file and what later definitions need to
+ * compile against it (its inline body, whether it's an operator), and the
+ * prototypes of its externs. Restoring one links the objects into the JIT
+ * again, nothing is parsed or compiled.
+ *
+ * The file is little endian: a header (magic, version, the target the
+ * objects were compiled for, whether they're instrumented) and the entries,
+ * each with a checksum of its contents. Strings and blobs are a 32 bit
+ * length and the bytes.
+ */
+
+namespace athens {
+
+/// SnapshotEntry - One definition (or extern) of a snapshot.
+struct SnapshotEntry {
+  std::string Name;
+  std::vector<std::string> Args;
+  std::vector<ValueType> ArgTypes;
+  ValueType RetType = ValueType::Double;
+  std::string OperatorName;
+  unsigned Precedence = 0;
+  bool Pure = false;
+  bool Extern = false;
+  // Its code uses a memo table (see MemoTableSuffix)
+  bool Memoized = false;
+  // See Session::isSelfContained
+  bool SelfContained = false;
+  FunctionEffects Effects;
+  // Bitcode, empty if it can't be inlined
+  std::string InlineBody;
+  // Empty for an extern
+  std::string Object;
+};
+
+/// Snapshot - The contents of a snapshot file.
+struct Snapshot {
+  // Objects only link into a process on the same target (triple, CPU and
+  // data layout)
+  std::string Target;
+  // The objects count what runs into the saving process' profile counters
+  // (see --pgo-gen), they can't run anywhere else
+  bool Instrumented = false;
+  std::vector<SnapshotEntry> Entries;
+
+  llvm::Error write(const std::string &Path) const;
+  static llvm::Expected<Snapshot> read(const std::string &Path);
+};
+
+} // namespace athens
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "parser.h"
+
+#include <vector>
+
+/// TypeInference - Local type inference for one function, run right before
+/// its codegen (once the prototypes of everything it calls are known).
+///
+/// Arguments have their declared types. Every other slot starts out as an int
+/// and turns into a double as soon as a double is stored into it, by its
+/// initializer, an assignment or a for loop's start and step. Literals without
+/// a '.' are ints, and arithmetic on two ints stays an int ('/' always gives a
+/// double). Slots only ever go from int to double, so re-inferring the body
+/// until none changes terminates, usually after one or two rounds.
+///
+/// A variable is an array if it's declared (parameters) or initialized (var)
+/// as one. Arrays don't convert to or from numbers, using one where a number
+/// is expected (or the other way around) is a type error. The other one is a
+/// pure function calling one that isn't.
+///
+/// Codegen reads the result off the nodes (ExprAST::getType) and
+/// getSlotTypes.
+class TypeInference {
+public:
+  TypeInference(const FunctionProtoMap &FunctionProtos,
+                const PrototypeAST &Self, unsigned NumSlots);
+
+  /// Infer the types of Body and every slot of the function. Returns false
+  /// if there's a type error, it's reported.
+  bool run(ExprAST *Body);
+
+  ValueType getSlotType(unsigned Slot) const { return SlotTypes[Slot]; }
+  ArrayRef<ValueType> getSlotTypes() const { return SlotTypes; }
+
+  /// A value of type Ty is stored into Slot.
+  void store(unsigned Slot, ValueType Ty);
+
+  /// A value of type Got is used where one of type Expected goes. Ints and
+  /// doubles convert into each other, arrays only go where arrays do.
+  bool expect(ValueType Expected, ValueType Got);
+
+  /// The function (or operator) Callee is called with arguments of types
+  /// ArgTypes.
+  void call(const PrototypeAST &Callee, ArrayRef<ValueType> ArgTypes);
+
+  /// Whether the function calls any (built-in operators aren't calls).
+  bool callsFunctions() const { return CallsFunctions; }
+
+  /// Prototype of the function called Name, null if there isn't one.
+  const PrototypeAST *lookup(Symbol Name) const;
+
+private:
+  const FunctionProtoMap &FunctionProtos;
+  // The function being inferred, it isn't in FunctionProtos until it compiled
+  const PrototypeAST &Self;
+  std::vector<ValueType> SlotTypes;
+  bool Changed = false;
+  bool Failed = false;
+  bool CallsFunctions = false;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "session.h"
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/Support/Error.h>
+
+#include <memory>
+#include <string>
+
+/* Watch mode.
+ *
+ * Runs a file every time it's saved, with the JIT kept between runs: each
+ * run compiles only the definitions that changed since the one before (see
+ * Session::update), then runs all the top-level expressions. Those run in a
+ * fork of the session, so a runtime error (or whatever the program does to
+ * the runtime's state, e.g. memo tables) ends with the run.
+ *
+ * The file's directory is watched with inotify rather than the file itself,
+ * editors often save by writing a new file and renaming it over the old one.
+ */
+
+namespace athens {
+
+/// Run the program at Path, and again every time it changes, until the
+/// process is killed. NewSession creates the session it runs in, and a new
+/// one when a change can't be made to the program in the old session.
+/// Sessions must be SessionOptions::forkable and not be used by any other
+/// thread. Only returns if it couldn't watch Path or create a session.
+llvm::Error
+watch(llvm::function_ref<llvm::Expected<std::unique_ptr<Session>>()> NewSession,
+      const std::string &Path, Mode M);
+
+} // namespace athens
@@ -23,6 +23,8 @@ AthensLexRules::keyword(std::string_view identifier) const {
     return TokenKind::KwElse;
   if (identifier == "for")
     return TokenKind::KwFor;
+  if (identifier == "parfor")
+    return TokenKind::KwParfor;
   if (identifier == "in")
     return TokenKind::KwIn;
   if (identifier == "binary")
@@ -43,6 +45,10 @@ AthensLexRules::punctuator(std::string_view text) const {
     return TokenKind::LParen;
   if (text == ")")
     return TokenKind::RParen;
+  if (text == "[")
+    return TokenKind::LBracket;
+  if (text == "]")
+    return TokenKind::RBracket;
   if (text == ",")
     return TokenKind::Comma;
   if (text == ";")
@@ -67,6 +73,21 @@ AthensLexRules::punctuator(std::string_view text) const {
     return TokenKind::GreaterEqual;
   if (text == "!")
     return TokenKind::LogicNot;
+  if (text == "==")
+    return TokenKind::EqualEqual;
+  if (text == "!=")
+    return TokenKind::NotEqual;
+  if (text == "&&")
+    return TokenKind::LogicAnd;
+  if (text == "||")
+    return TokenKind::LogicOr;
+  if (text == ":")
+    return TokenKind::Colon;
+
+  // athens supports user-defined operators, any other single non-alphanumeric
+  // character can be one (e.g. '|', '&', '%')
+  if (text.size() == 1 && std::ispunct(static_cast<unsigned char>(text[0])))
+    return TokenKind::Operator;
 
   return std::nullopt;
 }
@@ -1,32 +1,424 @@
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/FunctionAttrs.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/InductiveRangeCheckElimination.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/InjectTLIMappings.h"
+#include "llvm/Transforms/Utils/LCSSA.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 
 #include "codegen.h"
+#include "consteval.h"
 #include "error.h"
 #include "parser.h"
+#include "profile.h"
+#include "runtime.h"
+#include "typecheck.h"
 
 using namespace llvm;
 
-std::unique_ptr<LLVMContext> TheContext;
-std::unique_ptr<Module> TheModule;
-std::unique_ptr<IRBuilder<>> Builder;
-std::map<std::string, AllocaInst *> NamedValues;
+/* Module setup */
 
-std::unique_ptr<FunctionPassManager> TheFPM;
-std::unique_ptr<LoopAnalysisManager> TheLAM;
-std::unique_ptr<FunctionAnalysisManager> TheFAM;
+void CodeGen::initializeModuleAndManagers(const DataLayout &DL) {
+  // Drop the previous managers outermost first, the module analysis manager
+  // holds proxies into the inner ones.
+  TheSI.reset();
+  TheMAM.reset();
+  TheCGAM.reset();
+  TheFAM.reset();
+  TheLAM.reset();
 
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+  if (!TM) {
+    auto JTMB = cantFail(orc::JITTargetMachineBuilder::detectHost());
+    TM = cantFail(JTMB.createTargetMachine());
+  }
+
+  // Open a new context and module
+  TheContext = std::make_unique<LLVMContext>();
+  TheModule = std::make_unique<Module>("Athens Top Module", *TheContext);
+  TheModule->setDataLayout(DL);
+  TheModule->setTargetTriple(TM->getTargetTriple().str());
+  // What's hot or cold is relative to the whole profile
+  if (Profile)
+    TheModule->setProfileSummary(Profile->getSummaryMD(*TheContext),
+                                 ProfileSummary::PSK_Instr);
+
+  // Create a new builder for the module
+  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  if (Opts.FastMath) {
+    FastMathFlags FMF;
+    FMF.setFast();
+    Builder->setFastMathFlags(FMF);
+  }
+
+  // Create new pass and analysis managers
+  TheFPM = std::make_unique<FunctionPassManager>();
+  TheLAM = std::make_unique<LoopAnalysisManager>();
+  TheFAM = std::make_unique<FunctionAnalysisManager>();
+  TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+  TheMAM = std::make_unique<ModuleAnalysisManager>();
+  ThePIC = std::make_unique<PassInstrumentationCallbacks>();
+  TheSI = std::make_unique<StandardInstrumentations>(*TheContext,
+                                                     /*DebugLogging*/ true);
+  TheSI->registerCallbacks(*ThePIC, TheMAM.get());
+
+  // Add transform passes.
+
+  // Promote allocas to registers
+  TheFPM->addPass(PromotePass());
+
+  // Do simple "peephole" optimizations and big-twiddling opts.
+  TheFPM->addPass(InstCombinePass());
+
+  // Reassociate expressions.
+  TheFPM->addPass(ReassociatePass());
+
+  // Eliminate common subexpressions
+  TheFPM->addPass(GVNPass());
+
+  // Simplify the control flow graph (delete unreachable blocks, etc).
+  TheFPM->addPass(SimplifyCFGPass());
+
+  // Loops: put them in canonical form (preheader, dedicated exits, values
+  // used outside only through phis) first, the loop passes rely on it.
+  TheFPM->addPass(LoopSimplifyPass());
+  TheFPM->addPass(LCSSAPass());
+
+  // Hoist invariant code out of loops and canonicalize the induction
+  // variables (which also computes trip counts).
+  LoopPassManager LPM;
+  LPM.addPass(LICMPass(LICMOptions()));
+  LPM.addPass(IndVarSimplifyPass());
+  TheFPM->addPass(
+      createFunctionToLoopPassAdaptor(std::move(LPM), /*UseMemorySSA=*/true));
+
+  // Array bounds checks the induction variables couldn't prove away: split
+  // off the iterations that can't fail, so that loop has no checks left.
+  TheFPM->addPass(IRCEPass());
+
+  // Vectorize, then unroll what's left (like clang's pipeline does). Calls
+  // the vector library has vector versions of are marked as such first.
+  if (Opts.VecLib != VectorLibrary::None)
+    TheFPM->addPass(InjectTLIMappings());
+  TheFPM->addPass(LoopVectorizePass());
+  TheFPM->addPass(LoopUnrollPass());
+
+  // Clean up after them.
+  TheFPM->addPass(InstCombinePass());
+  TheFPM->addPass(SimplifyCFGPass());
+
+  // Inline the imported bodies (see importInlineBodies), the function passes
+  // above clean up after it.
+  TheMPM = std::make_unique<ModulePassManager>();
+  TheMPM->addPass(ModuleInlinerWrapperPass(getInlineParams()));
+
+  // What the functions access, whether they throw and return, bottom up
+  // from the attributes of the callees' declarations (see FunctionEffects).
+  TheAttrMPM = std::make_unique<ModulePassManager>();
+  TheAttrMPM->addPass(
+      createModuleToPostOrderCGSCCPassAdaptor(PostOrderFunctionAttrsPass()));
+
+  // Math intrinsics in vectorized loops become calls of the vector library's
+  // functions (registered before the default library info)
+  if (Opts.VecLib != VectorLibrary::None) {
+    TargetLibraryInfoImpl TLII(TM->getTargetTriple());
+    TLII.addVectorizableFunctionsFromVecLib(
+        Opts.VecLib == VectorLibrary::LibMVec
+            ? TargetLibraryInfoImpl::LIBMVEC_X86
+            : TargetLibraryInfoImpl::SLEEFGNUABI,
+        TM->getTargetTriple());
+    TheFAM->registerPass([TLII] { return TargetLibraryAnalysis(TLII); });
+  }
+
+  // Register analysis passes used in these transform passes. With the target
+  // machine the cost models know the host's vector width etc.
+  PassBuilder PB(TM.get());
+  PB.registerModuleAnalyses(*TheMAM);
+  PB.registerCGSCCAnalyses(*TheCGAM);
+  PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
+  PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+}
+
+orc::ThreadSafeModule CodeGen::takeModule() {
+  return orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+}
+
+/* Cross-module inlining */
+
+// Definitions bigger than this (after optimization) are always called
+static constexpr unsigned InlineBodyMaxInstructions = 64;
+
+bool CodeGen::importInlineBodies() {
+  DenseSet<Symbol> Imported;
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+
+    // Imported bodies may call further functions with known bodies, so go
+    // again until there's nothing new.
+    SmallVector<Symbol, 8> ToImport;
+    for (const Function &F : *TheModule) {
+      if (!F.isDeclaration())
+        continue;
+      Symbol S = Symbols.find(F.getName());
+      if (S && InlineBodies.count(S) && Imported.insert(S).second)
+        ToImport.push_back(S);
+    }
+
+    for (Symbol S : ToImport) {
+      const auto &Bitcode = InlineBodies.find(S)->second;
+      auto Body = parseBitcodeFile(
+          MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                          name(S)),
+          *TheContext);
+      if (!Body) {
+        consumeError(Body.takeError());
+        continue;
+      }
+
+      // Visible to the optimizer only, the JIT keeps calling the real one.
+      // Internal functions (parfor bodies) can't be called from here, they
+      // come along as copies of their own.
+      for (Function &F : **Body)
+        if (!F.isDeclaration() && !F.hasLocalLinkage())
+          F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+
+      // linkModules returns true on error
+      if (!Linker::linkModules(*TheModule, std::move(*Body),
+                               Linker::LinkOnlyNeeded))
+        Changed = true;
+    }
+  }
+  return !Imported.empty();
+}
+
+std::optional<SmallVector<char, 0>>
+CodeGen::exportInlineBody(const Function &F) const {
+  if (F.getInstructionCount() > InlineBodyMaxInstructions)
+    return std::nullopt;
+
+  SmallVector<char, 0> Bitcode;
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(*F.getParent(), OS);
+  return Bitcode;
+}
+
+/* Interpreter entry points */
+
+Function *CodeGen::emitInterpreterEntry(Function &F) {
+  Type *I64 = Type::getInt64Ty(*TheContext);
+  Type *Ptr = PointerType::getUnqual(*TheContext);
+  FunctionType *FT =
+      FunctionType::get(Type::getVoidTy(*TheContext), {Ptr, Ptr}, false);
+  Function *Entry =
+      Function::Create(FT, Function::ExternalLinkage,
+                       F.getName() + InterpreterEntrySuffix, TheModule.get());
+  Entry->setDoesNotThrow();
+
+  IRBuilder<> B(BasicBlock::Create(*TheContext, "entry", Entry));
+  Value *Words = Entry->getArg(0);
+  unsigned Word = 0;
+  auto Load = [&](Type *Ty) {
+    return B.CreateLoad(Ty, B.CreateConstInBoundsGEP1_64(I64, Words, Word++));
+  };
+
+  SmallVector<Value *, 8> Args;
+  for (Argument &Arg : F.args()) {
+    Type *Ty = Arg.getType();
+    if (!Ty->isStructTy()) {
+      Args.push_back(Load(Ty));
+      continue;
+    }
+    Value *Arr = PoisonValue::get(Ty);
+    Arr = B.CreateInsertValue(Arr, Load(Ptr), 0);
+    Args.push_back(B.CreateInsertValue(Arr, Load(I64), 1));
+  }
+
+  Value *RetVal = B.CreateCall(&F, Args);
+  Value *Result = Entry->getArg(1);
+  if (RetVal->getType()->isStructTy()) {
+    B.CreateStore(B.CreateExtractValue(RetVal, 0), Result);
+    B.CreateStore(B.CreateExtractValue(RetVal, 1),
+                  B.CreateConstInBoundsGEP1_64(I64, Result, 1));
+  } else {
+    B.CreateStore(RetVal, Result);
+  }
+  B.CreateRetVoid();
+  return Entry;
+}
+
+/* Profile-guided optimization */
+
+void CodeGen::beginProfile(Function &F) {
+  Profiled = ProfiledFunction();
+  Profiled.F = &F;
+  Profiled.Hash = 14695981039346656037ULL; // FNV-1a
+  Profiled.NumCounters = 1;
+  if (!Opts.InstrumentProfile)
+    return;
+
+  Type *I64 = Type::getInt64Ty(*TheContext);
+  Profiled.Counters = new GlobalVariable(*TheModule, I64, /*isConstant=*/false,
+                                         GlobalValue::ExternalLinkage,
+                                         nullptr, "counters");
+  Builder->CreateStore(
+      Builder->CreateAdd(Builder->CreateLoad(I64, Profiled.Counters),
+                         ConstantInt::get(I64, 1)),
+      Profiled.Counters);
+}
+
+BranchInst *CodeGen::createBranch(BranchKind K, Value *Cond, BasicBlock *True,
+                                  BasicBlock *False) {
+  unsigned Counter = Profiled.NumCounters;
+  Profiled.NumCounters += 2;
+  Profiled.Hash = (Profiled.Hash ^ static_cast<uint8_t>(K)) * 1099511628211ULL;
+
+  if (Profiled.Counters) {
+    Type *I64 = Type::getInt64Ty(*TheContext);
+    Value *Idx = Builder->CreateSelect(Cond, ConstantInt::get(I64, Counter),
+                                       ConstantInt::get(I64, Counter + 1));
+    Value *Ptr = Builder->CreateInBoundsGEP(I64, Profiled.Counters, Idx);
+    // The body of a parfor runs on several threads at once
+    if (Builder->GetInsertBlock()->getParent() != Profiled.F)
+      Builder->CreateAtomicRMW(AtomicRMWInst::Add, Ptr,
+                               ConstantInt::get(I64, 1), MaybeAlign(),
+                               AtomicOrdering::Monotonic);
+    else
+      Builder->CreateStore(
+          Builder->CreateAdd(Builder->CreateLoad(I64, Ptr),
+                             ConstantInt::get(I64, 1)),
+          Ptr);
+  }
+
+  BranchInst *Br = Builder->CreateCondBr(Cond, True, False);
+  Profiled.Branches.emplace_back(Br, Counter);
+  return Br;
+}
+
+/// Branch weights are 32 bits, the counts are scaled down to fit (like clang
+/// does).
+static uint32_t scaleBranchWeight(uint64_t Count, uint64_t Scale) {
+  return Count / Scale + 1;
+}
+
+void CodeGen::finishProfile(bool Generated) {
+  if (GlobalVariable *Counters = Profiled.Counters) {
+    // What's left of a function that failed is never run
+    Constant *Table = Constant::getNullValue(Counters->getType());
+    if (Generated) {
+      uint64_t *Counts = newProfileCounters(
+          Profiled.F->getName(), Profiled.Hash, Profiled.NumCounters);
+      Table = ConstantExpr::getIntToPtr(
+          ConstantInt::get(Type::getInt64Ty(*TheContext),
+                           reinterpret_cast<uintptr_t>(Counts)),
+          Counters->getType());
+    }
+    Counters->replaceAllUsesWith(Table);
+    Counters->eraseFromParent();
+  }
+
+  if (!Generated || !Profile)
+    return;
+  ArrayRef<uint64_t> Counts = Profile->lookup(
+      Profiled.F->getName(), Profiled.Hash, Profiled.NumCounters);
+  if (Counts.empty())
+    return;
+
+  // Hot if it's entered often, cold if nothing in it ran much (like LLVM's
+  // own PGO does it), relative to the whole profile
+  Profiled.F->setEntryCount(Counts[0]);
+  uint64_t Max = *std::max_element(Counts.begin(), Counts.end());
+  auto &PSI = TheMAM->getResult<ProfileSummaryAnalysis>(*TheModule);
+  if (PSI.isHotCount(Counts[0]))
+    Profiled.F->addFnAttr(Attribute::Hot);
+  else if (PSI.isColdCount(Max))
+    Profiled.F->addFnAttr(Attribute::Cold);
+
+  uint64_t Scale = Max < UINT32_MAX ? 1 : Max / UINT32_MAX + 1;
+  MDBuilder MDB(*TheContext);
+  for (auto [Br, Counter] : Profiled.Branches) {
+    uint64_t TrueCount = Counts[Counter], FalseCount = Counts[Counter + 1];
+    // Never reached, there's nothing to go by
+    if (!TrueCount && !FalseCount)
+      continue;
+    Br->setMetadata(LLVMContext::MD_prof,
+                    MDB.createBranchWeights(
+                        scaleBranchWeight(TrueCount, Scale),
+                        scaleBranchWeight(FalseCount, Scale)));
+  }
+}
+
+/* Math functions */
+
+namespace {
+/// MathFunction - A function of the C math library that has an LLVM
+/// intrinsic.
+struct MathFunction {
+  StringLiteral Name;
+  Intrinsic::ID ID;
+  unsigned NumArgs;
+};
+} // namespace
+
+static constexpr MathFunction MathFunctions[] = {
+    {"sin", Intrinsic::sin, 1},   {"cos", Intrinsic::cos, 1},
+    {"exp", Intrinsic::exp, 1},   {"log", Intrinsic::log, 1},
+    {"sqrt", Intrinsic::sqrt, 1}, {"fabs", Intrinsic::fabs, 1},
+    {"pow", Intrinsic::pow, 2},   {"fma", Intrinsic::fma, 3},
+    {"floor", Intrinsic::floor, 1},
+};
+
+/// The intrinsic a call of Proto is if it's an extern declaring one of
+/// MathFunctions, on and returning doubles. Unlike the library call it has
+/// no side effects (it never sets errno), so it can be folded, hoisted out
+/// of loops and vectorized.
+static Intrinsic::ID getMathIntrinsic(const PrototypeAST &Proto,
+                                      StringRef Name) {
+  if (!Proto.isExtern() || Proto.getReturnType() != ValueType::Double ||
+      !all_of(Proto.getArgTypes(),
+              [](ValueType Ty) { return Ty == ValueType::Double; }))
+    return Intrinsic::not_intrinsic;
+  for (const MathFunction &MF : MathFunctions)
+    if (MF.Name == Name && MF.NumArgs == Proto.getArgs().size())
+      return MF.ID;
+  return Intrinsic::not_intrinsic;
+}
+
+bool isMathFunction(const PrototypeAST &Proto, StringRef Name) {
+  return getMathIntrinsic(Proto, Name) != Intrinsic::not_intrinsic;
+}
 
 /* Some Helpers */
 
@@ -35,127 +427,436 @@ Value *LogErrorV(const char *Str) {
   return nullptr;
 }
 
-Function *getFunction(std::string Name) {
+Function *CodeGen::getFunction(Symbol Name) {
   // First, see if the function has already been added to the current module
-  if (auto *F = TheModule->getFunction(Name))
+  if (auto *F = TheModule->getFunction(name(Name)))
     return F;
 
   // Check if we can codegen the declaration from some existing prototype
   auto FI = FunctionProtos.find(Name);
   if (FI != FunctionProtos.end())
-    return FI->second->codegen();
+    return FI->second->codegen(*this);
 
   // If no existing prototype exists, return null
   return nullptr;
 }
 
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+Type *CodeGen::getType(ValueType Ty) {
+  switch (Ty) {
+  case ValueType::Double:
+    return Type::getDoubleTy(*TheContext);
+  case ValueType::Int:
+    return Type::getInt64Ty(*TheContext);
+  case ValueType::Array:
+    // The elements and their count, see IndexExprAST::codegenAddress
+    return StructType::get(PointerType::getUnqual(*TheContext),
+                           Type::getInt64Ty(*TheContext));
+  }
+  llvm_unreachable("unknown value type");
+}
+
+Value *CodeGen::convert(Value *V, Type *To) {
+  if (V->getType() == To)
+    return V;
+  // Type inference only lets numbers through here
+  assert(!V->getType()->isStructTy() && !To->isStructTy());
+  if (To->isDoubleTy())
+    return Builder->CreateSIToFP(V, To, "todouble");
+  return Builder->CreateFPToSI(V, To, "toint");
+}
+
+Value *CodeGen::isTrue(Value *V, const Twine &Name) {
+  if (V->getType()->isDoubleTy())
+    return Builder->CreateFCmpONE(V, ConstantFP::get(V->getType(), 0.0), Name);
+  return Builder->CreateICmpNE(V, ConstantInt::get(V->getType(), 0), Name);
+}
+
+/* Runtime */
+
+/// A function of the runtime (see runtime.h). None of them throw, so the
+/// functions calling them can be inferred nounwind.
+template <typename... ArgTys>
+static FunctionCallee runtimeFunction(CodeGen &CG, StringRef Name, Type *RetTy,
+                                      ArgTys... Args) {
+  FunctionCallee F = CG.TheModule->getOrInsertFunction(Name, RetTy, Args...);
+  cast<Function>(F.getCallee())->setDoesNotThrow();
+  return F;
+}
+
+/* Arrays */
+
+// The array runtime, see runtime.h
+
+static FunctionCallee arrayNewFn(CodeGen &CG) {
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
+  FunctionCallee F = runtimeFunction(
+      CG, "athens_array_new", PointerType::getUnqual(*CG.TheContext), I64);
+  // Fresh memory nothing else points to, which spares the vectorizer
+  // runtime alias checks between arrays created in the same function
+  cast<Function>(F.getCallee())->addRetAttr(Attribute::NoAlias);
+  return F;
+}
+
+static FunctionCallee boundsFailFn(CodeGen &CG) {
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
+  FunctionCallee F = runtimeFunction(
+      CG, "athens_bounds_fail", Type::getVoidTy(*CG.TheContext), I64, I64);
+  auto *Fn = cast<Function>(F.getCallee());
+  Fn->setDoesNotReturn();
+  Fn->addFnAttr(Attribute::Cold);
+  return F;
+}
+
+/// Whether F creates arrays, or gets new ones from the functions it calls.
+static bool createsArrays(const Function &F) {
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB)
+      if (auto *Call = dyn_cast<CallInst>(&I)) {
+        const Function *Callee = Call->getCalledFunction();
+        if (Call->getType()->isStructTy() ||
+            (Callee && Callee->getName() == "athens_array_new"))
+          return true;
+      }
+  return false;
+}
+
+/// Arrays are allocated from an arena (see runtime.h). The ones F creates are
+/// garbage once it returns, unless it returns one of them. Call right before
+/// F's return.
+static void releaseArraysOnReturn(CodeGen &CG, Function &F, Value *RetVal) {
+  if (RetVal->getType()->isStructTy() || !createsArrays(F))
+    return;
+
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
+  FunctionCallee MarkFn = runtimeFunction(CG, "athens_arena_mark", I64);
+  FunctionCallee ReleaseFn = runtimeFunction(
+      CG, "athens_arena_release", Type::getVoidTy(*CG.TheContext), I64);
+
+  BasicBlock &Entry = F.getEntryBlock();
+  IRBuilder<> EntryB(&Entry, Entry.begin());
+  Value *Mark = EntryB.CreateCall(MarkFn, {}, "arenamark");
+  CG.Builder->CreateCall(ReleaseFn, Mark);
+}
+
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, Type *Ty,
                                           StringRef VarName) {
   IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                    TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, VarName);
+  return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+/* Memoization */
+
+// Memo tables key on (and store) the bits of ints and doubles alike
+static Value *toBits(CodeGen &CG, Value *V) {
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
+  return V->getType() == I64 ? V : CG.Builder->CreateBitCast(V, I64, "bits");
+}
+
+/// The id of F's memo table as its code sees it (see MemoTableSuffix).
+static Constant *memoTableId(CodeGen &CG, Function &F) {
+  Constant *Symbol = CG.TheModule->getOrInsertGlobal(
+      (F.getName() + MemoTableSuffix).str(), Type::getInt8Ty(*CG.TheContext));
+  return ConstantExpr::getPtrToInt(Symbol, Type::getInt64Ty(*CG.TheContext));
+}
+
+/// A pure function starts by looking its arguments up in its memo table (see
+/// runtime.h), and returns right away on a hit:
+///
+/// entry:
+///  store args, key
+///  hit = athens_memo_lookup(table, key, result)
+///  br hit, memo.hit, memo.miss
+///
+/// memo.hit:
+///  ret load result
+///
+/// memo.miss:
+///  ...
+///
+/// Gives the key, emitMemoStore stores the result under it.
+static Value *emitMemoLookup(CodeGen &CG, Function &F, Constant *Table) {
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
+  Type *Ptr = PointerType::getUnqual(*CG.TheContext);
+  ArrayType *KeyTy = ArrayType::get(I64, F.arg_size());
+  AllocaInst *Key = CreateEntryBlockAlloca(&F, KeyTy, "memo.key");
+  AllocaInst *Result = CreateEntryBlockAlloca(&F, I64, "memo.result");
+  for (auto &Arg : F.args())
+    CG.Builder->CreateStore(
+        toBits(CG, &Arg),
+        CG.Builder->CreateConstInBoundsGEP2_64(KeyTy, Key, 0, Arg.getArgNo()));
+
+  FunctionCallee LookupFn =
+      runtimeFunction(CG, "athens_memo_lookup", I64, I64, Ptr, Ptr);
+  Value *Hit = CG.Builder->CreateCall(
+      LookupFn, {Table, Key, Result}, "memo");
+
+  BasicBlock *HitBB = BasicBlock::Create(*CG.TheContext, "memo.hit", &F);
+  BasicBlock *MissBB = BasicBlock::Create(*CG.TheContext, "memo.miss", &F);
+  CG.Builder->CreateCondBr(CG.isTrue(Hit, "memo.found"), HitBB, MissBB);
+
+  CG.Builder->SetInsertPoint(HitBB);
+  Value *Bits = CG.Builder->CreateLoad(I64, Result, "memo.bits");
+  Type *RetTy = F.getReturnType();
+  CG.Builder->CreateRet(RetTy == I64 ? Bits
+                                     : CG.Builder->CreateBitCast(Bits, RetTy));
+
+  CG.Builder->SetInsertPoint(MissBB);
+  return Key;
+}
+
+/// Store RetVal under Key (from emitMemoLookup), right before returning it.
+static void emitMemoStore(CodeGen &CG, Constant *Table, Value *Key,
+                          Value *RetVal) {
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
+  FunctionCallee StoreFn = runtimeFunction(
+      CG, "athens_memo_store", Type::getVoidTy(*CG.TheContext), I64,
+      PointerType::getUnqual(*CG.TheContext), I64);
+  CG.Builder->CreateCall(StoreFn, {Table, Key, toBits(CG, RetVal)});
 }
 
 /* Codegen */
 
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(*TheContext, APFloat(Val));
+Value *ExprAST::codegen(CodeGen &CG) {
+  switch (getKind()) {
+  case EK_Number:
+    return cast<NumberExprAST>(this)->codegen(CG);
+  case EK_Variable:
+    return cast<VariableExprAST>(this)->codegen(CG);
+  case EK_Var:
+    return cast<VarExprAST>(this)->codegen(CG);
+  case EK_Binary:
+    return cast<BinaryExprAST>(this)->codegen(CG);
+  case EK_Unary:
+    return cast<UnaryExprAST>(this)->codegen(CG);
+  case EK_If:
+    return cast<IfExprAST>(this)->codegen(CG);
+  case EK_For:
+    return cast<ForExprAST>(this)->codegen(CG);
+  case EK_Parfor:
+    return cast<ParforExprAST>(this)->codegen(CG);
+  case EK_Call:
+    return cast<CallExprAST>(this)->codegen(CG);
+  case EK_Array:
+    return cast<ArrayExprAST>(this)->codegen(CG);
+  case EK_Index:
+    return cast<IndexExprAST>(this)->codegen(CG);
+  case EK_Length:
+    return cast<LengthExprAST>(this)->codegen(CG);
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+Value *NumberExprAST::codegen(CodeGen &CG) {
+  if (IsInt)
+    return ConstantInt::getSigned(Type::getInt64Ty(*CG.TheContext), IntVal);
+  return ConstantFP::get(*CG.TheContext, APFloat(Val));
 }
 
-Value *VariableExprAST::codegen() {
-  // Look this variable up in the function.
-  AllocaInst *A = NamedValues[Name];
+Value *VariableExprAST::codegen(CodeGen &CG) {
+  // Resolution already found the binding, it's in its slot
+  auto *A = dyn_cast<AllocaInst>(CG.Slots[Slot]);
   if (!A)
-    return LogErrorV("Unknown variable name");
+    return CG.Slots[Slot];
 
   // Load the value
-  return Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+  return CG.Builder->CreateLoad(A->getAllocatedType(), A, CG.name(Name));
 }
 
-Value *UnaryExprAST::codegen() {
-  Value *OperandV = Operand->codegen();
+Value *UnaryExprAST::codegen(CodeGen &CG) {
+  Value *OperandV = Operand->codegen(CG);
   if (!OperandV)
     return nullptr;
 
-  Function *F = getFunction(std::string("unary") + Op);
+  // Defining a built-in operator overloads it
+  Function *F = CG.getFunction(OpFn);
+  if (!F && Op == BuiltinOp::Not) {
+    // 1 for 0 and 0 for anything else, the opposite of what `if` tests
+    Value *Zero = Constant::getNullValue(OperandV->getType());
+    Value *IsZero = OperandV->getType()->isDoubleTy()
+                        ? CG.Builder->CreateFCmpUEQ(OperandV, Zero, "nottmp")
+                        : CG.Builder->CreateICmpEQ(OperandV, Zero, "nottmp");
+    return CG.Builder->CreateZExt(IsZero, Type::getInt64Ty(*CG.TheContext),
+                                  "booltmp");
+  }
+
   if (!F) {
     std::string errStr = "Unknown unary operator: ";
-    errStr.push_back(Op);
+    errStr += CG.name(OpFn).drop_front(sizeof("unary") - 1);
     errStr += "\n";
     return LogErrorV(errStr.c_str());
   }
 
-  return Builder->CreateCall(F, OperandV, "unop");
+  OperandV = CG.convert(OperandV, F->getArg(0)->getType());
+  return CG.Builder->CreateCall(F, OperandV, "unop");
 }
 
-Value *BinaryExprAST::handleAssignment() {
-  // We need LHS to be an identifier
-  // There is no RTTI (run time type information), LLVM builds without it by
-  // default. If LLVM is built with RTTI, then this can be changed to
-  // dynamic_cast (and it'll output nullptr if the cast is invalid, so we can
-  // check for errors) static_cast is unsafe because if the LHS is not actually
-  // a VariableExprAST, then this is a UB (undefined behavior)
-
-  VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-  if (!LHSE)
-    return LogErrorV("lhs of = must be a variable");
-
+Value *BinaryExprAST::handleAssignment(CodeGen &CG) {
   // Codegen the rhs
-  Value *Val = RHS->codegen();
+  Value *Val = RHS->codegen(CG);
   if (!Val)
     return nullptr;
 
-  // Look up the name in the symbol table
-  Value *Variable = NamedValues[LHSE->getName()];
-  if (!Variable) {
-    std::string errStr = "unknown variable name";
-    errStr += LHSE->getName() + "\n";
-    return LogErrorV(errStr.c_str());
+  // a[i] = x stores x (as a double) into the element
+  if (auto *Elt = dyn_cast<IndexExprAST>(LHS)) {
+    Value *Addr = Elt->codegenAddress(CG);
+    if (!Addr)
+      return nullptr;
+    Val = CG.convert(Val, ValueType::Double);
+    CG.Builder->CreateStore(Val, Addr);
+    return Val;
   }
 
-  Builder->CreateStore(Val, Variable);
+  // Resolution made sure LHS is a variable otherwise
+  // There is no RTTI (run time type information), LLVM builds without it by
+  // default, but the AST nodes carry their kind so LLVM's cast works.
+  VariableExprAST *LHSE = cast<VariableExprAST>(LHS);
+
+  Val = CG.convert(Val, CG.SlotTypes[LHSE->getSlot()]);
+  CG.Builder->CreateStore(Val, CG.Slots[LHSE->getSlot()]);
   // Returning the value allows for things like chained assignments
   // e.g. X = (Y = Z);
   return Val;
 }
 
-Value *BinaryExprAST::codegen() {
+/// codegenShortCircuit - && and || only evaluate RHS if LHS doesn't decide
+/// the result already. Like the comparisons they give (an int) 0 or 1.
+Value *BinaryExprAST::codegenShortCircuit(CodeGen &CG) {
+  Value *L = LHS->codegen(CG);
+  if (!L)
+    return nullptr;
+
+  L = CG.isTrue(L, "lhscond");
+
+  // LHS can leave us in a block of its own (e.g. a nested &&)
+  BasicBlock *LHSBB = CG.Builder->GetInsertBlock();
+  Function *TheFunction = LHSBB->getParent();
+  BasicBlock *RHSBB = BasicBlock::Create(*CG.TheContext, "rhs", TheFunction);
+  BasicBlock *MergeBB = BasicBlock::Create(*CG.TheContext, "logiccont");
+
+  // a && b only needs b if a is true, a || b only if a is false
+  if (Op == BuiltinOp::And)
+    CG.createBranch(BranchKind::And, L, RHSBB, MergeBB);
+  else
+    CG.createBranch(BranchKind::Or, L, MergeBB, RHSBB);
+
+  CG.Builder->SetInsertPoint(RHSBB);
+  Value *R = RHS->codegen(CG);
+  if (!R)
+    return nullptr;
+  R = CG.isTrue(R, "rhscond");
+  CG.Builder->CreateBr(MergeBB);
+  RHSBB = CG.Builder->GetInsertBlock();
+
+  TheFunction->insert(TheFunction->end(), MergeBB);
+  CG.Builder->SetInsertPoint(MergeBB);
+
+  PHINode *PN =
+      CG.Builder->CreatePHI(Type::getInt1Ty(*CG.TheContext), 2, "logictmp");
+  PN->addIncoming(ConstantInt::getBool(*CG.TheContext, Op == BuiltinOp::Or),
+                  LHSBB);
+  PN->addIncoming(R, RHSBB);
+  return CG.Builder->CreateZExt(PN, Type::getInt64Ty(*CG.TheContext),
+                                "booltmp");
+}
+
+Value *BinaryExprAST::codegen(CodeGen &CG) {
 
   // Special handling of '=' -> we don't want to emit LHS as an expression.
-  if (Op == '=')
-    return handleAssignment();
+  if (Op == BuiltinOp::Assign)
+    return handleAssignment(CG);
+
+  // Defining a built-in operator overloads it, it's then called like any
+  // user-defined one (and && / || no longer short circuit)
+  Function *F = CG.getFunction(OpFn);
+  if (!F && (Op == BuiltinOp::And || Op == BuiltinOp::Or))
+    return codegenShortCircuit(CG);
 
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
+  Value *L = LHS->codegen(CG);
+  Value *R = RHS->codegen(CG);
   if (!L || !R)
     return nullptr;
 
-  switch (Op) {
-  case '+':
-    return Builder->CreateFAdd(L, R, "addtmp");
-  case '-':
-    return Builder->CreateFSub(L, R, "subtmp");
-  case '*':
-    return Builder->CreateFMul(L, R, "multmp");
-  case '<':
-    L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-  default:
-    break; // If it's not one of these, then it must be a user-defined binary
-           // op, so fall through
+  if (F) {
+    Value *Ops[2] = {CG.convert(L, F->getArg(0)->getType()),
+                     CG.convert(R, F->getArg(1)->getType())};
+    return CG.Builder->CreateCall(F, Ops, "binop");
   }
 
-  Function *F = getFunction(std::string("binary") + Op);
-  assert(F && "binary operator not found!");
+  // Only evaluated for its effects
+  if (Op == BuiltinOp::Seq)
+    return R;
+
+  // Two ints are added, compared, etc. as ints (wrapping around on
+  // overflow), anything else as doubles. Division always gives a double.
+  bool Ints = LHS->getType() == ValueType::Int &&
+              RHS->getType() == ValueType::Int && Op != BuiltinOp::Div;
+  if (!Ints) {
+    L = CG.convert(L, ValueType::Double);
+    R = CG.convert(R, ValueType::Double);
+  }
 
-  Value *Ops[2] = {L, R};
-  return Builder->CreateCall(F, Ops, "binop");
+  switch (Op) {
+  case BuiltinOp::Add:
+    return Ints ? CG.Builder->CreateAdd(L, R, "addtmp")
+                : CG.Builder->CreateFAdd(L, R, "addtmp");
+  case BuiltinOp::Sub:
+    return Ints ? CG.Builder->CreateSub(L, R, "subtmp")
+                : CG.Builder->CreateFSub(L, R, "subtmp");
+  case BuiltinOp::Mul:
+    return Ints ? CG.Builder->CreateMul(L, R, "multmp")
+                : CG.Builder->CreateFMul(L, R, "multmp");
+  case BuiltinOp::Div:
+    return CG.Builder->CreateFDiv(L, R, "divtmp");
+  case BuiltinOp::Less:
+    L = Ints ? CG.Builder->CreateICmpSLT(L, R, "cmptmp")
+             : CG.Builder->CreateFCmpULT(L, R, "cmptmp");
+    break;
+  case BuiltinOp::Greater:
+    L = Ints ? CG.Builder->CreateICmpSGT(L, R, "cmptmp")
+             : CG.Builder->CreateFCmpUGT(L, R, "cmptmp");
+    break;
+  case BuiltinOp::LessEqual:
+    L = Ints ? CG.Builder->CreateICmpSLE(L, R, "cmptmp")
+             : CG.Builder->CreateFCmpULE(L, R, "cmptmp");
+    break;
+  case BuiltinOp::GreaterEqual:
+    L = Ints ? CG.Builder->CreateICmpSGE(L, R, "cmptmp")
+             : CG.Builder->CreateFCmpUGE(L, R, "cmptmp");
+    break;
+  case BuiltinOp::Equal:
+    L = Ints ? CG.Builder->CreateICmpEQ(L, R, "cmptmp")
+             : CG.Builder->CreateFCmpOEQ(L, R, "cmptmp");
+    break;
+  case BuiltinOp::NotEqual:
+    L = Ints ? CG.Builder->CreateICmpNE(L, R, "cmptmp")
+             : CG.Builder->CreateFCmpUNE(L, R, "cmptmp");
+    break;
+  default: {
+    // A user-defined operator whose definition didn't compile
+    std::string errStr = "Unknown binary operator: ";
+    errStr += CG.name(OpFn).drop_front(sizeof("binary") - 1);
+    errStr += "\n";
+    return LogErrorV(errStr.c_str());
+  }
+  }
+
+  // Convert bool 0/1 to int 0 or 1
+  return CG.Builder->CreateZExt(L, Type::getInt64Ty(*CG.TheContext),
+                                "booltmp");
 }
 
-Value *CallExprAST::codegen() {
+Value *CallExprAST::codegen(CodeGen &CG) {
+  // A call of an effect-free function on constants gives a constant
+  if (CG.ConstEval)
+    if (auto V = CG.ConstEval->evaluate(this, CG.CurrentFunction)) {
+      if (V->Ty == ValueType::Int)
+        return ConstantInt::getSigned(Type::getInt64Ty(*CG.TheContext), V->I);
+      return ConstantFP::get(*CG.TheContext, APFloat(V->D));
+    }
+
   // Look up the name in the global module table.
-  Function *CalleeF = getFunction(Callee);
+  Function *CalleeF = CG.getFunction(Callee);
   if (!CalleeF)
     return LogErrorV("Unknown function referenced");
 
@@ -165,332 +866,604 @@ Value *CallExprAST::codegen() {
 
   std::vector<Value *> ArgsV;
   for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
+    Value *ArgV = Args[i]->codegen(CG);
+    if (!ArgV)
       return nullptr;
+    ArgsV.push_back(CG.convert(ArgV, CalleeF->getArg(i)->getType()));
   }
 
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  auto PI = CG.FunctionProtos.find(Callee);
+  if (PI != CG.FunctionProtos.end())
+    if (Intrinsic::ID ID = getMathIntrinsic(*PI->second, CalleeF->getName()))
+      return CG.Builder->CreateIntrinsic(ID, {CalleeF->getReturnType()}, ArgsV,
+                                         nullptr, "calltmp");
+
+  return CG.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
-Function *PrototypeAST::codegen() {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-  FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+Value *ArrayExprAST::codegen(CodeGen &CG) {
+  Value *N = Size->codegen(CG);
+  if (!N)
+    return nullptr;
+  N = CG.convert(N, ValueType::Int);
+
+  Value *Data = CG.Builder->CreateCall(arrayNewFn(CG), N, "data");
+  Value *Arr = PoisonValue::get(CG.getType(ValueType::Array));
+  Arr = CG.Builder->CreateInsertValue(Arr, Data, 0);
+  return CG.Builder->CreateInsertValue(Arr, N, 1, "array");
+}
+
+Value *IndexExprAST::codegenAddress(CodeGen &CG) {
+  Value *Arr = Array->codegen(CG);
+  Value *Idx = Index->codegen(CG);
+  if (!Arr || !Idx)
+    return nullptr;
+  Idx = CG.convert(Idx, ValueType::Int);
+
+  // The length is a plain SSA value next to the pointer, so in a loop like
+  // `for i = 0, i < len(a) in ... a[i] ...` the check is provably true and
+  // goes away, the loop can then be vectorized. One unsigned compare also
+  // catches negative indices.
+  Value *Len = CG.Builder->CreateExtractValue(Arr, 1, "len");
+  Value *InBounds = CG.Builder->CreateICmpULT(Idx, Len, "inbounds");
+
+  Function *TheFunction = CG.Builder->GetInsertBlock()->getParent();
+  BasicBlock *FailBB =
+      BasicBlock::Create(*CG.TheContext, "outofbounds", TheFunction);
+  BasicBlock *OkBB = BasicBlock::Create(*CG.TheContext, "inbounds");
+  CG.Builder->CreateCondBr(InBounds, OkBB, FailBB);
+
+  CG.Builder->SetInsertPoint(FailBB);
+  CG.Builder->CreateCall(boundsFailFn(CG), {Idx, Len});
+  CG.Builder->CreateUnreachable();
+
+  TheFunction->insert(TheFunction->end(), OkBB);
+  CG.Builder->SetInsertPoint(OkBB);
+  Value *Data = CG.Builder->CreateExtractValue(Arr, 0, "data");
+  return CG.Builder->CreateInBoundsGEP(Type::getDoubleTy(*CG.TheContext),
+                                       Data, Idx, "elt");
+}
+
+Value *IndexExprAST::codegen(CodeGen &CG) {
+  Value *Addr = codegenAddress(CG);
+  if (!Addr)
+    return nullptr;
+  return CG.Builder->CreateLoad(Type::getDoubleTy(*CG.TheContext), Addr,
+                                "eltval");
+}
+
+Value *LengthExprAST::codegen(CodeGen &CG) {
+  Value *Arr = Array->codegen(CG);
+  if (!Arr)
+    return nullptr;
+  return CG.Builder->CreateExtractValue(Arr, 1, "len");
+}
+
+static void addEffects(Function &F, const FunctionEffects &E) {
+  if (E.DoesNotAccessMemory)
+    F.setDoesNotAccessMemory();
+  else if (E.OnlyReadsMemory)
+    F.setOnlyReadsMemory();
+  if (E.DoesNotThrow)
+    F.setDoesNotThrow();
+  if (E.WillReturn)
+    F.setWillReturn();
+  if (E.Speculatable)
+    F.addFnAttr(Attribute::Speculatable);
+}
+
+/// The effects of the optimized (and attribute inferred) F. Declared pure
+/// functions don't access memory, as far as their callers can tell (their
+/// memo tables and arrays are their own business). Their bodies do, so with
+/// Pure these are for callers' declarations only.
+static FunctionEffects inferEffects(const Function &F, bool Pure) {
+  FunctionEffects E;
+  E.DoesNotAccessMemory = Pure || F.doesNotAccessMemory();
+  E.OnlyReadsMemory = E.DoesNotAccessMemory || F.onlyReadsMemory();
+  // Athens has no exceptions, only the externs could throw
+  E.DoesNotThrow = Pure || F.doesNotThrow();
+  E.WillReturn = F.willReturn();
+
+  // Calling it early or needlessly is harmless if it doesn't do anything
+  // but compute its result, with nothing else it calls doing more
+  E.Speculatable = E.DoesNotAccessMemory && E.DoesNotThrow && E.WillReturn;
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB)
+      if (auto *Call = dyn_cast<CallBase>(&I)) {
+        const Function *Callee = Call->getCalledFunction();
+        if (!Callee || !Callee->hasFnAttribute(Attribute::Speculatable))
+          E.Speculatable = false;
+      }
+  return E;
+}
+
+Function *PrototypeAST::codegen(CodeGen &CG) {
+  // Make the function type:  double(double,int) etc.
+  std::vector<Type *> ArgTys;
+  for (ValueType Ty : ArgTypes)
+    ArgTys.push_back(CG.getType(Ty));
+  FunctionType *FT = FunctionType::get(CG.getType(RetType), ArgTys, false);
 
   Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+      Function::Create(FT, Function::ExternalLinkage, CG.name(Name),
+                       CG.TheModule.get());
 
   // Set names for all arguments.
   unsigned Idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+    Arg.setName(CG.name(Args[Idx++]));
 
+  addEffects(*F, Effects);
   return F;
 }
 
-Function *FunctionAST::codegen() {
-  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
-  auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
+Function *FunctionAST::codegen(CodeGen &CG) {
+  // First, check for an existing declaration in this module (e.g. an extern)
+  Function *TheFunction =
+      CG.TheModule->getFunction(CG.name(Proto->getName()));
 
-  Function *TheFunction = getFunction(P.getName());
+  if (!TheFunction)
+    TheFunction = Proto->codegen(CG);
 
   if (!TheFunction)
     return nullptr;
 
-  // If this is a user defined binary operator, install it
-  if (P.isBinaryOp())
-    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+  assert(Resolved && "codegen of a function that wasn't resolved");
+  CG.CurrentFunction = Proto->getName();
 
   // Create a new basic block to start insertion into.
-  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-  Builder->SetInsertPoint(BB);
+  BasicBlock *BB = BasicBlock::Create(*CG.TheContext, "entry", TheFunction);
+  CG.Builder->SetInsertPoint(BB);
+
+  // The types of the slots and expressions depend on the prototypes of the
+  // callees, so (unlike names) they're only known now
+  TypeInference TI(CG.FunctionProtos, *Proto, NumSlots);
+  if (!TI.run(Body)) {
+    TheFunction->eraseFromParent();
+    return nullptr;
+  }
+  CG.SlotTypes.assign(TI.getSlotTypes().begin(), TI.getSlotTypes().end());
 
-  // Record the function arguments in the NamedValues map.
-  NamedValues.clear();
+  // One slot per binding in the function, the arguments come first.
+  CG.Slots.assign(NumSlots, nullptr);
   for (auto &Arg : TheFunction->args()) {
-    // NamedValues[std::string(Arg.getName())] = &Arg;
-
     // Crate an alloca for this variable
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, Arg.getType(), Arg.getName());
 
     // Store initial value
-    Builder->CreateStore(&Arg, Alloca);
+    CG.Builder->CreateStore(&Arg, Alloca);
 
     // Now add it to the symbol table
-    NamedValues[std::string(Arg.getName())] = Alloca;
+    CG.Slots[Arg.getArgNo()] = Alloca;
+  }
+  CG.beginProfile(*TheFunction);
+
+  // Pure functions get a memo table of their own, every definition (and
+  // redefinition) a new one. Ones that don't call anything are cheaper to
+  // run again than to look up.
+  Value *MemoKey = nullptr;
+  if (Proto->isPure() && TI.callsFunctions()) {
+    Proto->setMemoTable(athens_memo_new(TheFunction->arg_size()));
+    MemoKey = emitMemoLookup(CG, *TheFunction, memoTableId(CG, *TheFunction));
   }
 
-  if (Value *RetVal = Body->codegen()) {
+  if (Value *RetVal = Body->codegen(CG)) {
+    RetVal = CG.convert(RetVal, TheFunction->getReturnType());
+
     // Finish off the function.
-    Builder->CreateRet(RetVal);
+    if (MemoKey)
+      emitMemoStore(CG, memoTableId(CG, *TheFunction), MemoKey, RetVal);
+    releaseArraysOnReturn(CG, *TheFunction, RetVal);
+    CG.Builder->CreateRet(RetVal);
+    CG.finishProfile(/*Generated=*/true);
 
     // Validate the generated code, checking for consistency.
     verifyFunction(*TheFunction);
 
-    // Run the optimizer on the function.
-    TheFPM->run(*TheFunction, *TheFAM);
+    // Inline small functions defined in earlier modules.
+    if (CG.importInlineBodies())
+      CG.TheMPM->run(*CG.TheModule, *CG.TheMAM);
+
+    // Run the optimizer on the function, and the parfor bodies outlined from
+    // it.
+    for (Function &F : *CG.TheModule)
+      if (!F.isDeclaration() && !F.hasAvailableExternallyLinkage())
+        CG.TheFPM->run(F, *CG.TheFAM);
+
+    // Calls to it in later modules get its effects on the declaration
+    CG.TheAttrMPM->run(*CG.TheModule, *CG.TheMAM);
+    Proto->setEffects(inferEffects(*TheFunction, Proto->isPure()));
+    addEffects(*TheFunction, inferEffects(*TheFunction, /*Pure=*/false));
+
+    // The imported bodies have done their job, the module goes to the JIT
+    // (and maybe to InlineBodies) with declarations only.
+    for (Function &F : *CG.TheModule)
+      if (F.hasAvailableExternallyLinkage())
+        F.deleteBody();
+    // And so are the copies of internal functions nothing inlined
+    for (Function &F : make_early_inc_range(*CG.TheModule))
+      if (F.hasLocalLinkage() && F.use_empty())
+        F.eraseFromParent();
 
     return TheFunction;
   }
 
   // Error reading body, remove function.
+  CG.finishProfile(/*Generated=*/false);
   TheFunction->eraseFromParent();
 
-  if (P.isBinaryOp())
-    BinopPrecedence.erase(P.getOperatorName());
-
   return nullptr;
 }
 
-Value *IfExprAST::codegen() {
-  Value *CondV = Cond->codegen();
+Value *IfExprAST::codegen(CodeGen &CG) {
+  Value *CondV = Cond->codegen(CG);
   if (!CondV)
     return nullptr;
 
-  CondV = Builder->CreateFCmpONE(
-      CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+  CondV = CG.isTrue(CondV, "ifcond");
 
-  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Function *TheFunction = CG.Builder->GetInsertBlock()->getParent();
 
   // Blocks for then and else cases.
-  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
-  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+  BasicBlock *ThenBB = BasicBlock::Create(*CG.TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(*CG.TheContext, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(*CG.TheContext, "ifcont");
 
   // This emits the conditional branch code:
   // br i1 %ifcond, label %then, label %else
-  Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+  CG.createBranch(BranchKind::If, CondV, ThenBB, ElseBB);
 
   // Emit then value
   //
-  Builder->SetInsertPoint(ThenBB);
+  CG.Builder->SetInsertPoint(ThenBB);
 
-  Value *ThenV = Then->codegen();
+  // Both branches give the if's type, an int one might need a conversion
+  Value *ThenV = Then->codegen(CG);
   if (!ThenV)
     return nullptr;
+  ThenV = CG.convert(ThenV, getType());
 
   // Emit an unconditional branch to jump to the merger
   // br label %ifcont
-  Builder->CreateBr(MergeBB);
+  CG.Builder->CreateBr(MergeBB);
 
   // codegen of 'Then' can change the current block, e.g. nested if,
   // so update ThenBB for the PHI with the up-to-date value.
-  ThenBB = Builder->GetInsertBlock();
+  ThenBB = CG.Builder->GetInsertBlock();
 
   // Emit else block
   TheFunction->insert(TheFunction->end(), ElseBB);
-  Builder->SetInsertPoint(ElseBB);
+  CG.Builder->SetInsertPoint(ElseBB);
 
-  Value *ElseV = Else->codegen();
+  Value *ElseV = Else->codegen(CG);
   if (!ElseV)
     return nullptr;
+  ElseV = CG.convert(ElseV, getType());
 
   // unconditional jump to the merger block
-  Builder->CreateBr(MergeBB);
+  CG.Builder->CreateBr(MergeBB);
 
   // Same reason as bbefore, Else->codegen can create bunch of blocks,
   // We need to make sure we have a handle of the last of them
   // to wire up the Phi node correctly
-  ElseBB = Builder->GetInsertBlock();
+  ElseBB = CG.Builder->GetInsertBlock();
 
   // Emit merge block
   TheFunction->insert(TheFunction->end(), MergeBB);
-  Builder->SetInsertPoint(MergeBB);
+  CG.Builder->SetInsertPoint(MergeBB);
 
-  PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+  PHINode *PN = CG.Builder->CreatePHI(CG.getType(getType()), 2, "iftmp");
 
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
   return PN;
 }
 
-Value *VarExprAST::codegen() {
-  std::vector<AllocaInst *> OldBindings;
-
-  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+Value *VarExprAST::codegen(CodeGen &CG) {
+  Function *TheFunction = CG.Builder->GetInsertBlock()->getParent();
 
   // Register all variables and emit their initializers.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-    const std::string &VarName = VarNames[i].first;
-    ExprAST *Init = VarNames[i].second.get();
+  for (const auto &Binding : VarNames) {
+    ExprAST *Init = Binding.Init;
 
     // Emit initialized *before* putting the variable in scope.
     // 1) if x is not defined, I don't wanna deal with x = x;
     // 2) if x is defined, I want to support x = x; (x in RHS refers to the old
     // value)
+    Type *Ty = CG.getType(CG.SlotTypes[Binding.Slot]);
     Value *InitVal;
     if (Init) {
-      InitVal = Init->codegen();
+      InitVal = Init->codegen(CG);
       if (!InitVal)
         return nullptr;
+      InitVal = CG.convert(InitVal, Ty);
     } else {
-      // default to 0.0 if not initialized
-      InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
+      // default to 0 if not initialized
+      InitVal = Constant::getNullValue(Ty);
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    Builder->CreateStore(InitVal, Alloca);
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, Ty, CG.name(Binding.Name));
+    CG.Builder->CreateStore(InitVal, Alloca);
 
-    // Remember the old value so we can restore it when we're done generating
-    // code for these assignments in this var/in block (i.e. deshadow)
-    OldBindings.push_back(NamedValues[VarName]);
-
-    NamedValues[VarName] = Alloca;
+    // A shadowing binding has a slot of its own, nothing to save/restore
+    CG.Slots[Binding.Slot] = Alloca;
   }
 
   // codegen the body
-  Value *BodyVal = Body->codegen();
-  if (!BodyVal)
-    return nullptr;
-
-  // pop all vars out of scope
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    NamedValues[VarNames[i].first] = OldBindings[i];
-
-  return BodyVal;
+  return Body->codegen(CG);
 }
 
-Value *ForExprAST::codegen() {
-  // Output will be several blocks (With the phi node)
-  //
-  // entry
-  //  start = startexpr
-  //  goto loop
-  //
-  // loop
-  //  variable = phi [start, entry], [nextVarible, loopend]
-  //  ...
-  //  body (<- this can be multiple blocks)
-  //  ...
-  //
-  // loopend
-  //    step = stepexpr
-  //    nextVariable = variable + step
-  //    endcond = endexpr
-  //    br endcond, loop, afterloop
-  //
-  // afterloop
-  //
-  // ---------------------------
-  //
-  // Output without the phi node (using alloca + mem2reg)
+Value *ForExprAST::codegen(CodeGen &CG) {
+  // Lowered the way LLVM's loop passes want it (rotated, with a guard):
   //
   // entry:
-  //  VAR = alloca double
-  //
   //  start = startexpr
-  //  store start -> VAR
-  //  goto loop
+  //  guard = endexpr (with i = start)
+  //  br guard, preheader, afterloop
   //
-  // loop:
-  //  bodyexpr (<- can be multiple blocks)
+  // preheader:
+  //  br loop
   //
-  // loopend:
+  // loop:
+  //  i = phi [start, preheader], [next, loop]
+  //  body (<- this can be multiple blocks)
   //  step = stepexpr
-  //  endcond = endexpr
+  //  next = i + step
+  //  endcond = endexpr (with i = next)
+  //  br endcond, loop, loopexit
   //
-  //  curvar = load VAR
-  //  nextvar = curvar + step
-  //  store nextvar -> VAR
-  //  br endcond, loop, afterloop
+  // loopexit:
+  //  br afterloop
   //
   // afterloop:
   //  .....
   //
+  // If the body (or the condition, or the step) assigns to i it's kept in an
+  // alloca instead of the phi, mem2reg makes it a phi later on.
 
-  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Function *TheFunction = CG.Builder->GetInsertBlock()->getParent();
 
-  // Create Alloca for the loop variable (in the entry block)
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+  // The loop variable is an int unless a double is stored into it
+  Type *VarTy = CG.getType(CG.SlotTypes[Slot]);
 
   // Emit start code without variable in scope
-  Value *StartVal = Start->codegen();
+  Value *StartVal = Start->codegen(CG);
   if (!StartVal)
     return nullptr;
+  StartVal = CG.convert(StartVal, VarTy);
 
-  // Store the value into the alloca (i.e. create a store instruction)
-  Builder->CreateStore(StartVal, Alloca);
-
-  // Reemember the preheader for the phi node
-  // BasicBlock *PreheaderBB = Builder->GetInsertBlock();
-  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
-
-  // Fall through the loopBB (<-- goto loop)
-  Builder->CreateBr(LoopBB);
-
-  // Start inserting into the LoopBB
-  Builder->SetInsertPoint(LoopBB);
-
-  // Start phi node with an entry for Start
-  // PHINode *Variable = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2,
-  // VarName);
-  // Variable->addIncoming(StartVal, PreheaderBB);
+  AllocaInst *Alloca = nullptr;
+  if (VarAssigned) {
+    Alloca = CreateEntryBlockAlloca(TheFunction, VarTy, CG.name(VarName));
+    CG.Builder->CreateStore(StartVal, Alloca);
+    CG.Slots[Slot] = Alloca;
+  } else {
+    // If it shadows an existing variable that one has another slot
+    CG.Slots[Slot] = StartVal;
+  }
 
-  // Within the loop, the variable is defined equal to the PHI node. If it
-  // shadows an existing variable,   we have to restore it, so save now
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+  // Don't enter the loop at all if the condition doesn't hold for start
+  Value *GuardCond = End->codegen(CG);
+  if (!GuardCond)
+    return nullptr;
+  GuardCond = CG.isTrue(GuardCond, "loopguard");
+
+  BasicBlock *PreheaderBB =
+      BasicBlock::Create(*CG.TheContext, "preheader", TheFunction);
+  BasicBlock *LoopBB = BasicBlock::Create(*CG.TheContext, "loop");
+  BasicBlock *ExitBB = BasicBlock::Create(*CG.TheContext, "loopexit");
+  BasicBlock *AfterBB = BasicBlock::Create(*CG.TheContext, "afterloop");
+  CG.createBranch(BranchKind::LoopGuard, GuardCond, PreheaderBB, AfterBB);
+
+  CG.Builder->SetInsertPoint(PreheaderBB);
+  CG.Builder->CreateBr(LoopBB);
+
+  TheFunction->insert(TheFunction->end(), LoopBB);
+  CG.Builder->SetInsertPoint(LoopBB);
+
+  PHINode *Variable = nullptr;
+  if (!VarAssigned) {
+    Variable = CG.Builder->CreatePHI(VarTy, 2, CG.name(VarName));
+    Variable->addIncoming(StartVal, PreheaderBB);
+    CG.Slots[Slot] = Variable;
+  }
 
   // Emit the body of the loop
   // This, like any other expr, can create many blocks.
   // Though we don't care about the result of the body, we raise the errors
-  if (!Body->codegen())
+  if (!Body->codegen(CG))
     return nullptr;
 
   // Emit the step value
   Value *StepVal = nullptr;
   if (Step) {
-    StepVal = Step->codegen();
+    StepVal = Step->codegen(CG);
     if (!StepVal)
       return nullptr;
+    StepVal = CG.convert(StepVal, VarTy);
   } else {
-    // default to 1.0
-    StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    // default to 1
+    StepVal = VarTy->isDoubleTy() ? ConstantFP::get(VarTy, 1.0)
+                                  : ConstantInt::get(VarTy, 1);
   }
 
-  // Value *NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");
+  Value *CurVal = Variable;
+  if (Alloca)
+    CurVal = CG.Builder->CreateLoad(VarTy, Alloca, CG.name(VarName));
+  Value *NextVar = VarTy->isDoubleTy()
+                       ? CG.Builder->CreateFAdd(CurVal, StepVal, "nextvar")
+                       : CG.Builder->CreateNSWAdd(CurVal, StepVal, "nextvar");
+  if (Alloca)
+    CG.Builder->CreateStore(NextVar, Alloca);
+  else
+    CG.Slots[Slot] = NextVar;
 
-  // Compute the end condition
-  Value *EndCond = End->codegen();
+  // Compute the end condition for the next iteration
+  Value *EndCond = End->codegen(CG);
   if (!EndCond)
     return nullptr;
+  EndCond = CG.isTrue(EndCond, "loopcond");
 
-  // Convert condition to a bool by comparing non-equal to 0.0
-  EndCond = Builder->CreateFCmpONE(
-      EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+  // The body can end in a block of its own
+  BasicBlock *LoopEndBB = CG.Builder->GetInsertBlock();
+  CG.createBranch(BranchKind::LoopLatch, EndCond, LoopBB, ExitBB);
+  if (Variable)
+    Variable->addIncoming(NextVar, LoopEndBB);
 
-  // load, increment, and re-store the alloca (the loop variable)
-  // Note that because it's an Alloca, any BasicBlocks in the loop body can
-  // freely mutate the variable and it'll all be reflected in the "store"
-  Value *CurVal =
-      Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
-  Value *NextVar = Builder->CreateFAdd(CurVal, StepVal, "nextvar");
-  Builder->CreateStore(NextVar, Alloca);
+  TheFunction->insert(TheFunction->end(), ExitBB);
+  CG.Builder->SetInsertPoint(ExitBB);
+  CG.Builder->CreateBr(AfterBB);
 
-  // Create the afterloop block and insert it
-  // BasicBlock *LoopEndBB = Builder->GetInsertBlock();
-  BasicBlock *AfterBB =
-      BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+  // Any new code will be inserted in After BB
+  TheFunction->insert(TheFunction->end(), AfterBB);
+  CG.Builder->SetInsertPoint(AfterBB);
 
-  // insert the conditional branch into the end of LoopEndBB
-  Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  // for expr returns 0.0 for now
+  return Constant::getNullValue(Type::getDoubleTy(*CG.TheContext));
+}
 
-  // Any new code will be inserted in After BB
-  Builder->SetInsertPoint(AfterBB);
+/// The outlined body of a parfor: `double body(ptr env, i64 begin, i64 end)`
+/// runs iterations [begin, end) and gives their reduction. The runtime calls
+/// it with consecutive chunks of the whole range, possibly on several threads
+/// at once.
+///
+/// entry:
+///  captures = load env
+///  br begin < end, loop, exit
+///
+/// loop:
+///  i = phi [begin, entry], [next, loop]
+///  acc = phi [identity, entry], [acc.next, loop]
+///  acc.next = acc op body
+///  next = i + 1
+///  br next < end, loop, exit
+///
+/// exit:
+///  ret phi [identity, entry], [acc.next, loop]
+Function *ParforExprAST::codegenBody(CodeGen &CG, StructType *EnvTy) {
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
+  Type *DoubleTy = Type::getDoubleTy(*CG.TheContext);
+  FunctionType *FT = FunctionType::get(
+      DoubleTy, {PointerType::getUnqual(*CG.TheContext), I64, I64}, false);
+
+  // Internal, so nothing outside the module refers to it by name and the
+  // names of bodies never clash in the JIT
+  Function *Parent = CG.Builder->GetInsertBlock()->getParent();
+  Function *F = Function::Create(FT, Function::InternalLinkage,
+                                 Parent->getName() + ".parfor",
+                                 CG.TheModule.get());
+  Value *Env = F->getArg(0), *Begin = F->getArg(1), *End = F->getArg(2);
+  Env->setName("env");
+  Begin->setName("begin");
+  End->setName("end");
+
+  BasicBlock *EntryBB = BasicBlock::Create(*CG.TheContext, "entry", F);
+  BasicBlock *LoopBB = BasicBlock::Create(*CG.TheContext, "loop", F);
+  BasicBlock *ExitBB = BasicBlock::Create(*CG.TheContext, "exit");
+  CG.Builder->SetInsertPoint(EntryBB);
+
+  // The body can't assign the captured variables, their values can live in
+  // registers
+  for (unsigned Idx = 0, E = Captures.size(); Idx != E; ++Idx) {
+    Value *Field = CG.Builder->CreateStructGEP(EnvTy, Env, Idx);
+    CG.Slots[Captures[Idx]] = CG.Builder->CreateLoad(
+        EnvTy->getElementType(Idx), Field, "captured");
+  }
+
+  Value *Identity =
+      ConstantFP::get(DoubleTy, Reduce == BuiltinOp::Mul ? 1.0 : 0.0);
+  CG.Builder->CreateCondBr(CG.Builder->CreateICmpSLT(Begin, End, "guard"),
+                           LoopBB, ExitBB);
+
+  CG.Builder->SetInsertPoint(LoopBB);
+  PHINode *Counter = CG.Builder->CreatePHI(I64, 2, CG.name(VarName));
+  PHINode *Acc = CG.Builder->CreatePHI(DoubleTy, 2, "acc");
+  Counter->addIncoming(Begin, EntryBB);
+  Acc->addIncoming(Identity, EntryBB);
+  CG.Slots[Slot] = Counter;
+
+  Value *BodyVal = Body->codegen(CG);
+  if (!BodyVal) {
+    F->eraseFromParent();
+    return nullptr;
+  }
 
-  // Add the new entry to the phi node
-  // Variable->addIncoming(NextVar, LoopEndBB);
+  Value *NextAcc = Acc;
+  if (Reduce != BuiltinOp::None) {
+    BodyVal = CG.convert(BodyVal, DoubleTy);
+    NextAcc = Reduce == BuiltinOp::Mul
+                  ? CG.Builder->CreateFMul(Acc, BodyVal, "acc.next")
+                  : CG.Builder->CreateFAdd(Acc, BodyVal, "acc.next");
+  }
+  Value *Next = CG.Builder->CreateNSWAdd(Counter, ConstantInt::get(I64, 1),
+                                         "next");
+  BasicBlock *LoopEndBB = CG.Builder->GetInsertBlock();
+  CG.Builder->CreateCondBr(CG.Builder->CreateICmpSLT(Next, End, "loopcond"),
+                           LoopBB, ExitBB);
+  Counter->addIncoming(Next, LoopEndBB);
+  Acc->addIncoming(NextAcc, LoopEndBB);
+
+  F->insert(F->end(), ExitBB);
+  CG.Builder->SetInsertPoint(ExitBB);
+  PHINode *Result = CG.Builder->CreatePHI(DoubleTy, 2, "result");
+  Result->addIncoming(Identity, EntryBB);
+  Result->addIncoming(NextAcc, LoopEndBB);
+  releaseArraysOnReturn(CG, *F, Result);
+  CG.Builder->CreateRet(Result);
+
+  verifyFunction(*F);
+  return F;
+}
 
-  // Restore the unshadowed variable
-  if (OldVal)
-    NamedValues[VarName] = OldVal;
-  else
-    NamedValues.erase(VarName);
+Value *ParforExprAST::codegen(CodeGen &CG) {
+  Type *I64 = Type::getInt64Ty(*CG.TheContext);
 
-  // for expr returns 0.0 for now
-  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  Value *StartVal = Start->codegen(CG);
+  Value *EndVal = End->codegen(CG);
+  if (!StartVal || !EndVal)
+    return nullptr;
+  StartVal = CG.convert(StartVal, I64);
+  EndVal = CG.convert(EndVal, I64);
+
+  // Pass the captured variables' current values in a struct
+  SmallVector<Type *, 8> FieldTys;
+  SmallVector<Value *, 8> Fields;
+  for (unsigned CapturedSlot : Captures) {
+    Value *V = CG.Slots[CapturedSlot];
+    if (auto *A = dyn_cast<AllocaInst>(V))
+      V = CG.Builder->CreateLoad(A->getAllocatedType(), A);
+    FieldTys.push_back(V->getType());
+    Fields.push_back(V);
+  }
+  StructType *EnvTy = StructType::get(*CG.TheContext, FieldTys);
+
+  Function *Parent = CG.Builder->GetInsertBlock()->getParent();
+  AllocaInst *Env = CreateEntryBlockAlloca(Parent, EnvTy, "parfor.env");
+  for (unsigned Idx = 0, E = Fields.size(); Idx != E; ++Idx)
+    CG.Builder->CreateStore(Fields[Idx],
+                            CG.Builder->CreateStructGEP(EnvTy, Env, Idx));
+
+  // The body is generated into a function of its own, in the middle of this
+  // one's codegen. Its slots are the same ones, put ours back afterwards.
+  auto IP = CG.Builder->saveIP();
+  std::vector<Value *> SavedSlots = CG.Slots;
+  Function *BodyFn = codegenBody(CG, EnvTy);
+  CG.Slots = std::move(SavedSlots);
+  CG.Builder->restoreIP(IP);
+  if (!BodyFn)
+    return nullptr;
+
+  // double athens_parfor(ptr body, ptr env, i64 start, i64 end, i64 reduce)
+  Type *Ptr = PointerType::getUnqual(*CG.TheContext);
+  FunctionCallee ParforFn =
+      runtimeFunction(CG, "athens_parfor", Type::getDoubleTy(*CG.TheContext),
+                      Ptr, Ptr, I64, I64, I64);
+  AthensReduction R = Reduce == BuiltinOp::Add   ? AthensSum
+                      : Reduce == BuiltinOp::Mul ? AthensProduct
+                                                 : AthensNoReduction;
+  return CG.Builder->CreateCall(
+      ParforFn, {BodyFn, Env, StartVal, EndVal, ConstantInt::get(I64, R)},
+      "parfor");
 }
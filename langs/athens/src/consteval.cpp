@@ -0,0 +1,56 @@
+#include "consteval.h"
+#include "error.h"
+#include "typecheck.h"
+
+using namespace llvm;
+
+void ConstEvaluator::define(const PrototypeAST &Proto, ExprAST *Body,
+                            ArrayRef<ValueType> SlotTypes,
+                            std::shared_ptr<ASTContext> Ctx) {
+  Definitions.erase(Proto.getName());
+  if (!Fuel || !Proto.getEffects().DoesNotAccessMemory)
+    return;
+
+  auto PI = FunctionProtos.find(Proto.getName());
+  if (PI == FunctionProtos.end())
+    return;
+  Definitions[Proto.getName()] = {PI->second.get(), Body,
+                                  std::vector<ValueType>(SlotTypes.begin(),
+                                                         SlotTypes.end()),
+                                  std::move(Ctx)};
+}
+
+const ConstEvaluator::Definition *ConstEvaluator::lookup(Symbol Name) const {
+  auto DI = Definitions.find(Name);
+  if (DI == Definitions.end())
+    return nullptr;
+  auto PI = FunctionProtos.find(Name);
+  if (PI == FunctionProtos.end() || PI->second.get() != DI->second.Proto)
+    return nullptr;
+  return &DI->second;
+}
+
+std::optional<EvalValue>
+ConstEvaluator::evaluate(FunctionAST &TopLevel) const {
+  if (!Fuel)
+    return std::nullopt;
+
+  // The body's types, its codegen reports the errors if there are any
+  std::string Errors;
+  error::ErrorCapture Capture(Errors);
+  TypeInference TI(FunctionProtos, TopLevel.getProto(),
+                   TopLevel.getNumSlots());
+  if (!TI.run(TopLevel.getBody()))
+    return std::nullopt;
+
+  Evaluation E(*this, TopLevel.getProto().getName());
+  return E.run(TopLevel.getBody(), TI.getSlotTypes());
+}
+
+std::optional<EvalValue> ConstEvaluator::evaluate(ExprAST *E,
+                                                  Symbol Self) const {
+  if (!Fuel)
+    return std::nullopt;
+  Evaluation Eval(*this, Self);
+  return E->evaluate(Eval);
+}
@@ -2,7 +2,30 @@
 
 #include "error.h"
 
+// Where errors on this thread go, stderr if null
+static thread_local std::string *CapturedErrors = nullptr;
+
+static void emit(const std::string &Msg) {
+  if (CapturedErrors)
+    *CapturedErrors += Msg;
+  else
+    fputs(Msg.c_str(), stderr);
+}
+
 void error::logError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+  emit(std::string("Error: ") + Str + "\n");
   return;
 }
+
+void error::Diagnostics::error(const frontend::lex::SourceLoc &Loc,
+                               std::string_view Message) {
+  emit("Error: " + std::to_string(Loc.start_line) + ":" +
+       std::to_string(Loc.start_column) + ": " + std::string(Message) + "\n");
+}
+
+error::ErrorCapture::ErrorCapture(std::string &Out)
+    : Previous(CapturedErrors) {
+  CapturedErrors = &Out;
+}
+
+error::ErrorCapture::~ErrorCapture() { CapturedErrors = Previous; }
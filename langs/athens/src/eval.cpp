@@ -0,0 +1,437 @@
+#include "eval.h"
+#include "consteval.h"
+#include "interp.h"
+#include "runtime.h"
+
+#include <bit>
+
+using namespace llvm;
+
+/* Evaluation */
+
+Evaluation::Evaluation(const ConstEvaluator &Consts, Symbol Self)
+    : Consts(&Consts), Self(Self), FuelLeft(Consts.Fuel) {}
+
+bool Evaluation::step() {
+  if (Interp)
+    return true;
+  if (!FuelLeft)
+    return false;
+  --FuelLeft;
+  return true;
+}
+
+EvalValue *Evaluation::slot(unsigned Slot) {
+  if (!Slots || Slot >= Slots->size())
+    return nullptr;
+  return &(*Slots)[Slot];
+}
+
+std::optional<EvalValue> Evaluation::convert(EvalValue V,
+                                             ValueType To) const {
+  if (V.Ty == To)
+    return V;
+  if (V.Ty == ValueType::Array || To == ValueType::Array)
+    return std::nullopt;
+  if (To == ValueType::Double)
+    return EvalValue::ofDouble(static_cast<double>(V.I));
+
+  // fptosi of a double outside of the int range (or a NaN) is poison,
+  // cvttsd2si gives INT64_MIN for it
+  if (!(V.D >= -0x1p63 && V.D < 0x1p63)) {
+    if (!Interp)
+      return std::nullopt;
+    return EvalValue::ofInt(INT64_MIN);
+  }
+  return EvalValue::ofInt(static_cast<int64_t>(V.D));
+}
+
+bool Evaluation::isTrue(EvalValue V) {
+  // fcmp one, NaN is false
+  return V.Ty == ValueType::Int ? V.I != 0 : V.D < 0 || V.D > 0;
+}
+
+// Int arithmetic wraps around, like the compiled code's
+std::optional<EvalValue> Evaluation::intOp(BuiltinOp Op, int64_t L,
+                                           int64_t R) const {
+  switch (Op) {
+  case BuiltinOp::Add:
+    return EvalValue::ofInt(int64_t(uint64_t(L) + uint64_t(R)));
+  case BuiltinOp::Sub:
+    return EvalValue::ofInt(int64_t(uint64_t(L) - uint64_t(R)));
+  case BuiltinOp::Mul:
+    return EvalValue::ofInt(int64_t(uint64_t(L) * uint64_t(R)));
+  case BuiltinOp::Less:
+    return EvalValue::ofInt(L < R);
+  case BuiltinOp::Greater:
+    return EvalValue::ofInt(L > R);
+  case BuiltinOp::LessEqual:
+    return EvalValue::ofInt(L <= R);
+  case BuiltinOp::GreaterEqual:
+    return EvalValue::ofInt(L >= R);
+  case BuiltinOp::Equal:
+    return EvalValue::ofInt(L == R);
+  case BuiltinOp::NotEqual:
+    return EvalValue::ofInt(L != R);
+  default:
+    return std::nullopt;
+  }
+}
+
+bool Evaluation::isFunction(Symbol Name) const {
+  if (Interp)
+    return Interp->isFunction(Name);
+  return Name == Self || Consts->FunctionProtos.count(Name);
+}
+
+std::optional<EvalValue> Evaluation::call(Symbol Callee,
+                                          ArrayRef<EvalValue> Args) {
+  if (Interp)
+    return Interp->call(*this, Callee, Args);
+
+  // Self's body is the one being compiled, not a kept one
+  if (Callee == Self)
+    return std::nullopt;
+  const ConstEvaluator::Definition *Def = Consts->lookup(Callee);
+  if (!Def || Def->Proto->getArgs().size() != Args.size() || tooDeep())
+    return std::nullopt;
+
+  SmallVector<EvalValue, 4> Converted;
+  std::vector<int64_t> Key{Callee.id()};
+  for (auto [Arg, Ty] : zip(Args, Def->Proto->getArgTypes())) {
+    std::optional<EvalValue> V = convert(Arg, Ty);
+    if (!V)
+      return std::nullopt;
+    Converted.push_back(*V);
+    Key.push_back(Ty == ValueType::Int ? V->I : std::bit_cast<int64_t>(V->D));
+  }
+
+  auto CI = Calls.find(Key);
+  if (CI != Calls.end())
+    return CI->second;
+
+  std::optional<EvalValue> Result = run(Def->Body, Def->SlotTypes, Converted);
+  if (Result)
+    Result = convert(*Result, Def->Proto->getReturnType());
+  if (Result)
+    Calls.emplace(std::move(Key), *Result);
+  return Result;
+}
+
+std::optional<EvalValue> Evaluation::run(ExprAST *Body,
+                                         ArrayRef<ValueType> SlotTypes,
+                                         ArrayRef<EvalValue> Args) {
+  std::vector<EvalValue> Frame;
+  Frame.reserve(SlotTypes.size());
+  for (ValueType Ty : SlotTypes)
+    Frame.push_back(EvalValue::zero(Ty));
+  llvm::copy(Args, Frame.begin());
+
+  std::vector<EvalValue> *Caller = Slots;
+  Slots = &Frame;
+  ++Depth;
+  std::optional<EvalValue> Result = Body->evaluate(*this);
+  --Depth;
+  Slots = Caller;
+  return Result;
+}
+
+void Evaluation::iteration() {
+  if (Interp)
+    Interp->iteration();
+}
+
+std::optional<EvalValue> ExprAST::evaluate(Evaluation &CE) {
+  if (!CE.step())
+    return std::nullopt;
+
+  switch (getKind()) {
+  case EK_Number:
+    return cast<NumberExprAST>(this)->evaluate(CE);
+  case EK_Variable:
+    return cast<VariableExprAST>(this)->evaluate(CE);
+  case EK_Var:
+    return cast<VarExprAST>(this)->evaluate(CE);
+  case EK_Binary:
+    return cast<BinaryExprAST>(this)->evaluate(CE);
+  case EK_Unary:
+    return cast<UnaryExprAST>(this)->evaluate(CE);
+  case EK_If:
+    return cast<IfExprAST>(this)->evaluate(CE);
+  case EK_For:
+    return cast<ForExprAST>(this)->evaluate(CE);
+  case EK_Parfor:
+    return cast<ParforExprAST>(this)->evaluate(CE);
+  case EK_Call:
+    return cast<CallExprAST>(this)->evaluate(CE);
+  case EK_Array:
+    return cast<ArrayExprAST>(this)->evaluate(CE);
+  case EK_Index:
+    return cast<IndexExprAST>(this)->evaluate(CE);
+  case EK_Length:
+    return cast<LengthExprAST>(this)->evaluate(CE);
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+std::optional<EvalValue> NumberExprAST::evaluate(Evaluation &) {
+  return IsInt ? EvalValue::ofInt(IntVal) : EvalValue::ofDouble(Val);
+}
+
+std::optional<EvalValue> VariableExprAST::evaluate(Evaluation &CE) {
+  // Arrays are memory, only the interpreter touches them
+  EvalValue *V = CE.slot(Slot);
+  if (!V || (V->Ty == ValueType::Array && !CE.interpreting()))
+    return std::nullopt;
+  return *V;
+}
+
+std::optional<EvalValue> VarExprAST::evaluate(Evaluation &CE) {
+  for (const auto &Binding : VarNames) {
+    EvalValue *V = CE.slot(Binding.Slot);
+    if (!V)
+      return std::nullopt;
+
+    // The initializer doesn't see the variable yet, 0 if there's none
+    EvalValue InitVal = EvalValue::ofInt(0);
+    if (Binding.Init) {
+      std::optional<EvalValue> Init = Binding.Init->evaluate(CE);
+      if (!Init)
+        return std::nullopt;
+      InitVal = *Init;
+    }
+    std::optional<EvalValue> Stored = CE.convert(InitVal, V->Ty);
+    if (!Stored)
+      return std::nullopt;
+    *V = *Stored;
+  }
+
+  return Body->evaluate(CE);
+}
+
+// Orderings are unordered compares (true for NaNs), == is ordered and != is
+// unordered, like BinaryExprAST::codegen's
+static std::optional<EvalValue> doubleOp(BuiltinOp Op, double L, double R) {
+  switch (Op) {
+  case BuiltinOp::Add:
+    return EvalValue::ofDouble(L + R);
+  case BuiltinOp::Sub:
+    return EvalValue::ofDouble(L - R);
+  case BuiltinOp::Mul:
+    return EvalValue::ofDouble(L * R);
+  case BuiltinOp::Div:
+    return EvalValue::ofDouble(L / R);
+  case BuiltinOp::Less:
+    return EvalValue::ofInt(!(L >= R));
+  case BuiltinOp::Greater:
+    return EvalValue::ofInt(!(L <= R));
+  case BuiltinOp::LessEqual:
+    return EvalValue::ofInt(!(L > R));
+  case BuiltinOp::GreaterEqual:
+    return EvalValue::ofInt(!(L < R));
+  case BuiltinOp::Equal:
+    return EvalValue::ofInt(L == R);
+  case BuiltinOp::NotEqual:
+    return EvalValue::ofInt(L != R);
+  default:
+    return std::nullopt;
+  }
+}
+
+std::optional<EvalValue> BinaryExprAST::evaluate(Evaluation &CE) {
+  if (Op == BuiltinOp::Assign) {
+    std::optional<EvalValue> Val = RHS->evaluate(CE);
+    if (!Val)
+      return std::nullopt;
+
+    // a[i] = x stores x (as a double) into the element
+    if (auto *Elt = dyn_cast<IndexExprAST>(LHS)) {
+      double *Addr = Elt->evaluateAddress(CE);
+      std::optional<EvalValue> Stored = CE.convert(*Val, ValueType::Double);
+      if (!Addr || !Stored)
+        return std::nullopt;
+      *Addr = Stored->D;
+      return Stored;
+    }
+
+    EvalValue *V = CE.slot(cast<VariableExprAST>(LHS)->getSlot());
+    if (!V)
+      return std::nullopt;
+    std::optional<EvalValue> Stored = CE.convert(*Val, V->Ty);
+    if (!Stored)
+      return std::nullopt;
+    return *V = *Stored;
+  }
+
+  bool Defined = CE.isFunction(OpFn);
+  if (!Defined && (Op == BuiltinOp::And || Op == BuiltinOp::Or)) {
+    std::optional<EvalValue> L = LHS->evaluate(CE);
+    if (!L)
+      return std::nullopt;
+    if (Evaluation::isTrue(*L) == (Op == BuiltinOp::Or))
+      return EvalValue::ofInt(Op == BuiltinOp::Or);
+    std::optional<EvalValue> R = RHS->evaluate(CE);
+    if (!R)
+      return std::nullopt;
+    return EvalValue::ofInt(Evaluation::isTrue(*R));
+  }
+
+  std::optional<EvalValue> L = LHS->evaluate(CE);
+  if (!L)
+    return std::nullopt;
+  std::optional<EvalValue> R = RHS->evaluate(CE);
+  if (!R)
+    return std::nullopt;
+
+  if (Defined)
+    return CE.call(OpFn, {*L, *R});
+
+  if (Op == BuiltinOp::Seq)
+    return R;
+
+  if (LHS->getType() == ValueType::Int && RHS->getType() == ValueType::Int &&
+      Op != BuiltinOp::Div)
+    return CE.intOp(Op, L->I, R->I);
+
+  L = CE.convert(*L, ValueType::Double);
+  R = CE.convert(*R, ValueType::Double);
+  if (!L || !R)
+    return std::nullopt;
+  return doubleOp(Op, L->D, R->D);
+}
+
+std::optional<EvalValue> UnaryExprAST::evaluate(Evaluation &CE) {
+  std::optional<EvalValue> V = Operand->evaluate(CE);
+  if (!V)
+    return std::nullopt;
+
+  if (CE.isFunction(OpFn))
+    return CE.call(OpFn, *V);
+  if (Op != BuiltinOp::Not)
+    return std::nullopt;
+
+  // fcmp ueq with 0, a NaN is true
+  if (V->Ty == ValueType::Int)
+    return EvalValue::ofInt(V->I == 0);
+  return EvalValue::ofInt(!(V->D < 0 || V->D > 0));
+}
+
+std::optional<EvalValue> IfExprAST::evaluate(Evaluation &CE) {
+  std::optional<EvalValue> CondV = Cond->evaluate(CE);
+  if (!CondV)
+    return std::nullopt;
+
+  std::optional<EvalValue> V =
+      (Evaluation::isTrue(*CondV) ? Then : Else)->evaluate(CE);
+  if (!V)
+    return std::nullopt;
+  return CE.convert(*V, getType());
+}
+
+std::optional<EvalValue> ForExprAST::evaluate(Evaluation &CE) {
+  std::optional<EvalValue> StartVal = Start->evaluate(CE);
+  EvalValue *Var = CE.slot(Slot);
+  if (!StartVal || !Var)
+    return std::nullopt;
+  ValueType VarTy = Var->Ty;
+  StartVal = CE.convert(*StartVal, VarTy);
+  if (!StartVal)
+    return std::nullopt;
+  *Var = *StartVal;
+
+  // Checked before every iteration, the first one too. The slots don't move
+  // while the loop runs, Var stays valid.
+  while (true) {
+    std::optional<EvalValue> Cond = End->evaluate(CE);
+    if (!Cond)
+      return std::nullopt;
+    if (!Evaluation::isTrue(*Cond))
+      break;
+
+    if (!Body->evaluate(CE))
+      return std::nullopt;
+    CE.iteration();
+
+    std::optional<EvalValue> StepVal = VarTy == ValueType::Int
+                                           ? EvalValue::ofInt(1)
+                                           : EvalValue::ofDouble(1.0);
+    if (Step) {
+      StepVal = Step->evaluate(CE);
+      if (!StepVal)
+        return std::nullopt;
+      StepVal = CE.convert(*StepVal, VarTy);
+      if (!StepVal)
+        return std::nullopt;
+    }
+
+    // The step is added to what the body (and the step) left in the variable
+    std::optional<EvalValue> Next =
+        VarTy == ValueType::Int ? CE.intOp(BuiltinOp::Add, Var->I, StepVal->I)
+                                : EvalValue::ofDouble(Var->D + StepVal->D);
+    if (!Next)
+      return std::nullopt;
+    *Var = *Next;
+  }
+
+  return EvalValue::ofDouble(0);
+}
+
+std::optional<EvalValue> ParforExprAST::evaluate(Evaluation &) {
+  // Its reduction is combined in whatever chunks the pool splits it into,
+  // and the interpreter leaves functions with one to the JIT
+  return std::nullopt;
+}
+
+std::optional<EvalValue> CallExprAST::evaluate(Evaluation &CE) {
+  SmallVector<EvalValue, 4> ArgVals;
+  for (auto *Arg : Args) {
+    std::optional<EvalValue> V = Arg->evaluate(CE);
+    if (!V)
+      return std::nullopt;
+    ArgVals.push_back(*V);
+  }
+  return CE.call(Callee, ArgVals);
+}
+
+std::optional<EvalValue> ArrayExprAST::evaluate(Evaluation &CE) {
+  if (!CE.interpreting())
+    return std::nullopt;
+  std::optional<EvalValue> N = Size->evaluate(CE);
+  if (!N)
+    return std::nullopt;
+  N = CE.convert(*N, ValueType::Int);
+  if (!N)
+    return std::nullopt;
+  return EvalValue::ofArray(athens_array_new(N->I), N->I);
+}
+
+double *IndexExprAST::evaluateAddress(Evaluation &CE) {
+  if (!CE.interpreting())
+    return nullptr;
+  std::optional<EvalValue> Arr = Array->evaluate(CE);
+  std::optional<EvalValue> Idx = Index->evaluate(CE);
+  if (!Arr || !Idx)
+    return nullptr;
+  Idx = CE.convert(*Idx, ValueType::Int);
+  if (!Idx)
+    return nullptr;
+
+  // One unsigned compare catches negative indices too
+  if (static_cast<uint64_t>(Idx->I) >= static_cast<uint64_t>(Arr->Arr.Len))
+    athens_bounds_fail(Idx->I, Arr->Arr.Len);
+  return Arr->Arr.Data + Idx->I;
+}
+
+std::optional<EvalValue> IndexExprAST::evaluate(Evaluation &CE) {
+  double *Addr = evaluateAddress(CE);
+  if (!Addr)
+    return std::nullopt;
+  return EvalValue::ofDouble(*Addr);
+}
+
+std::optional<EvalValue> LengthExprAST::evaluate(Evaluation &CE) {
+  std::optional<EvalValue> Arr = Array->evaluate(CE);
+  if (!Arr || Arr->Ty != ValueType::Array)
+    return std::nullopt;
+  return EvalValue::ofInt(Arr->Arr.Len);
+}
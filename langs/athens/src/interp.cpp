@@ -0,0 +1,221 @@
+#include "interp.h"
+#include "error.h"
+#include "runtime.h"
+#include "typecheck.h"
+
+#include <bit>
+
+using namespace llvm;
+
+bool Interpreter::canInterpret(const FunctionAST &Fn, bool TopLevel) const {
+  if (!enabled() || Fn.hasParfor() || (TopLevel && Fn.hasLoops()))
+    return false;
+
+  // A compiled function's redefinition is compiled too, compiled code may
+  // call it
+  const PrototypeAST &Self = Fn.getProto();
+  auto FI = Functions.find(Self.getName());
+  if (!TopLevel && FI != Functions.end() && FI->second.St == State::Compiled)
+    return false;
+
+  for (const CalleeRef &C : Fn.getCallees()) {
+    if (C.Name == Self.getName() && C.NumArgs == Self.getArgs().size())
+      continue;
+    auto PI = FunctionProtos.find(C.Name);
+    if (PI == FunctionProtos.end()) {
+      // An operator that isn't overloaded is built in
+      if (C.Overloadable)
+        continue;
+      return false;
+    }
+    if (PI->second->getArgs().size() != C.NumArgs || !Functions.count(C.Name))
+      return false;
+  }
+  return true;
+}
+
+bool Interpreter::defer(std::unique_ptr<FunctionAST> Fn,
+                        std::shared_ptr<ASTContext> Ctx) {
+  const PrototypeAST &Proto = Fn->getProto();
+  TypeInference TI(FunctionProtos, Proto, Fn->getNumSlots());
+  if (!TI.run(Fn->getBody()))
+    return false;
+
+  // Known to the items that follow like a compiled definition, but without
+  // effects until it's compiled
+  Symbol Name = Proto.getName();
+  FunctionProtos[Name] = std::make_unique<PrototypeAST>(Proto);
+  FunctionInfo &Info = Functions[Name] = FunctionInfo(State::Deferred);
+  Info.Def = std::move(Fn);
+  Info.Ctx = std::move(Ctx);
+  Info.SlotTypes.assign(TI.getSlotTypes().begin(), TI.getSlotTypes().end());
+  return true;
+}
+
+void Interpreter::compiled(Symbol Name) {
+  if (enabled())
+    Functions[Name] = FunctionInfo(State::Compiled);
+}
+
+void Interpreter::declared(Symbol Name) {
+  if (enabled())
+    Functions[Name] = FunctionInfo(State::Extern);
+}
+
+bool Interpreter::promote(FunctionInfo &Fn) {
+  Fn.St = State::Compiling;
+  if (!H.Compile(Fn.Def, Fn.Ctx)) {
+    Fn.St = State::Failed;
+    return false;
+  }
+  Fn.St = State::Compiled;
+  return true;
+}
+
+bool Interpreter::compileCallees(const FunctionAST &Fn) {
+  // A failed one may compile now, after redefinitions of what it calls
+  for (const CalleeRef &C : Fn.getCallees()) {
+    auto FI = Functions.find(C.Name);
+    if (FI == Functions.end())
+      continue;
+    State St = FI->second.St;
+    if ((St == State::Deferred || St == State::Failed) &&
+        !promote(FI->second))
+      return false;
+  }
+  return true;
+}
+
+bool Interpreter::compileDeferred() {
+  // Compiling one may compile others (what it calls) first
+  SmallVector<Symbol, 16> Names;
+  for (auto &[Name, Fn] : Functions)
+    if (Fn.St == State::Deferred || Fn.St == State::Failed)
+      Names.push_back(Name);
+
+  bool Ok = true;
+  for (Symbol Name : Names) {
+    FunctionInfo &Fn = Functions[Name];
+    if (Fn.St == State::Deferred || Fn.St == State::Failed)
+      Ok &= promote(Fn);
+  }
+  return Ok;
+}
+
+std::optional<double> Interpreter::run(FunctionAST &TopLevel) {
+  TypeInference TI(FunctionProtos, TopLevel.getProto(),
+                   TopLevel.getNumSlots());
+  if (!TI.run(TopLevel.getBody()))
+    return std::nullopt;
+
+  // Arrays it creates are gone once it's done, like with a compiled one
+  Evaluation E(*this);
+  int64_t Mark = athens_arena_mark();
+  std::optional<EvalValue> V = E.run(TopLevel.getBody(), TI.getSlotTypes());
+  athens_arena_release(Mark);
+  if (!V)
+    return std::nullopt;
+  return V->toDouble();
+}
+
+std::optional<EvalValue> Interpreter::call(Evaluation &E, Symbol Callee,
+                                           ArrayRef<EvalValue> Args) {
+  // Only a redefinition since the caller was read can make these fail
+  auto FI = Functions.find(Callee);
+  if (FI == Functions.end() || !FunctionProtos.count(Callee)) {
+    error::logError("Unknown function referenced");
+    return std::nullopt;
+  }
+  FunctionInfo &Fn = FI->second;
+
+  // Compile it if it's hot, or if interpreting it would nest too deep. If
+  // it doesn't compile (reported) it's interpreted.
+  if (Fn.St == State::Deferred && (++Fn.Count >= Threshold || E.tooDeep()))
+    promote(Fn);
+
+  // Compiling it replaced its prototype
+  const PrototypeAST &Proto = *FunctionProtos.find(Callee)->second;
+  if (Proto.getArgs().size() != Args.size()) {
+    error::logError("Incorrect # arguments passed");
+    return std::nullopt;
+  }
+  SmallVector<EvalValue, 4> Converted;
+  for (auto [Arg, Ty] : zip(Args, Proto.getArgTypes())) {
+    std::optional<EvalValue> V = E.convert(Arg, Ty);
+    if (!V) {
+      error::logError(Ty == ValueType::Array
+                          ? "Expected an array, got a number"
+                          : "Expected a number, got an array");
+      return std::nullopt;
+    }
+    Converted.push_back(*V);
+  }
+
+  if (Fn.St == State::Compiled || Fn.St == State::Extern)
+    return callNative(Callee, Fn, Proto, Converted);
+  if (E.tooDeep()) {
+    error::logError("Calls nested too deep to interpret");
+    return std::nullopt;
+  }
+
+  Symbol Caller = Running;
+  Running = Callee;
+  int64_t Mark = athens_arena_mark();
+  std::optional<EvalValue> Result =
+      E.run(Fn.Def->getBody(), Fn.SlotTypes, Converted);
+  Running = Caller;
+  if (Result)
+    Result = E.convert(*Result, Fn.Def->getProto().getReturnType());
+
+  // The arrays it created are garbage, unless it returns one of them
+  if (!Result || Result->Ty != ValueType::Array)
+    athens_arena_release(Mark);
+  return Result;
+}
+
+std::optional<EvalValue> Interpreter::callNative(Symbol Callee,
+                                                 FunctionInfo &Fn,
+                                                 const PrototypeAST &Proto,
+                                                 ArrayRef<EvalValue> Args) {
+  if (!Fn.Native)
+    Fn.Native = H.Entry(Callee, Fn.St == State::Extern);
+  if (!Fn.Native)
+    return std::nullopt;
+
+  // See CodeGen::emitInterpreterEntry
+  SmallVector<int64_t, 8> Words;
+  for (const EvalValue &Arg : Args)
+    switch (Arg.Ty) {
+    case ValueType::Double:
+      Words.push_back(std::bit_cast<int64_t>(Arg.D));
+      break;
+    case ValueType::Int:
+      Words.push_back(Arg.I);
+      break;
+    case ValueType::Array:
+      Words.push_back(reinterpret_cast<intptr_t>(Arg.Arr.Data));
+      Words.push_back(Arg.Arr.Len);
+      break;
+    }
+
+  int64_t Result[2];
+  Fn.Native(Words.data(), Result);
+  switch (Proto.getReturnType()) {
+  case ValueType::Double:
+    return EvalValue::ofDouble(std::bit_cast<double>(Result[0]));
+  case ValueType::Int:
+    return EvalValue::ofInt(Result[0]);
+  case ValueType::Array:
+    return EvalValue::ofArray(reinterpret_cast<double *>(Result[0]),
+                              Result[1]);
+  }
+  llvm_unreachable("unknown value type");
+}
+
+void Interpreter::iteration() {
+  if (!Running)
+    return;
+  auto FI = Functions.find(Running);
+  if (FI != Functions.end())
+    ++FI->second.Count;
+}
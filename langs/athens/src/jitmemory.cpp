@@ -0,0 +1,251 @@
+#include "jitmemory.h"
+
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace athens;
+
+// Address space the slabs of one JIT are placed in
+static constexpr size_t ReservationSize = size_t(1) << 30;
+static constexpr size_t SlabSize = size_t(256) << 10;
+
+// How many forks this process is from the one that started. A child stops
+// using the code and read-only slabs it shares with its parent, the parent
+// (which waits for it, or doesn't compile anymore) keeps them. Read-write
+// slabs are private, copied on write.
+static std::atomic<unsigned> ForkGeneration = 0;
+
+static void countFork() { ++ForkGeneration; }
+
+static bool isDualMapped(SlabAllocator::Kind K) {
+  return K != SlabAllocator::Kind::ReadWrite;
+}
+
+// Whether a slab of kind K mapped in Generation is shared with the parent
+static bool isShared(SlabAllocator::Kind K, unsigned Generation) {
+  return isDualMapped(K) && Generation != ForkGeneration;
+}
+
+SlabAllocator::SlabAllocator() {
+  static std::once_flag Registered;
+  std::call_once(Registered,
+                 [] { pthread_atfork(nullptr, nullptr, countFork); });
+}
+
+SlabAllocator::~SlabAllocator() {
+  for (unsigned K = 0; K != NumKinds; ++K)
+    if (isDualMapped(Kind(K)))
+      for (Slab &S : Slabs[K])
+        munmap(S.Addr, S.Size);
+  if (Reserved)
+    munmap(Reserved, ReservationSize);
+}
+
+bool SlabAllocator::mapSlab(Kind K, size_t Size) {
+  if (!Reserved) {
+    void *P = mmap(nullptr, ReservationSize, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (P == MAP_FAILED)
+      return false;
+    Reserved = static_cast<uint8_t *>(P);
+  }
+  if (Size > ReservationSize - ReservedUsed)
+    return false;
+  uint8_t *Target = Reserved + ReservedUsed;
+
+  uint8_t *Addr = Target;
+  if (!isDualMapped(K)) {
+    if (mmap(Target, Size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      return false;
+  } else {
+    int Fd = memfd_create("athens-jit", MFD_CLOEXEC);
+    if (Fd < 0)
+      return false;
+    int Prot = K == Kind::Code ? PROT_READ | PROT_EXEC : PROT_READ;
+    void *W = MAP_FAILED;
+    if (ftruncate(Fd, Size) == 0)
+      W = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+    bool Mapped = W != MAP_FAILED &&
+                  mmap(Target, Size, Prot, MAP_SHARED | MAP_FIXED, Fd, 0) !=
+                      MAP_FAILED;
+    close(Fd);
+    if (!Mapped) {
+      if (W != MAP_FAILED)
+        munmap(W, Size);
+      return false;
+    }
+    Addr = static_cast<uint8_t *>(W);
+  }
+
+  ReservedUsed += Size;
+  Slabs[unsigned(K)].push_back({Addr, Target, Size, 0, {}, ForkGeneration});
+  return true;
+}
+
+SlabAllocator::Block SlabAllocator::take(Slab &S, Kind K, size_t Offset,
+                                         size_t Size) {
+  Live[unsigned(K)] += Size;
+  return {S.Addr + Offset, uint64_t(uintptr_t(S.Target + Offset)), Size, K};
+}
+
+SlabAllocator::Block SlabAllocator::allocate(Kind K, size_t Size,
+                                             unsigned Alignment) {
+  // RuntimeDyld tells sections apart by their address, even empty ones
+  Size = std::max<size_t>(Size, 1);
+  Alignment = std::max(Alignment, 1u);
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto &Candidates = Slabs[unsigned(K)];
+
+  for (Slab &S : Candidates) {
+    if (isShared(K, S.Generation))
+      continue;
+    // The first free range it fits in, what's left of it stays free
+    for (auto It = S.Free.begin(); It != S.Free.end(); ++It) {
+      auto [Start, Length] = *It;
+      size_t Offset = alignTo(Start, Alignment);
+      if (Offset + Size > Start + Length)
+        continue;
+      S.Free.erase(It);
+      if (Offset != Start)
+        S.Free[Start] = Offset - Start;
+      if (Offset + Size != Start + Length)
+        S.Free[Offset + Size] = Start + Length - Offset - Size;
+      return take(S, K, Offset, Size);
+    }
+  }
+
+  auto Bump = [&](Slab &S, size_t &Offset) {
+    Offset = alignTo(S.Used, Alignment);
+    if (Offset + Size > S.Size)
+      return false;
+    if (Offset != S.Used)
+      S.Free[S.Used] = Offset - S.Used;
+    S.Used = Offset + Size;
+    return true;
+  };
+  size_t Offset;
+  for (Slab &S : Candidates)
+    if (!isShared(K, S.Generation) && Bump(S, Offset))
+      return take(S, K, Offset, Size);
+  // Sections bigger than a slab get one of their own
+  size_t PageSize = sys::Process::getPageSizeEstimate();
+  if (mapSlab(K, alignTo(std::max(Size, SlabSize), PageSize)) &&
+      Bump(Candidates.back(), Offset))
+    return take(Candidates.back(), K, Offset, Size);
+  return {};
+}
+
+void SlabAllocator::release(const Block &B) {
+  if (!B.Addr)
+    return;
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Live[unsigned(B.K)] -= B.Size;
+  for (Slab &S : Slabs[unsigned(B.K)]) {
+    if (B.Addr < S.Addr || B.Addr >= S.Addr + S.Size)
+      continue;
+    // A slab shared with the parent stays as it is
+    if (isShared(B.K, S.Generation))
+      return;
+
+    size_t Start = B.Addr - S.Addr, Length = B.Size;
+    auto Next = S.Free.lower_bound(Start);
+    if (Next != S.Free.end() && Next->first == Start + Length) {
+      Length += Next->second;
+      Next = S.Free.erase(Next);
+    }
+    if (Next != S.Free.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Start) {
+        Start = Prev->first;
+        Length += Prev->second;
+        S.Free.erase(Prev);
+      }
+    }
+    if (Start + Length == S.Used)
+      S.Used = Start;
+    else
+      S.Free[Start] = Length;
+    return;
+  }
+}
+
+SlabAllocator::Usage SlabAllocator::getUsage() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Usage U;
+  U.Code = Live[unsigned(Kind::Code)];
+  U.Data = Live[unsigned(Kind::ReadOnly)] + Live[unsigned(Kind::ReadWrite)];
+  U.Slabs = ReservedUsed;
+  return U;
+}
+
+SlabMemoryManager::~SlabMemoryManager() {
+  for (const SlabAllocator::Block &B : Blocks)
+    Slabs.release(B);
+}
+
+uint8_t *SlabMemoryManager::allocate(SlabAllocator::Kind K, uintptr_t Size,
+                                     unsigned Alignment) {
+  SlabAllocator::Block B = Slabs.allocate(K, Size, Alignment);
+  if (B.Addr)
+    Blocks.push_back(B);
+  return B.Addr;
+}
+
+uint8_t *SlabMemoryManager::allocateCodeSection(uintptr_t Size,
+                                                unsigned Alignment,
+                                                unsigned /*SectionID*/,
+                                                StringRef /*SectionName*/) {
+  return allocate(SlabAllocator::Kind::Code, Size, Alignment);
+}
+
+uint8_t *SlabMemoryManager::allocateDataSection(uintptr_t Size,
+                                                unsigned Alignment,
+                                                unsigned /*SectionID*/,
+                                                StringRef /*SectionName*/,
+                                                bool IsReadOnly) {
+  return allocate(IsReadOnly ? SlabAllocator::Kind::ReadOnly
+                             : SlabAllocator::Kind::ReadWrite,
+                  Size, Alignment);
+}
+
+// Relocations are resolved against where the sections run, not where
+// they're written
+void SlabMemoryManager::notifyObjectLoaded(RuntimeDyld &RTDyld,
+                                           const object::ObjectFile &) {
+  for (const SlabAllocator::Block &B : Blocks)
+    if (B.TargetAddress != uint64_t(uintptr_t(B.Addr)))
+      RTDyld.mapSectionAddress(B.Addr, B.TargetAddress);
+}
+
+bool SlabMemoryManager::finalizeMemory(std::string *) {
+  for (const SlabAllocator::Block &B : Blocks)
+    if (B.K == SlabAllocator::Kind::Code)
+      sys::Memory::InvalidateInstructionCache(
+          reinterpret_cast<void *>(uintptr_t(B.TargetAddress)), B.Size);
+  return false;
+}
+
+// The unwinder reads the frames where they're mapped read-only
+void SlabMemoryManager::registerEHFrames(uint8_t *, uint64_t LoadAddr,
+                                         size_t Size) {
+  uint8_t *Frames = reinterpret_cast<uint8_t *>(uintptr_t(LoadAddr));
+  registerEHFramesInProcess(Frames, Size);
+  EHFrames.push_back({Frames, Size});
+}
+
+void SlabMemoryManager::deregisterEHFrames() {
+  for (const EHFrame &F : EHFrames)
+    deregisterEHFramesInProcess(F.Addr, F.Size);
+  EHFrames.clear();
+}
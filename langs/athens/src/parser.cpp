@@ -1,366 +1,577 @@
-
 #include "parser.h"
-#include "error.h"
-#include "lexer.h"
 
-Token CurTok;
-Token getNextToken() { return CurTok = lexer::gettok(); }
+#include <cctype>
+#include <optional>
 
-std::map<char, int> BinopPrecedence;
+using frontend::lex::Token;
+using frontend::lex::TokenKind;
 
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence() {
-  if (!isascii(static_cast<int>(CurTok)))
-    return -1;
+namespace athens {
 
-  // Make sure it's a declared binop.
-  int TokPrec = BinopPrecedence[static_cast<int>(CurTok)];
-  if (TokPrec <= 0)
-    return -1;
-  return TokPrec;
-}
+using Engine = frontend::parse::ParserEngine<ASTBuilder>;
+using ParseCtx = frontend::parse::ParseContext<ASTBuilder>;
+
+// Unary operators bind tighter than any binary operator (those are [1..100])
+static constexpr int UnaryOperandPrecedence = 1000;
 
-/// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  error::logError(Str);
+/// LogError - Reports at the token the parser is currently looking at.
+static ExprAST *LogError(ParseCtx &Ctx, const char *Str) {
+  Ctx.diag.error(Ctx.tokenStream.current().source_loc, Str);
   return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-  error::logError(Str);
-  return nullptr;
+/// Operator tokens spell the operator, a single character or one of the
+/// built-in two character ones (e.g. "<=", "&&").
+static bool isOperatorToken(const Token &Tok) {
+  switch (Tok.kind) {
+  case TokenKind::Plus:
+  case TokenKind::Minus:
+  case TokenKind::Star:
+  case TokenKind::Slash:
+  case TokenKind::Equal:
+  case TokenKind::Less:
+  case TokenKind::LessEqual:
+  case TokenKind::Greater:
+  case TokenKind::GreaterEqual:
+  case TokenKind::LogicNot:
+  case TokenKind::EqualEqual:
+  case TokenKind::NotEqual:
+  case TokenKind::LogicAnd:
+  case TokenKind::LogicOr:
+  case TokenKind::Colon:
+  case TokenKind::Operator:
+    return true;
+  default:
+    return false;
+  }
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+/// What codegen lowers a binary operator to when it isn't overloaded.
+static BuiltinOp builtinBinaryOp(TokenKind Kind) {
+  switch (Kind) {
+  case TokenKind::Equal:
+    return BuiltinOp::Assign;
+  case TokenKind::Plus:
+    return BuiltinOp::Add;
+  case TokenKind::Minus:
+    return BuiltinOp::Sub;
+  case TokenKind::Star:
+    return BuiltinOp::Mul;
+  case TokenKind::Slash:
+    return BuiltinOp::Div;
+  case TokenKind::Less:
+    return BuiltinOp::Less;
+  case TokenKind::Greater:
+    return BuiltinOp::Greater;
+  case TokenKind::LessEqual:
+    return BuiltinOp::LessEqual;
+  case TokenKind::GreaterEqual:
+    return BuiltinOp::GreaterEqual;
+  case TokenKind::EqualEqual:
+    return BuiltinOp::Equal;
+  case TokenKind::NotEqual:
+    return BuiltinOp::NotEqual;
+  case TokenKind::LogicAnd:
+    return BuiltinOp::And;
+  case TokenKind::LogicOr:
+    return BuiltinOp::Or;
+  case TokenKind::Colon:
+    return BuiltinOp::Seq;
+  default:
+    return BuiltinOp::None;
+  }
+}
+
+/// The function a user-defined operator calls, e.g. "binary|". Short enough
+/// for the small string buffer, so this doesn't allocate.
+static Symbol operatorFunction(frontend::lex::SymbolTable &Symbols,
+                               std::string_view Kind, std::string_view Op) {
+  std::string Name(Kind);
+  Name += Op;
+  return Symbols.intern(Name);
+}
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(lexer::NumVal);
-  getNextToken(); // consume the number
-  return std::move(Result);
+static ExprAST *ParseNumberExpr(ParseCtx &Ctx, Engine &, Token Tok) {
+  if (auto *I = std::get_if<long long>(&Tok.literal))
+    return Ctx.builder.Ctx->create<NumberExprAST>(static_cast<int64_t>(*I));
+
+  double Val = 0;
+  if (auto *D = std::get_if<double>(&Tok.literal))
+    Val = *D;
+  return Ctx.builder.Ctx->create<NumberExprAST>(Val);
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken(); // eat (.
-  auto V = ParseExpression();
+static ExprAST *ParseParenExpr(ParseCtx &Ctx, Engine &E, Token) {
+  auto *V = E.parseExpression(0);
   if (!V)
     return nullptr;
 
-  if (CurTok != ')')
-    return LogError("expected ')'");
-  getNextToken(); // eat ).
+  if (!Ctx.tokenStream.expect(TokenKind::RParen, Ctx.diag, "expected ')'"))
+    return nullptr;
   return V;
 }
 
+/// array(n) and len(a) look like calls, but no function can have these names.
+static bool isArrayBuiltin(std::string_view Name) {
+  return Name == "array" || Name == "len";
+}
+
+/// arrayexpr ::= 'array' '(' expression ')'
+/// lengthexpr ::= 'len' '(' expression ')'
+static ExprAST *ParseArrayBuiltin(ParseCtx &Ctx, Engine &E, Token Tok) {
+  auto *Arg = E.parseExpression(0);
+  if (!Arg)
+    return nullptr;
+
+  if (!Ctx.tokenStream.expect(TokenKind::RParen, Ctx.diag, "expected ')'"))
+    return nullptr;
+
+  if (Tok.lexeme == "array")
+    return Ctx.builder.Ctx->create<ArrayExprAST>(Arg);
+  return Ctx.builder.Ctx->create<LengthExprAST>(Arg);
+}
+
 /// identifierexpr
 ///   ::= identifier
+///   ::= identifier '[' expression ']'
 ///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = lexer::IdentifierStr;
+static ExprAST *ParseIdentifierExpr(ParseCtx &Ctx, Engine &E, Token Tok) {
+  ASTContext &AST = *Ctx.builder.Ctx;
+  Symbol IdName = Tok.symbol;
+
+  if (Ctx.tokenStream.match(TokenKind::LBracket)) {
+    auto *Index = E.parseExpression(0);
+    if (!Index)
+      return nullptr;
+
+    if (!Ctx.tokenStream.expect(TokenKind::RBracket, Ctx.diag,
+                                "expected ']'"))
+      return nullptr;
+    return AST.create<IndexExprAST>(AST.create<VariableExprAST>(IdName),
+                                    Index);
+  }
 
-  getNextToken(); // eat identifier.
+  if (!Ctx.tokenStream.match(TokenKind::LParen)) // Simple variable ref.
+    return AST.create<VariableExprAST>(IdName);
 
-  if (CurTok != '(') // Simple variable ref.
-    return std::make_unique<VariableExprAST>(IdName);
+  if (isArrayBuiltin(Tok.lexeme))
+    return ParseArrayBuiltin(Ctx, E, Tok);
 
   // Call.
-  getNextToken(); // eat (
-  std::vector<std::unique_ptr<ExprAST>> Args;
-  if (CurTok != ')') {
+  SmallVector<ExprAST *, 4> Args;
+  if (!Ctx.tokenStream.is(TokenKind::RParen)) {
     while (true) {
-      if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
+      if (auto *Arg = E.parseExpression(0))
+        Args.push_back(Arg);
       else
         return nullptr;
 
-      if (CurTok == ')')
+      if (Ctx.tokenStream.is(TokenKind::RParen))
         break;
 
-      if (CurTok != ',')
-        return LogError("Expected ')' or ',' in argument list");
-      getNextToken();
+      if (!Ctx.tokenStream.expect(TokenKind::Comma, Ctx.diag,
+                                  "Expected ')' or ',' in argument list"))
+        return nullptr;
     }
   }
 
   // Eat the ')'.
-  getNextToken();
+  (void)Ctx.tokenStream.consume();
 
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
+  return AST.create<CallExprAST>(IdName, AST.copyArray<ExprAST *>(Args));
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr() {
-  getNextToken(); // consume 'if'
-
-  auto Cond = ParseExpression();
+static ExprAST *ParseIfExpr(ParseCtx &Ctx, Engine &E, Token) {
+  auto *Cond = E.parseExpression(0);
   if (!Cond)
     return nullptr;
 
-  if (CurTok != Token::then_)
-    return LogError("Expected 'then' keyword in an if statement");
-  getNextToken(); // consume 'then'
+  if (!Ctx.tokenStream.expect(TokenKind::KwThen, Ctx.diag,
+                              "Expected 'then' keyword in an if statement"))
+    return nullptr;
 
-  auto Then = ParseExpression();
+  auto *Then = E.parseExpression(0);
   if (!Then)
     return nullptr;
 
-  if (CurTok != Token::else_)
-    return LogError("Expected 'else' keyword in an if statement");
-  getNextToken(); // consume 'else'
+  if (!Ctx.tokenStream.expect(TokenKind::KwElse, Ctx.diag,
+                              "Expected 'else' keyword in an if statement"))
+    return nullptr;
 
-  auto Else = ParseExpression();
+  auto *Else = E.parseExpression(0);
   if (!Else)
     return nullptr;
 
-  return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                     std::move(Else));
+  return Ctx.builder.Ctx->create<IfExprAST>(Cond, Then, Else);
 }
 
 // forexpr ::= 'for' identifier '=' expr ',' expr ',' (',' expr)? 'in' expr
-static std::unique_ptr<ExprAST> ParseForExpr() {
-  getNextToken(); // consume 'for'
-
-  if (CurTok != Token::identifier)
-    return LogError("Expected identifier after 'for'");
+static ExprAST *ParseForExpr(ParseCtx &Ctx, Engine &E, Token) {
+  if (!Ctx.tokenStream.is(TokenKind::Identifier))
+    return LogError(Ctx, "Expected identifier after 'for'");
 
-  std::string IdName = lexer::IdentifierStr;
-  getNextToken(); // consume identifier
+  Symbol IdName = Ctx.tokenStream.consume().symbol;
 
-  if (CurTok != '=')
-    return LogError("Expected = initializing loop variable");
-  getNextToken(); // consume =
+  if (!Ctx.tokenStream.expect(TokenKind::Equal, Ctx.diag,
+                              "Expected = initializing loop variable"))
+    return nullptr;
 
-  auto Start = ParseExpression();
+  auto *Start = E.parseExpression(0);
   if (!Start)
     return nullptr;
 
-  if (CurTok != ',')
-    return LogError("Expected , after initializing loop variable");
-  getNextToken();
+  if (!Ctx.tokenStream.expect(TokenKind::Comma, Ctx.diag,
+                              "Expected , after initializing loop variable"))
+    return nullptr;
 
-  auto End = ParseExpression();
+  auto *End = E.parseExpression(0);
   if (!End)
     return nullptr;
 
   // The step expression is optional
-  std::unique_ptr<ExprAST> Step;
-  if (CurTok == ',') {
-    getNextToken(); // consume ,
-    Step = ParseExpression();
+  ExprAST *Step = nullptr;
+  if (Ctx.tokenStream.match(TokenKind::Comma)) {
+    Step = E.parseExpression(0);
     if (!Step)
       return nullptr;
   }
 
-  if (CurTok != Token::in_)
-    return LogError("Expected 'in' after for");
-  getNextToken(); // move cursor over 'in' (consume in)
+  if (!Ctx.tokenStream.expect(TokenKind::KwIn, Ctx.diag,
+                              "Expected 'in' after for"))
+    return nullptr;
 
-  auto Body = ParseExpression();
+  auto *Body = E.parseExpression(0);
   if (!Body)
     return nullptr;
 
-  return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                      std::move(Step), std::move(Body));
+  return Ctx.builder.Ctx->create<ForExprAST>(IdName, Start, End, Step, Body);
+}
+
+// parforexpr ::= 'parfor' identifier '=' expr ',' expr (',' ('+' | '*'))?
+//                'in' expr
+static ExprAST *ParseParforExpr(ParseCtx &Ctx, Engine &E, Token) {
+  if (!Ctx.tokenStream.is(TokenKind::Identifier))
+    return LogError(Ctx, "Expected identifier after 'parfor'");
+
+  Symbol IdName = Ctx.tokenStream.consume().symbol;
+
+  if (!Ctx.tokenStream.expect(TokenKind::Equal, Ctx.diag,
+                              "Expected = initializing loop variable"))
+    return nullptr;
+
+  auto *Start = E.parseExpression(0);
+  if (!Start)
+    return nullptr;
+
+  if (!Ctx.tokenStream.expect(TokenKind::Comma, Ctx.diag,
+                              "Expected , after initializing loop variable"))
+    return nullptr;
+
+  auto *End = E.parseExpression(0);
+  if (!End)
+    return nullptr;
+
+  // The reduction operator is optional
+  BuiltinOp Reduce = BuiltinOp::None;
+  if (Ctx.tokenStream.match(TokenKind::Comma)) {
+    if (Ctx.tokenStream.is(TokenKind::Plus))
+      Reduce = BuiltinOp::Add;
+    else if (Ctx.tokenStream.is(TokenKind::Star))
+      Reduce = BuiltinOp::Mul;
+    else
+      return LogError(Ctx, "Expected '+' or '*' as the parfor reduction");
+    (void)Ctx.tokenStream.consume();
+  }
+
+  if (!Ctx.tokenStream.expect(TokenKind::KwIn, Ctx.diag,
+                              "Expected 'in' after parfor"))
+    return nullptr;
+
+  auto *Body = E.parseExpression(0);
+  if (!Body)
+    return nullptr;
+
+  return Ctx.builder.Ctx->create<ParforExprAST>(IdName, Start, End, Reduce,
+                                                Body);
 }
 
 // varexpr ::= 'var' identifier ('=' expression)? (',' identifier ('='
 // expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr() {
-  getNextToken(); // consume 'var'
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+static ExprAST *ParseVarExpr(ParseCtx &Ctx, Engine &E, Token) {
+  ASTContext &AST = *Ctx.builder.Ctx;
+  SmallVector<VarBinding, 4> VarNames;
 
   // At least one name is required
-  if (CurTok != Token::identifier)
-    return LogError("expected identifier after var");
+  if (!Ctx.tokenStream.is(TokenKind::Identifier))
+    return LogError(Ctx, "expected identifier after var");
 
   // Parse the identifier / expr pairs into the VarNames vector
   while (true) {
-    std::string Name = lexer::IdentifierStr;
-    getNextToken();
+    Symbol Name = Ctx.tokenStream.consume().symbol;
 
     // Read the (optional) initialized if there's any.
+    ExprAST *Init = nullptr;
 
-    std::unique_ptr<ExprAST> Init = nullptr;
-
-    if (CurTok == '=') {
-      getNextToken(); // move over =
-
-      Init = ParseExpression();
+    if (Ctx.tokenStream.match(TokenKind::Equal)) {
+      Init = E.parseExpression(0);
       if (!Init)
         return nullptr;
     }
 
-    VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    VarNames.push_back(VarBinding{Name, Init});
 
     // are we at the end of the var list?
-    if (CurTok != ',')
+    if (!Ctx.tokenStream.match(TokenKind::Comma))
       break;
 
-    getNextToken(); // consume ','
-
-    if (CurTok != Token::identifier)
-      return LogError("expected identifier list after var");
+    if (!Ctx.tokenStream.is(TokenKind::Identifier))
+      return LogError(Ctx, "expected identifier list after var");
   }
 
   // we have to have 'in' at this point
-  if (CurTok != Token::in_)
-    return LogError("expected 'in' keyword after 'var'");
-  getNextToken(); // consume 'in'
+  if (!Ctx.tokenStream.expect(TokenKind::KwIn, Ctx.diag,
+                              "expected 'in' keyword after 'var'"))
+    return nullptr;
 
-  auto Body = ParseExpression();
+  auto *Body = E.parseExpression(0);
   if (!Body)
     return nullptr;
 
-  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
-}
-
-/// primary
-///   ::= identifierexpr
-///   ::= numberexpr
-///   ::= parenexpr
-///   ::= ifexpr
-///   ::= forexpr
-///   ::= varexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (CurTok) {
-  case Token::identifier:
-    return ParseIdentifierExpr();
-  case Token::number:
-    return ParseNumberExpr();
-  case Token::if_:
-    return ParseIfExpr();
-  case Token::for_:
-    return ParseForExpr();
-  case static_cast<Token>('('):
-    return ParseParenExpr();
-  case Token::var_:
-    return ParseVarExpr();
-  default:
-    return LogError("unknown token when expecting an expression");
-  }
+  return AST.create<VarExprAST>(AST.copyArray<VarBinding>(VarNames), Body);
 }
 
 /// unary
 ///     ::= primary
 ///     ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary() {
-  // If the current token is not an operator, then it must be a primary expr
-  if (!isascii(static_cast<int>(CurTok)) || CurTok == '(' || CurTok == ',')
-    return ParsePrimary();
-
-  // If this is a unary operator, read it
-  int Opc = static_cast<int>(CurTok);
-  getNextToken();
-  if (auto Operand = ParseUnary())
-    return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+static ExprAST *ParseUnary(ParseCtx &Ctx, Engine &E, Token Tok) {
+  if (!isOperatorToken(Tok))
+    return LogError(Ctx, "unknown token when expecting an expression");
+
+  if (auto *Operand = E.parseExpression(UnaryOperandPrecedence)) {
+    BuiltinOp Op =
+        Tok.kind == TokenKind::LogicNot ? BuiltinOp::Not : BuiltinOp::None;
+    return Ctx.builder.Ctx->create<UnaryExprAST>(
+        Op, operatorFunction(*Ctx.builder.Symbols, "unary", Tok.lexeme),
+        Operand);
+  }
   return nullptr;
 }
 
 /// binoprhs
-///   ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
-  // If this is a binop, find its precedence.
-  while (true) {
-    int TokPrec = GetTokPrecedence();
+///   ::= ('+' unary)*
+static ExprAST *ParseBinaryExpr(ParseCtx &Ctx, Engine &, ExprAST *LHS,
+                                Token OpTok, ExprAST *RHS) {
+  if (!LHS || !RHS)
+    return nullptr;
+  return Ctx.builder.Ctx->create<BinaryExprAST>(
+      builtinBinaryOp(OpTok.kind),
+      operatorFunction(*Ctx.builder.Symbols, "binary", OpTok.lexeme), LHS,
+      RHS);
+}
 
-    // If this is a binop that binds at least as tightly as the current binop,
-    // consume it, otherwise we are done.
-    if (TokPrec < ExprPrec)
-      return LHS;
+void registerAthensGrammar(ParserRegistry &R) {
+  /// primary
+  ///   ::= identifierexpr
+  ///   ::= numberexpr
+  ///   ::= parenexpr
+  ///   ::= ifexpr
+  ///   ::= forexpr
+  ///   ::= parforexpr
+  ///   ::= varexpr
+  R.setPrefix(TokenKind::Identifier, ParseIdentifierExpr);
+  R.setPrefix(TokenKind::Integer, ParseNumberExpr);
+  R.setPrefix(TokenKind::Float, ParseNumberExpr);
+  R.setPrefix(TokenKind::LParen, ParseParenExpr);
+  R.setPrefix(TokenKind::KwIf, ParseIfExpr);
+  R.setPrefix(TokenKind::KwFor, ParseForExpr);
+  R.setPrefix(TokenKind::KwParfor, ParseParforExpr);
+  R.setPrefix(TokenKind::KwVar, ParseVarExpr);
+
+  // Any operator can be a (user-defined) unary operator
+  for (TokenKind K :
+       {TokenKind::Plus, TokenKind::Minus, TokenKind::Star, TokenKind::Slash,
+        TokenKind::Equal, TokenKind::Less, TokenKind::LessEqual,
+        TokenKind::Greater, TokenKind::GreaterEqual, TokenKind::LogicNot,
+        TokenKind::EqualEqual, TokenKind::NotEqual, TokenKind::LogicAnd,
+        TokenKind::LogicOr, TokenKind::Colon, TokenKind::Operator})
+    R.setPrefix(K, ParseUnary);
+
+  // Install standard binary operators.
+  // 1 is lowest precedence.
+  installBinaryOperator(R, ":", 1);
+  installBinaryOperator(R, "=", 2);
+  installBinaryOperator(R, "||", 5);
+  installBinaryOperator(R, "&&", 6);
+  installBinaryOperator(R, "==", 9);
+  installBinaryOperator(R, "!=", 9);
+  installBinaryOperator(R, "<", 10);
+  installBinaryOperator(R, ">", 10);
+  installBinaryOperator(R, "<=", 10);
+  installBinaryOperator(R, ">=", 10);
+  installBinaryOperator(R, "+", 20);
+  installBinaryOperator(R, "-", 20);
+  installBinaryOperator(R, "*", 40); // highest.
+  installBinaryOperator(R, "/", 40);
+
+  // A prototype's return type annotation is told apart from a body starting
+  // with a ':' by the type name after it
+  R.requireLookahead(1);
+}
 
-    // Okay, we know this is a binop.
-    Token BinOp = CurTok;
-    getNextToken(); // eat binop
+void installBinaryOperator(ParserRegistry &R, std::string_view Op,
+                           int Precedence) {
+  R.setInfixOperator(Op, Precedence, ParseBinaryExpr);
+}
 
-    // Parse the unary expression after the binary operator.
-    auto RHS = ParseUnary();
-    if (!RHS)
-      return nullptr;
+void removeBinaryOperator(ParserRegistry &R, std::string_view Op) {
+  R.removeInfixOperator(Op);
+}
 
-    // If BinOp binds less tightly with RHS than the operator after RHS, let
-    // the pending operator take RHS as its LHS.
-    int NextPrec = GetTokPrecedence();
-    if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-      if (!RHS)
-        return nullptr;
-    }
+/// `pure` before a prototype, it's only a keyword there (so a function can
+/// still be called pure).
+static bool isPureMarker(const Token &Tok, const Token &Next) {
+  return Tok.kind == TokenKind::Identifier && Tok.lexeme == "pure" &&
+         (Next.kind == TokenKind::Identifier ||
+          Next.kind == TokenKind::KwUnaryOp ||
+          Next.kind == TokenKind::KwBinaryOp);
+}
 
-    // Merge LHS/RHS.
-    LHS = std::make_unique<BinaryExprAST>(static_cast<char>(BinOp),
-                                          std::move(LHS), std::move(RHS));
+void installBinaryOperators(ParserRegistry &R, std::span<const Token> Tokens) {
+  for (std::size_t Def = 0; Def + 2 < Tokens.size(); ++Def) {
+    // Look at the prototype as if the 'def' was right before it
+    std::size_t I = Def + isPureMarker(Tokens[Def + 1], Tokens[Def + 2]);
+    if (Tokens[Def].kind != TokenKind::KwFuncDef || I + 2 >= Tokens.size() ||
+        Tokens[I + 1].kind != TokenKind::KwBinaryOp ||
+        !isOperatorToken(Tokens[I + 2]) ||
+        Tokens[I + 2].kind == TokenKind::Equal)
+      continue;
+
+    int Precedence = DefaultBinaryPrecedence;
+    if (I + 3 < Tokens.size() && Tokens[I + 3].kind == TokenKind::Integer) {
+      long long Prec = std::get<long long>(Tokens[I + 3].literal);
+      if (Prec < 1 || Prec > 100)
+        continue;
+      Precedence = static_cast<int>(Prec);
+    }
+    installBinaryOperator(R, Tokens[I + 2].lexeme, Precedence);
   }
 }
 
-/// expression
-///   ::= primary binoprhs
-///
-static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParseUnary();
-  if (!LHS)
-    return nullptr;
+/// Types are spelled with plain identifiers, they aren't reserved words.
+static std::optional<ValueType> typeName(const Token &Tok) {
+  if (Tok.kind != TokenKind::Identifier)
+    return std::nullopt;
+  if (Tok.lexeme == "double")
+    return ValueType::Double;
+  if (Tok.lexeme == "int")
+    return ValueType::Int;
+  if (Tok.lexeme == "array")
+    return ValueType::Array;
+  return std::nullopt;
+}
 
-  return ParseBinOpRHS(0, std::move(LHS));
+Parser::Parser(frontend::parse::TokenStream &Tokens,
+               const ParserRegistry &Registry,
+               frontend::lex::SymbolTable &Symbols,
+               frontend::parse::IDiagnostics &Diag)
+    : Tokens(Tokens), Diag(Diag), PCtx{Tokens, Builder, Diag},
+      Engine(PCtx, Registry) {
+  Builder.Symbols = &Symbols;
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  std::string FnName;
+///   ::= 'pure'? plain-prototype
+/// plain-prototype
+///   ::= id '(' param* ')' (':' type)?
+///   ::= unary LETTER '(' param ')' (':' type)?
+///   ::= binary LETTER number? '(' param param ')' (':' type)?
+/// param ::= id (':' type)?
+/// type ::= 'double' | 'int' | 'array'
+std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
+  Symbol FnName;
+  std::string OperatorName;
 
   unsigned Kind = 0; // 0 id, 1 unary, 2 binary
-  unsigned BinaryPrecedence =
-      30; // FIXME: parameterize this with the driver or something
+  unsigned BinaryPrecedence = DefaultBinaryPrecedence;
+
+  auto LogErrorP = [this](const char *Str) -> std::unique_ptr<PrototypeAST> {
+    Diag.error(Tokens.current().source_loc, Str);
+    return nullptr;
+  };
 
-  switch (CurTok) {
+  bool Pure = isPureMarker(Tokens.current(), Tokens.peek(1));
+  if (Pure)
+    (void)Tokens.consume();
+
+  switch (Tokens.current().kind) {
   default:
     return LogErrorP("Expected function name in prototype");
-  case Token::identifier:
-    FnName = lexer::IdentifierStr;
+  case TokenKind::Identifier:
+    if (isArrayBuiltin(Tokens.current().lexeme))
+      return LogErrorP("array and len are built in, they can't be redefined");
+    FnName = Tokens.consume().symbol;
     Kind = 0;
-    getNextToken();
     break;
-  case Token::unary_:
-    getNextToken();
-    if (!isascii(static_cast<int>(CurTok)))
+  case TokenKind::KwUnaryOp:
+    (void)Tokens.consume();
+    if (!isOperatorToken(Tokens.current()))
       return LogErrorP("Expected unary operator");
-    FnName = "unary";
-    FnName += (char)CurTok;
+    OperatorName = Tokens.consume().lexeme;
+    FnName = operatorFunction(*Builder.Symbols, "unary", OperatorName);
     Kind = 1;
-    getNextToken();
     break;
-  case Token::binary_:
-    getNextToken();
-    if (!isascii(static_cast<int>(CurTok)))
+  case TokenKind::KwBinaryOp:
+    (void)Tokens.consume();
+    if (!isOperatorToken(Tokens.current()))
       return LogErrorP("Expected binary operator");
-    FnName = "binary";
-    FnName += (char)CurTok;
+    if (Tokens.is(TokenKind::Equal))
+      return LogErrorP("'=' is assignment, it can't be redefined");
+    OperatorName = Tokens.consume().lexeme;
+    FnName = operatorFunction(*Builder.Symbols, "binary", OperatorName);
     Kind = 2;
-    getNextToken();
 
     // Read precedence if present
-    if (CurTok == Token::number) {
-      if (lexer::NumVal < 1 || lexer::NumVal > 100)
+    if (Tokens.is(TokenKind::Integer)) {
+      long long Prec = std::get<long long>(Tokens.current().literal);
+      if (Prec < 1 || Prec > 100)
         return LogErrorP("Invalid Precedence: must be [1..100]");
-      BinaryPrecedence = (unsigned)lexer::NumVal;
-      getNextToken();
+      BinaryPrecedence = static_cast<unsigned>(Prec);
+      (void)Tokens.consume();
     }
     break;
   }
 
-  if (CurTok != '(')
+  if (!Tokens.match(TokenKind::LParen))
     return LogErrorP("Expected '(' in prototype");
 
-  std::vector<std::string> ArgNames;
-  while (getNextToken() == Token::identifier)
-    ArgNames.push_back(lexer::IdentifierStr);
-  if (CurTok != ')')
+  // Unannotated arguments and returns are doubles
+  std::vector<Symbol> ArgNames;
+  std::vector<ValueType> ArgTypes;
+  while (Tokens.is(TokenKind::Identifier)) {
+    ArgNames.push_back(Tokens.consume().symbol);
+    ArgTypes.push_back(ValueType::Double);
+    if (!Tokens.is(TokenKind::Colon))
+      continue;
+    (void)Tokens.consume();
+    auto Ty = typeName(Tokens.current());
+    if (!Ty)
+      return LogErrorP("Expected type (int, double or array) after ':'");
+    (void)Tokens.consume();
+    ArgTypes.back() = *Ty;
+  }
+  if (!Tokens.match(TokenKind::RParen))
     return LogErrorP("Expected ')' in prototype");
 
-  // success.
-  getNextToken(); // eat ')'.
+  ValueType RetType = ValueType::Double;
+  if (Tokens.is(TokenKind::Colon))
+    if (auto Ty = typeName(Tokens.peek(1))) {
+      (void)Tokens.consume();
+      (void)Tokens.consume();
+      RetType = *Ty;
+    }
 
   // Verify right number of names for operator
   if (Kind && ArgNames.size() != Kind)
@@ -368,35 +579,56 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         ("Invalid number of operands for operator kind:" + std::to_string(Kind))
             .c_str());
 
-  return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind = !0,
-                                        BinaryPrecedence);
+  if (Pure && (RetType == ValueType::Array ||
+               llvm::is_contained(ArgTypes, ValueType::Array)))
+    return LogErrorP("A pure function can't take or return arrays");
+
+  return std::make_unique<PrototypeAST>(
+      FnName, std::move(ArgNames), std::move(ArgTypes), RetType,
+      std::move(OperatorName), BinaryPrecedence, Pure);
 }
 
 /// definition ::= 'def' prototype expression
-std::unique_ptr<FunctionAST> ParseDefinition() {
-  getNextToken(); // eat def.
-  auto Proto = ParsePrototype();
+std::unique_ptr<FunctionAST> Parser::parseDefinition(ASTContext &Ctx) {
+  (void)Tokens.consume(); // eat def.
+  auto Proto = parsePrototype();
   if (!Proto)
     return nullptr;
 
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  Builder.Ctx = &Ctx;
+  if (auto *E = Engine.parseExpression(0))
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
   return nullptr;
 }
 
 /// toplevelexpr ::= expression
-std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
+std::unique_ptr<FunctionAST> Parser::parseTopLevelExpr(ASTContext &Ctx) {
+  Builder.Ctx = &Ctx;
+  if (auto *E = Engine.parseExpression(0)) {
     // Make an anonymous proto.
-    auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                                                std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    auto Proto = std::make_unique<PrototypeAST>(
+        Builder.Symbols->intern("__anon_expr"), std::vector<Symbol>(),
+        std::vector<ValueType>());
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
   }
   return nullptr;
 }
 
 /// external ::= 'extern' prototype
-std::unique_ptr<PrototypeAST> ParseExtern() {
-  getNextToken(); // eat extern.
-  return ParsePrototype();
+std::unique_ptr<PrototypeAST> Parser::parseExtern() {
+  (void)Tokens.consume(); // eat extern.
+  auto Proto = parsePrototype();
+  if (Proto)
+    Proto->setExtern();
+
+  // Nothing can be inferred about an extern, a pure one (e.g. a math
+  // function) is taken at its word
+  if (Proto && Proto->isPure())
+    Proto->setEffects({.DoesNotAccessMemory = true,
+                       .OnlyReadsMemory = true,
+                       .DoesNotThrow = true,
+                       .WillReturn = true});
+  return Proto;
 }
+
+} // namespace athens
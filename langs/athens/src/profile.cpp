@@ -0,0 +1,139 @@
+#include "profile.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+using namespace llvm;
+
+namespace {
+/// CounterTable - The counters of one generated function.
+struct CounterTable {
+  std::string Name;
+  uint64_t Hash;
+  size_t Size;
+  std::unique_ptr<uint64_t[]> Counters;
+};
+
+/// ProfileCounters - Every table handed out so far, and where they go.
+struct ProfileCounters {
+  std::mutex M;
+  std::vector<CounterTable> Tables;
+  std::string Path;
+};
+
+// Never destroyed, generated code may count until the process is gone
+ProfileCounters &Counters = *new ProfileCounters;
+} // namespace
+
+uint64_t *newProfileCounters(StringRef Name, uint64_t Hash,
+                             size_t NumCounters) {
+  std::lock_guard<std::mutex> L(Counters.M);
+  auto &T = Counters.Tables.emplace_back(
+      CounterTable{Name.str(), Hash, NumCounters,
+                   std::make_unique<uint64_t[]>(NumCounters)});
+  return T.Counters.get();
+}
+
+static void writeProfile() {
+  std::lock_guard<std::mutex> L(Counters.M);
+
+  // Each top-level expression is a function of its own, most of them named
+  // alike
+  std::map<std::tuple<std::string, uint64_t, size_t>, std::vector<uint64_t>>
+      Merged;
+  for (const CounterTable &T : Counters.Tables) {
+    auto &Counts = Merged[{T.Name, T.Hash, T.Size}];
+    Counts.resize(T.Size);
+    for (size_t I = 0; I != T.Size; ++I)
+      Counts[I] += T.Counters[I];
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(Counters.Path, EC);
+  if (EC) {
+    errs() << "Couldn't write the profile " << Counters.Path << ": "
+           << EC.message() << "\n";
+    return;
+  }
+  OS << "# athens profile: name hash counters entry (true false)...\n";
+  for (const auto &[Key, Counts] : Merged) {
+    OS << std::get<0>(Key) << ' ' << std::get<1>(Key) << ' '
+       << std::get<2>(Key);
+    for (uint64_t C : Counts)
+      OS << ' ' << C;
+    OS << '\n';
+  }
+}
+
+void writeProfileAtExit(std::string Path) {
+  static std::once_flag Registered;
+  {
+    std::lock_guard<std::mutex> L(Counters.M);
+    Counters.Path = std::move(Path);
+  }
+  std::call_once(Registered, [] {
+    std::atexit(writeProfile);
+    std::at_quick_exit(writeProfile);
+  });
+}
+
+Expected<std::unique_ptr<ProfileData>>
+ProfileData::read(const std::string &Path) {
+  auto Buffer = MemoryBuffer::getFile(Path, /*IsText=*/true);
+  if (!Buffer)
+    return createStringError(Buffer.getError(), "Couldn't read the profile %s",
+                             Path.c_str());
+
+  auto Malformed = [&](int64_t Line) {
+    return createStringError(inconvertibleErrorCode(),
+                             "%s:%lld: malformed profile", Path.c_str(),
+                             static_cast<long long>(Line));
+  };
+
+  auto PD = std::unique_ptr<ProfileData>(new ProfileData);
+  InstrProfSummaryBuilder Builder(ProfileSummaryBuilder::DefaultCutoffs);
+  for (line_iterator LI(**Buffer, /*SkipBlanks=*/true, '#'); !LI.is_at_eof();
+       ++LI) {
+    SmallVector<StringRef, 16> Fields;
+    LI->split(Fields, ' ', -1, /*KeepEmpty=*/false);
+
+    Record R;
+    size_t NumCounters;
+    if (Fields.size() < 3 || Fields[1].getAsInteger(10, R.Hash) ||
+        Fields[2].getAsInteger(10, NumCounters) || NumCounters == 0 ||
+        Fields.size() != 3 + NumCounters)
+      return Malformed(LI.line_number());
+    for (StringRef Field : drop_begin(Fields, 3)) {
+      uint64_t Count;
+      if (Field.getAsInteger(10, Count))
+        return Malformed(LI.line_number());
+      R.Counts.push_back(Count);
+    }
+
+    // Like a front end's profile, the first counter is the entry count
+    Builder.addRecord(InstrProfRecord(R.Counts));
+    PD->Functions[Fields[0]].push_back(std::move(R));
+  }
+  PD->Summary = Builder.getSummary();
+  return PD;
+}
+
+ArrayRef<uint64_t> ProfileData::lookup(StringRef Name, uint64_t Hash,
+                                       size_t NumCounters) const {
+  auto FI = Functions.find(Name);
+  if (FI == Functions.end())
+    return {};
+  for (const Record &R : FI->second)
+    if (R.Hash == Hash && R.Counts.size() == NumCounters)
+      return R.Counts;
+  return {};
+}
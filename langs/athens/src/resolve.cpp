@@ -0,0 +1,210 @@
+#include "resolve.h"
+#include "error.h"
+
+#include <string>
+
+using namespace llvm;
+
+unsigned Resolver::bind(Symbol Name) {
+  Scope.emplace_back(Name, NumSlots);
+  return NumSlots++;
+}
+
+void Resolver::assign(unsigned Slot) {
+  if (Slot >= Assigned.size())
+    Assigned.resize(Slot + 1);
+  Assigned.set(Slot);
+}
+
+void Resolver::reference(unsigned Slot) {
+  // Nested parfors all have to pass it down
+  for (ParforScope &P : Parfors)
+    if (Slot < P.Counter && !is_contained(P.Captures, Slot))
+      P.Captures.push_back(Slot);
+}
+
+void Resolver::enterParfor(unsigned Counter) {
+  Parfors.push_back({Counter, {}});
+}
+
+ArrayRef<unsigned> Resolver::exitParfor() {
+  auto Captures = Ctx.copyArray<unsigned>(Parfors.back().Captures);
+  Parfors.pop_back();
+  return Captures;
+}
+
+void Resolver::call(Symbol Name, unsigned NumArgs, bool Overloadable) {
+  for (const CalleeRef &C : Callees)
+    if (C.Name == Name && C.NumArgs == NumArgs)
+      return;
+  Callees.push_back({Name, NumArgs, Overloadable});
+}
+
+ArrayRef<CalleeRef> Resolver::getCallees() {
+  return Ctx.copyArray<CalleeRef>(Callees);
+}
+
+std::optional<unsigned> Resolver::lookup(Symbol Name) const {
+  for (auto It = Scope.rbegin(), E = Scope.rend(); It != E; ++It)
+    if (It->first == Name)
+      return It->second;
+  return std::nullopt;
+}
+
+bool Resolver::error(const char *Msg, Symbol Name) {
+  std::string Str = Msg;
+  Str += ": ";
+  Str += Symbols.str(Name);
+  error::logError(Str.c_str());
+  return false;
+}
+
+bool Resolver::error(const char *Msg) {
+  error::logError(Msg);
+  return false;
+}
+
+bool ExprAST::resolve(Resolver &R) {
+  switch (getKind()) {
+  case EK_Number:
+    return cast<NumberExprAST>(this)->resolve(R);
+  case EK_Variable:
+    return cast<VariableExprAST>(this)->resolve(R);
+  case EK_Var:
+    return cast<VarExprAST>(this)->resolve(R);
+  case EK_Binary:
+    return cast<BinaryExprAST>(this)->resolve(R);
+  case EK_Unary:
+    return cast<UnaryExprAST>(this)->resolve(R);
+  case EK_If:
+    return cast<IfExprAST>(this)->resolve(R);
+  case EK_For:
+    return cast<ForExprAST>(this)->resolve(R);
+  case EK_Parfor:
+    return cast<ParforExprAST>(this)->resolve(R);
+  case EK_Call:
+    return cast<CallExprAST>(this)->resolve(R);
+  case EK_Array:
+    return cast<ArrayExprAST>(this)->resolve(R);
+  case EK_Index:
+    return cast<IndexExprAST>(this)->resolve(R);
+  case EK_Length:
+    return cast<LengthExprAST>(this)->resolve(R);
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+bool NumberExprAST::resolve(Resolver &) { return true; }
+
+bool VariableExprAST::resolve(Resolver &R) {
+  auto Found = R.lookup(Name);
+  if (!Found)
+    return R.error("Unknown variable name", Name);
+  Slot = *Found;
+  R.reference(Slot);
+  return true;
+}
+
+bool VarExprAST::resolve(Resolver &R) {
+  // Each initializer sees the names bound before it, but not its own (x = x
+  // refers to an outer x)
+  for (auto &Binding : VarNames) {
+    if (Binding.Init && !Binding.Init->resolve(R))
+      return false;
+    Binding.Slot = R.bind(Binding.Name);
+  }
+
+  bool Ok = Body->resolve(R);
+  R.unbind(VarNames.size());
+  return Ok;
+}
+
+bool BinaryExprAST::resolve(Resolver &R) {
+  // The lhs of '=' is assigned to, not evaluated, it has to be a variable or
+  // an array element
+  if (Op == BuiltinOp::Assign && !isa<VariableExprAST, IndexExprAST>(LHS))
+    return R.error("lhs of = must be a variable or an array element");
+
+  if (!LHS->resolve(R) || !RHS->resolve(R))
+    return false;
+  // Any other operator calls its function if it's defined (or isn't built in)
+  if (Op != BuiltinOp::Assign)
+    R.call(OpFn, 2, Op != BuiltinOp::None);
+  // Storing into an element doesn't change the array variable
+  if (Op == BuiltinOp::Assign)
+    if (auto *Var = dyn_cast<VariableExprAST>(LHS)) {
+      if (R.isShared(Var->getSlot()))
+        return R.error("A parfor body can't assign its counter or variables "
+                       "from outside it",
+                       Var->getName());
+      R.assign(Var->getSlot());
+    }
+  return true;
+}
+
+bool UnaryExprAST::resolve(Resolver &R) {
+  R.call(OpFn, 1, Op != BuiltinOp::None);
+  return Operand->resolve(R);
+}
+
+bool IfExprAST::resolve(Resolver &R) {
+  return Cond->resolve(R) && Then->resolve(R) && Else->resolve(R);
+}
+
+bool ForExprAST::resolve(Resolver &R) {
+  // The start value is computed before the loop variable exists
+  if (!Start->resolve(R))
+    return false;
+
+  R.loop(/*Parallel=*/false);
+  Slot = R.bind(VarName);
+  bool Ok = End->resolve(R) && (!Step || Step->resolve(R)) &&
+            Body->resolve(R);
+  R.unbind(1);
+
+  // Only the loop itself changes the variable, it can live in a PHI
+  VarAssigned = R.isAssigned(Slot);
+  return Ok;
+}
+
+bool ParforExprAST::resolve(Resolver &R) {
+  if (!Start->resolve(R) || !End->resolve(R))
+    return false;
+
+  R.loop(/*Parallel=*/true);
+  Slot = R.bind(VarName);
+  R.enterParfor(Slot);
+  bool Ok = Body->resolve(R);
+  Captures = R.exitParfor();
+  R.unbind(1);
+  return Ok;
+}
+
+bool CallExprAST::resolve(Resolver &R) {
+  R.call(Callee, Args.size(), /*Overloadable=*/false);
+  for (auto *Arg : Args)
+    if (!Arg->resolve(R))
+      return false;
+  return true;
+}
+
+bool ArrayExprAST::resolve(Resolver &R) { return Size->resolve(R); }
+
+bool IndexExprAST::resolve(Resolver &R) {
+  return Array->resolve(R) && Index->resolve(R);
+}
+
+bool LengthExprAST::resolve(Resolver &R) { return Array->resolve(R); }
+
+bool FunctionAST::resolve(Resolver &R) {
+  // Arguments take the first slots, in order
+  for (Symbol Arg : Proto->getArgs())
+    R.bind(Arg);
+
+  Resolved = Body->resolve(R);
+  NumSlots = R.getNumSlots();
+  Callees = R.getCallees();
+  HasLoops = R.hasLoops();
+  HasParfor = R.hasParfor();
+  return Resolved;
+}
@@ -1,11 +1,764 @@
 #include "runtime.h"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+/// OutputBuffer - What a thread printed and hasn't written out yet. It's
+/// written in one go once it's big enough, on flush() and when the thread
+/// exits (for the main thread that's exit() or returning from main).
+class OutputBuffer {
+public:
+  ~OutputBuffer() { flush(); }
+
+  void append(const char *Data, size_t Size) {
+    Buf.append(Data, Size);
+    if (Buf.size() >= FlushSize)
+      flush();
+  }
+
+  void flush();
+
+private:
+  static constexpr size_t FlushSize = 1 << 16;
+
+  std::string Buf;
+};
+
+std::atomic<int> OutputFd = 1;
+
+void OutputBuffer::flush() {
+  const char *Data = Buf.data();
+  size_t Left = Buf.size();
+  while (Left) {
+    auto N = write(OutputFd.load(std::memory_order_relaxed), Data, Left);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      break; // Nowhere to put it, like a closed pipe
+    Data += N;
+    Left -= N;
+  }
+  Buf.clear();
+}
+
+thread_local OutputBuffer Output;
+// Where the running parfor chunk's output goes (or the captured output of
+// a top-level expression), null outside of parfors
+thread_local std::string *ChunkOutput = nullptr;
+// The top-level expression this thread runs with its output captured
+thread_local AthensCapture *Capture = nullptr;
+
+void print(const char *Data, size_t Size) {
+  if (ChunkOutput)
+    ChunkOutput->append(Data, Size);
+  else
+    Output.append(Data, Size);
+}
+
+} // namespace
+
+extern "C" [[noreturn]] DLLEXPORT void athens_fatal(const char *Message) {
+  Output.flush();
+  fprintf(stderr, "Error: %s\n", Message);
+  std::exit(1);
+}
+
+extern "C" [[noreturn]] DLLEXPORT void athens_fatal_now(const char *Message) {
+  Output.flush();
+  fprintf(stderr, "Error: %s\n", Message);
+  fflush(nullptr);
+  std::quick_exit(1);
+}
+
+namespace {
+
+// A parfor chunk running on this thread ran into a runtime error, see
+// ParforPool::fail
+bool inParforChunk();
+[[noreturn]] void failParforChunk(const char *Message);
+
+/// Report a runtime error and exit, after what was printed before it. An
+/// error in a parfor chunk is reported by the thread that started the loop,
+/// a captured top-level expression hands it to its session.
+[[noreturn]] void fatal(const char *Fmt, ...) {
+  char Message[256];
+  va_list Args;
+  va_start(Args, Fmt);
+  vsnprintf(Message, sizeof(Message), Fmt, Args);
+  va_end(Args);
+  if (inParforChunk())
+    failParforChunk(Message);
+  if (Capture)
+    Capture->Fatal(*Capture, Message);
+  athens_fatal(Message);
+}
+
+} // namespace
+
+extern "C" [[noreturn]] DLLEXPORT void athens_not_linked() {
+  fatal("called a function whose definition failed to link");
+}
+
 extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
+  char C = (char)X;
+  print(&C, 1);
   return 0;
 }
 
 extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
+  // Shortest representation that reads back as X
+  char Buf[64];
+  auto [End, Err] = std::to_chars(Buf, Buf + sizeof(Buf) - 1, X);
+  *End++ = '\n';
+  print(Buf, End - Buf);
   return 0;
 }
+
+extern "C" DLLEXPORT double printstr(const double *Chars, int64_t Length) {
+  std::string Str(Length, '\0');
+  for (int64_t I = 0; I != Length; ++I)
+    Str[I] = (char)Chars[I];
+  print(Str.data(), Str.size());
+  return 0;
+}
+
+extern "C" DLLEXPORT double flush() {
+  Output.flush();
+  return 0;
+}
+
+extern "C" DLLEXPORT void athens_set_output_fd(int Fd) {
+  Output.flush();
+  OutputFd = Fd;
+}
+
+extern "C" DLLEXPORT void athens_capture_output(AthensCapture *C) {
+  Capture = C;
+  ChunkOutput = C ? &C->Output : nullptr;
+}
+
+extern "C" DLLEXPORT void athens_print(const char *Data, int64_t Size) {
+  print(Data, Size);
+}
+
+namespace {
+
+/// ArrayArena - Bump allocator for array elements. Positions (and so marks)
+/// count doubles handed out since the arena was created, a chunk covers the
+/// positions [Start, Start + Size).
+class ArrayArena {
+public:
+  double *allocate(int64_t N) {
+    // Keep every array on its own cache line (and vector aligned)
+    int64_t Rounded = (std::max<int64_t>(N, 1) + 7) & ~int64_t(7);
+    if (Chunks.empty() || Top + Rounded > Chunks.back().end())
+      newChunk(Rounded);
+
+    Chunk &C = Chunks.back();
+    double *Mem = C.Mem.get() + (Top - C.Start);
+    Top += Rounded;
+    std::memset(Mem, 0, N * sizeof(double));
+    return Mem;
+  }
+
+  int64_t mark() const { return Top; }
+
+  void release(int64_t Mark) {
+    // Chunks entirely past the mark are kept around for the next arrays
+    while (!Chunks.empty() && Chunks.back().Start >= Mark) {
+      Spare.push_back(std::move(Chunks.back()));
+      Chunks.pop_back();
+    }
+    Top = Mark;
+  }
+
+private:
+  struct FreeDeleter {
+    void operator()(double *P) const { std::free(P); }
+  };
+
+  struct Chunk {
+    std::unique_ptr<double[], FreeDeleter> Mem;
+    int64_t Start;
+    int64_t Size;
+
+    int64_t end() const { return Start + Size; }
+  };
+
+  // 512 KiB, bigger arrays get a chunk of their own
+  static constexpr int64_t ChunkSize = 1 << 16;
+
+  void newChunk(int64_t MinSize) {
+    // What's left of the current chunk is skipped
+    auto Fits = [&](const Chunk &C) { return C.Size >= MinSize; };
+    if (auto It = std::find_if(Spare.begin(), Spare.end(), Fits);
+        It != Spare.end()) {
+      Chunks.push_back(std::move(*It));
+      Spare.erase(It);
+    } else {
+      int64_t Size = std::max(MinSize, ChunkSize);
+      auto *Mem = static_cast<double *>(
+          std::aligned_alloc(64, Size * sizeof(double)));
+      if (!Mem)
+        fatal("out of memory allocating an array");
+      Chunks.push_back({decltype(Chunk::Mem)(Mem), 0, Size});
+    }
+    Chunks.back().Start = Top;
+  }
+
+  std::vector<Chunk> Chunks;
+  std::vector<Chunk> Spare;
+  int64_t Top = 0;
+};
+
+// Sessions can run code on several threads at once
+thread_local ArrayArena Arena;
+
+} // namespace
+
+extern "C" DLLEXPORT double *athens_array_new(int64_t N) {
+  if (N < 0)
+    fatal("negative array length %lld", (long long)N);
+  if (N > PTRDIFF_MAX / int64_t(sizeof(double)) - 8)
+    fatal("array length %lld is too big", (long long)N);
+  return Arena.allocate(N);
+}
+
+extern "C" DLLEXPORT int64_t athens_arena_mark() { return Arena.mark(); }
+
+extern "C" DLLEXPORT void athens_arena_release(int64_t Mark) {
+  Arena.release(Mark);
+}
+
+extern "C" DLLEXPORT void athens_bounds_fail(int64_t Index, int64_t Length) {
+  fatal("index %lld out of bounds for an array of length %lld",
+        (long long)Index, (long long)Length);
+}
+
+namespace {
+
+/// ParforPool - The threads parfors run on. One loop runs at a time: its
+/// chunks are dealt out evenly to the workers' queues up front, a worker
+/// takes chunks off the front of its own queue and, once that's empty,
+/// steals the back half of another worker's. Worker 0 is the thread that
+/// started the loop, the others are created as they're first needed and live
+/// as long as the process.
+class ParforPool {
+public:
+  using BodyFn = double (*)(void *, int64_t, int64_t);
+
+  double run(BodyFn Body, void *Env, int64_t Start, int64_t End,
+             int64_t Reduce) {
+    // End > Start, so the difference fits
+    uint64_t Trip = End > Start ? uint64_t(End) - uint64_t(Start) : 0;
+
+    std::unique_lock<std::mutex> Running(RunMutex, std::try_to_lock);
+    if (InParfor || !Running || Threads < 2 || Trip < 2)
+      return Body(Env, Start, End);
+
+    // A few chunks per thread, so steals can even out uneven iterations
+    unsigned NumWorkers = unsigned(std::min<uint64_t>(Threads, Trip));
+    uint64_t NumChunks = std::min<uint64_t>(Trip, uint64_t(NumWorkers) * 8);
+    Job = {Body, Env, Start, Trip, NumChunks, NumWorkers};
+    Failed = false;
+    CallerOutput = ChunkOutput;
+    Partials.assign(NumChunks, 0);
+    Outputs.assign(NumChunks, std::string());
+    while (Queues.size() < NumWorkers)
+      Queues.emplace_back();
+    for (unsigned Id = 0; Id != NumWorkers; ++Id) {
+      Queues[Id].Begin = NumChunks * Id / NumWorkers;
+      Queues[Id].End = NumChunks * (Id + 1) / NumWorkers;
+    }
+
+    {
+      std::lock_guard<std::mutex> L(M);
+      for (; NumThreads < NumWorkers; ++NumThreads)
+        std::thread(&ParforPool::workerMain, this, NumThreads, Generation)
+            .detach();
+      Active = NumWorkers - 1;
+      ++Generation;
+    }
+    WorkCV.notify_all();
+
+    work(0);
+    waitForWorkers();
+    if (Failed)
+      reportError();
+
+    // Everything in chunk order, whichever thread ran it
+    double Result = Reduce == AthensProduct ? 1 : 0;
+    for (double Partial : Partials)
+      Result = Reduce == AthensProduct ? Result * Partial : Result + Partial;
+    for (const std::string &Out : Outputs)
+      print(Out.data(), Out.size());
+    return Result;
+  }
+
+  /// A runtime error in the chunk this thread runs. No more chunks are
+  /// handed out, and once the running ones are done the thread that started
+  /// the loop reports the error of the first chunk that failed, after what
+  /// the chunks before it printed (like a for loop would). It can't return
+  /// into the body, so a worker waits for the exit.
+  [[noreturn]] void fail(const char *Message) {
+    {
+      std::lock_guard<std::mutex> L(ErrorMutex);
+      if (!Failed || RunningChunk < FailedChunk) {
+        FailedChunk = RunningChunk;
+        Error = Message;
+      }
+      Failed = true;
+    }
+    RunningChunk = NoChunk;
+    InParfor = false;
+
+    if (WorkerId != 0) {
+      ChunkOutput = nullptr;
+      {
+        std::lock_guard<std::mutex> L(M);
+        if (--Active == 0)
+          DoneCV.notify_one();
+      }
+      for (;;)
+        std::this_thread::sleep_for(std::chrono::hours(1));
+    }
+    ChunkOutput = CallerOutput;
+    waitForWorkers();
+    reportError();
+  }
+
+  bool inChunk() const { return RunningChunk != NoChunk; }
+
+  void setThreads(int64_t N) {
+    std::lock_guard<std::mutex> Running(RunMutex);
+    Threads = N > 0 ? unsigned(std::min<int64_t>(N, 1024)) : defaultThreads();
+  }
+
+private:
+  struct JobInfo {
+    BodyFn Body;
+    void *Env;
+    int64_t Start;
+    uint64_t Trip;
+    uint64_t NumChunks;
+    unsigned NumWorkers;
+  };
+
+  // The chunks [Begin, End) a worker has left
+  struct Queue {
+    std::mutex M;
+    uint64_t Begin = 0, End = 0;
+  };
+
+  static unsigned defaultThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  void waitForWorkers() {
+    std::unique_lock<std::mutex> L(M);
+    DoneCV.wait(L, [&] { return Active == 0; });
+  }
+
+  // On the thread that started the loop, once the workers are done
+  [[noreturn]] void reportError() {
+    for (uint64_t Chunk = 0; Chunk <= FailedChunk; ++Chunk)
+      print(Outputs[Chunk].data(), Outputs[Chunk].size());
+    fatal("%s", Error.c_str());
+  }
+
+  void workerMain(unsigned Id, uint64_t Seen) {
+    std::unique_lock<std::mutex> L(M);
+    for (;;) {
+      WorkCV.wait(L, [&] { return Generation != Seen; });
+      Seen = Generation;
+      if (Id >= Job.NumWorkers)
+        continue;
+
+      L.unlock();
+      work(Id);
+      L.lock();
+      if (--Active == 0)
+        DoneCV.notify_one();
+    }
+  }
+
+  void work(unsigned Id) {
+    WorkerId = Id;
+    InParfor = true;
+    uint64_t Chunk;
+    while (next(Id, Chunk))
+      runChunk(Chunk);
+    InParfor = false;
+  }
+
+  bool next(unsigned Id, uint64_t &Chunk) {
+    if (Failed)
+      return false;
+    Queue &Own = Queues[Id];
+    {
+      std::lock_guard<std::mutex> L(Own.M);
+      if (Own.Begin != Own.End) {
+        Chunk = Own.Begin++;
+        return true;
+      }
+    }
+
+    for (unsigned I = 1; I != Job.NumWorkers; ++I) {
+      Queue &Victim = Queues[(Id + I) % Job.NumWorkers];
+      uint64_t From, To;
+      {
+        std::lock_guard<std::mutex> L(Victim.M);
+        if (Victim.Begin == Victim.End)
+          continue;
+        To = Victim.End;
+        From = To - (To - Victim.Begin + 1) / 2;
+        Victim.End = From;
+      }
+      // Run the first stolen chunk, queue the rest
+      std::lock_guard<std::mutex> L(Own.M);
+      Chunk = From;
+      Own.Begin = From + 1;
+      Own.End = To;
+      return true;
+    }
+    return false;
+  }
+
+  void runChunk(uint64_t Chunk) {
+    // The first Trip % NumChunks chunks get an extra iteration
+    uint64_t Size = Job.Trip / Job.NumChunks;
+    uint64_t Extra = Job.Trip % Job.NumChunks;
+    int64_t Begin = Job.Start + int64_t(Size * Chunk + std::min(Chunk, Extra));
+    int64_t End = Begin + int64_t(Size + (Chunk < Extra));
+
+    // The calling thread's output may be captured
+    std::string *Outer = ChunkOutput;
+    ChunkOutput = &Outputs[Chunk];
+    RunningChunk = Chunk;
+    Partials[Chunk] = Job.Body(Job.Env, Begin, End);
+    RunningChunk = NoChunk;
+    ChunkOutput = Outer;
+  }
+
+  // Held while a loop runs
+  std::mutex RunMutex;
+  unsigned Threads = defaultThreads();
+  JobInfo Job = {};
+  std::vector<double> Partials;
+  std::vector<std::string> Outputs;
+  // Where the thread that started the loop printed to
+  std::string *CallerOutput = nullptr;
+
+  // The first chunk (in chunk order) that ran into a runtime error
+  std::mutex ErrorMutex;
+  std::atomic<bool> Failed = false;
+  uint64_t FailedChunk = 0;
+  std::string Error;
+  // Never shrinks, idle workers keep pointing into it
+  std::deque<Queue> Queues;
+
+  // Guards the rest, workers wait for a new Generation
+  std::mutex M;
+  std::condition_variable WorkCV, DoneCV;
+  unsigned NumThreads = 1; // The workers created so far, plus worker 0
+  uint64_t Generation = 0;
+  unsigned Active = 0;
+
+  static constexpr uint64_t NoChunk = UINT64_MAX;
+  static thread_local bool InParfor;
+  static thread_local unsigned WorkerId;
+  static thread_local uint64_t RunningChunk;
+};
+
+thread_local bool ParforPool::InParfor = false;
+thread_local unsigned ParforPool::WorkerId = 0;
+thread_local uint64_t ParforPool::RunningChunk = ParforPool::NoChunk;
+
+// Never destroyed, its threads can still be waiting when the process exits
+ParforPool &Pool = *new ParforPool;
+
+bool inParforChunk() { return Pool.inChunk(); }
+
+void failParforChunk(const char *Message) { Pool.fail(Message); }
+
+} // namespace
+
+extern "C" DLLEXPORT double athens_parfor(double (*Body)(void *, int64_t,
+                                                         int64_t),
+                                          void *Env, int64_t Start,
+                                          int64_t End, int64_t Reduce) {
+  return Pool.run(Body, Env, Start, End, Reduce);
+}
+
+extern "C" DLLEXPORT void athens_set_threads(int64_t N) {
+  Pool.setThreads(N);
+}
+
+namespace {
+
+/// MemoTable - One thread's results of one pure function: open addressing
+/// on the hash of the key, probing a few entries at most. It starts small and
+/// doubles while it's more than half full, until it reaches its capacity.
+class MemoTable {
+public:
+  MemoTable(unsigned NumArgs, uint64_t Capacity, AthensMemoEviction Eviction)
+      : NumArgs(NumArgs), Capacity(Capacity), Eviction(Eviction) {
+    resize(std::min<uint64_t>(Capacity, 64));
+  }
+
+  bool lookup(const int64_t *Key, int64_t &Result) {
+    int64_t *Entry = find(Key);
+    bool Hit = Entry && Used[index(Entry)];
+    if (Hit)
+      Result = Entry[NumArgs];
+    // Only this thread writes them, others just read the stats
+    auto &Counter = Hit ? Hits : Misses;
+    Counter.store(Counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+    return Hit;
+  }
+
+  void store(const int64_t *Key, int64_t Result) {
+    int64_t *Entry = find(Key);
+    if (!Entry && size() < Capacity) {
+      resize(size() * 2);
+      Entry = find(Key);
+    }
+    if (!Entry) {
+      // The probed entries are all taken by other keys
+      switch (Eviction) {
+      case AthensEvictReplace:
+        Entry = entry(hash(Key));
+        break;
+      case AthensEvictClear:
+        std::fill(Used.begin(), Used.end(), false);
+        Count = 0;
+        Entry = entry(hash(Key));
+        break;
+      case AthensEvictKeep:
+        return;
+      }
+    }
+
+    if (!Used[index(Entry)]) {
+      Used[index(Entry)] = true;
+      ++Count;
+    }
+    std::copy(Key, Key + NumArgs, Entry);
+    Entry[NumArgs] = Result;
+
+    if (Count * 2 > size() && size() < Capacity)
+      resize(size() * 2);
+  }
+
+  uint64_t bytes() const { return Bytes.load(std::memory_order_relaxed); }
+
+  std::atomic<uint64_t> Hits = 0, Misses = 0;
+
+private:
+  static constexpr uint64_t MaxProbes = 8;
+
+  uint64_t size() const { return Used.size(); }
+  uint64_t stride() const { return NumArgs + 1; }
+  int64_t *entry(uint64_t Hash) {
+    return &Entries[(Hash & (size() - 1)) * stride()];
+  }
+  uint64_t index(const int64_t *Entry) const {
+    return (Entry - Entries.data()) / stride();
+  }
+
+  uint64_t hash(const int64_t *Key) const {
+    // MurmurHash3's finalizer after every word: the bits of doubles that
+    // differ are the high ones, the table is indexed by the low ones
+    uint64_t H = 0x9e3779b97f4a7c15;
+    for (unsigned I = 0; I != NumArgs; ++I) {
+      H ^= uint64_t(Key[I]);
+      H ^= H >> 33;
+      H *= 0xff51afd7ed558ccd;
+      H ^= H >> 33;
+      H *= 0xc4ceb9fe1a85ec53;
+      H ^= H >> 33;
+    }
+    return H;
+  }
+
+  /// The entry holding Key, or the free one it would go in. Null if neither
+  /// is within MaxProbes of where Key belongs.
+  int64_t *find(const int64_t *Key) {
+    uint64_t H = hash(Key);
+    for (uint64_t Probe = 0; Probe != std::min(MaxProbes, size()); ++Probe) {
+      int64_t *Entry = entry(H + Probe);
+      if (!Used[index(Entry)] || std::equal(Key, Key + NumArgs, Entry))
+        return Entry;
+    }
+    return nullptr;
+  }
+
+  void resize(uint64_t NewSize) {
+    std::vector<int64_t> Old = std::move(Entries);
+    std::vector<bool> OldUsed = std::move(Used);
+    Entries.assign(NewSize * stride(), 0);
+    Used.assign(NewSize, false);
+    Count = 0;
+    // Only this thread resizes, others read the size for athens_memo_bytes
+    Bytes.store(Entries.capacity() * sizeof(int64_t) + Used.capacity() / 8,
+                std::memory_order_relaxed);
+
+    // Entries that don't fit anymore are dropped, they're only a cache
+    for (uint64_t I = 0; I != OldUsed.size(); ++I) {
+      if (!OldUsed[I])
+        continue;
+      const int64_t *Key = &Old[I * stride()];
+      if (int64_t *Entry = find(Key)) {
+        Used[index(Entry)] = true;
+        ++Count;
+        std::copy(Key, Key + stride(), Entry);
+      }
+    }
+  }
+
+  unsigned NumArgs;
+  uint64_t Capacity; // A power of 2
+  AthensMemoEviction Eviction;
+  uint64_t Count = 0;
+  // Entry I is the key at Entries[I * stride()], then the result
+  std::vector<int64_t> Entries;
+  std::vector<bool> Used;
+  std::atomic<uint64_t> Bytes = 0;
+};
+
+struct ThreadMemo;
+
+/// MemoRegistry - The pure functions' tables on every thread, for the
+/// stats. Threads create their tables as they first call the functions.
+struct MemoRegistry {
+  std::mutex M;
+  // Per table id. Id 0 isn't handed out, compiled code gets ids as the
+  // addresses of symbols, which can't be null.
+  std::vector<unsigned> NumArgs = {0};
+  std::vector<ThreadMemo *> Threads;
+  // Counts of the tables of threads that exited
+  std::vector<uint64_t> ExitedHits = {0}, ExitedMisses = {0};
+  uint64_t Capacity = 1 << 16;
+  AthensMemoEviction Eviction = AthensEvictReplace;
+};
+
+// Never destroyed, threads can exit after it would be
+MemoRegistry &Memo = *new MemoRegistry;
+
+/// ThreadMemo - A thread's tables, indexed by id.
+struct ThreadMemo {
+  std::vector<std::unique_ptr<MemoTable>> Tables;
+
+  ThreadMemo() {
+    std::lock_guard<std::mutex> L(Memo.M);
+    Memo.Threads.push_back(this);
+  }
+
+  ~ThreadMemo() {
+    std::lock_guard<std::mutex> L(Memo.M);
+    for (size_t Id = 0; Id != Tables.size(); ++Id)
+      if (Tables[Id]) {
+        Memo.ExitedHits[Id] += Tables[Id]->Hits;
+        Memo.ExitedMisses[Id] += Tables[Id]->Misses;
+      }
+    std::erase(Memo.Threads, this);
+  }
+
+  MemoTable &table(int64_t Id) {
+    if (size_t(Id) < Tables.size() && Tables[Id])
+      return *Tables[Id];
+
+    // Stats read Tables from other threads
+    std::lock_guard<std::mutex> L(Memo.M);
+    if (size_t(Id) >= Tables.size())
+      Tables.resize(Id + 1);
+    Tables[Id] = std::make_unique<MemoTable>(Memo.NumArgs[Id], Memo.Capacity,
+                                             Memo.Eviction);
+    return *Tables[Id];
+  }
+};
+
+thread_local ThreadMemo ThreadTables;
+
+} // namespace
+
+extern "C" DLLEXPORT int64_t athens_memo_new(int64_t NumArgs) {
+  std::lock_guard<std::mutex> L(Memo.M);
+  Memo.NumArgs.push_back(unsigned(NumArgs));
+  Memo.ExitedHits.push_back(0);
+  Memo.ExitedMisses.push_back(0);
+  return Memo.NumArgs.size() - 1;
+}
+
+extern "C" DLLEXPORT int64_t athens_memo_lookup(int64_t Table,
+                                               const int64_t *Key,
+                                               int64_t *Result) {
+  return ThreadTables.table(Table).lookup(Key, *Result);
+}
+
+extern "C" DLLEXPORT void athens_memo_store(int64_t Table, const int64_t *Key,
+                                           int64_t Result) {
+  ThreadTables.table(Table).store(Key, Result);
+}
+
+extern "C" DLLEXPORT void athens_memo_configure(int64_t Capacity,
+                                               int64_t Eviction) {
+  std::lock_guard<std::mutex> L(Memo.M);
+  if (Capacity > 0)
+    Memo.Capacity = std::bit_ceil(uint64_t(Capacity));
+  Memo.Eviction = AthensMemoEviction(Eviction);
+}
+
+extern "C" DLLEXPORT void athens_memo_free(int64_t Table) {
+  std::lock_guard<std::mutex> L(Memo.M);
+  for (ThreadMemo *T : Memo.Threads)
+    if (size_t(Table) < T->Tables.size())
+      T->Tables[Table].reset();
+}
+
+extern "C" DLLEXPORT int64_t athens_memo_bytes(int64_t Table) {
+  std::lock_guard<std::mutex> L(Memo.M);
+  uint64_t Bytes = 0;
+  for (ThreadMemo *T : Memo.Threads)
+    if (size_t(Table) < T->Tables.size() && T->Tables[Table])
+      Bytes += T->Tables[Table]->bytes();
+  return int64_t(Bytes);
+}
+
+extern "C" DLLEXPORT void athens_memo_stats(int64_t Table, int64_t *Hits,
+                                           int64_t *Misses) {
+  std::lock_guard<std::mutex> L(Memo.M);
+  uint64_t H = Memo.ExitedHits[Table], M = Memo.ExitedMisses[Table];
+  for (ThreadMemo *T : Memo.Threads)
+    if (size_t(Table) < T->Tables.size() && T->Tables[Table]) {
+      H += T->Tables[Table]->Hits;
+      M += T->Tables[Table]->Misses;
+    }
+  *Hits = int64_t(H);
+  *Misses = int64_t(M);
+}
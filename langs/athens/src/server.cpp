@@ -0,0 +1,241 @@
+#include "server.h"
+#include "runtime.h"
+
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace athens;
+
+namespace {
+/// Request - What a client sends first, along with its stdout and stderr.
+/// The source follows it.
+struct Request {
+  uint32_t Version;
+  uint32_t Mode;
+  uint64_t SourceSize;
+};
+
+constexpr uint32_t ProtocolVersion = 1;
+
+// Room for the two file descriptors a request comes with
+union FdControl {
+  char Buf[CMSG_SPACE(sizeof(int) * 2)];
+  cmsghdr Align;
+};
+} // namespace
+
+static Error errnoError(const Twine &What) {
+  int Errno = errno;
+  return createStringError(std::error_code(Errno, std::generic_category()),
+                           "%s: %s", What.str().c_str(), strerror(Errno));
+}
+
+static Expected<sockaddr_un> socketAddress(const std::string &Path) {
+  sockaddr_un Addr{};
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path))
+    return createStringError(inconvertibleErrorCode(),
+                             "Socket path %s is too long", Path.c_str());
+  memcpy(Addr.sun_path, Path.c_str(), Path.size() + 1);
+  return Addr;
+}
+
+static bool readAll(int Fd, void *Data, size_t Size) {
+  char *P = static_cast<char *>(Data);
+  while (Size) {
+    ssize_t N = read(Fd, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+// The other side may be gone, that's not worth a SIGPIPE
+static bool sendAll(int Fd, const void *Data, size_t Size) {
+  const char *P = static_cast<const char *>(Data);
+  while (Size) {
+    ssize_t N = send(Fd, P, Size, MSG_NOSIGNAL);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool receiveRequest(int Conn, Request &Req, int (&Fds)[2]) {
+  FdControl Control;
+  iovec IOV = {&Req, sizeof(Req)};
+  msghdr Msg{};
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control.Buf;
+  Msg.msg_controllen = sizeof(Control.Buf);
+
+  ssize_t N;
+  do
+    N = recvmsg(Conn, &Msg, MSG_CMSG_CLOEXEC);
+  while (N < 0 && errno == EINTR);
+  cmsghdr *C = N > 0 ? CMSG_FIRSTHDR(&Msg) : nullptr;
+  if (!C || C->cmsg_level != SOL_SOCKET || C->cmsg_type != SCM_RIGHTS ||
+      C->cmsg_len != CMSG_LEN(sizeof(Fds)))
+    return false;
+  memcpy(Fds, CMSG_DATA(C), sizeof(Fds));
+
+  // The rest of the header may come separately
+  return readAll(Conn, reinterpret_cast<char *>(&Req) + N, sizeof(Req) - N) &&
+         Req.Version == ProtocolVersion &&
+         Req.Mode <= uint32_t(Mode::EmitLLVMIR);
+}
+
+/// Read a request from Conn, run it in a fork of S and send back how that
+/// exited. Runs in a fork of the server itself, so it can wait.
+[[noreturn]] static void handleConnection(Session &S, int Conn) {
+  Request Req;
+  int Fds[2];
+  if (!receiveRequest(Conn, Req, Fds))
+    _exit(1);
+  std::string Source(Req.SourceSize, '\0');
+  if (!readAll(Conn, Source.data(), Source.size()))
+    _exit(1);
+
+  pid_t Pid = fork();
+  if (Pid == 0) {
+    close(Conn);
+    dup2(Fds[0], STDOUT_FILENO);
+    dup2(Fds[1], STDERR_FILENO);
+    close(Fds[0]);
+    close(Fds[1]);
+    // Like the driver, keep the IR on stdout by itself
+    Mode M = Mode(Req.Mode);
+    if (M == Mode::EmitLLVMIR)
+      athens_set_output_fd(STDERR_FILENO);
+    S.run(Source, M);
+    std::exit(0);
+  }
+
+  int32_t Exit = 1;
+  int Status;
+  if (Pid > 0) {
+    pid_t Done;
+    do
+      Done = waitpid(Pid, &Status, 0);
+    while (Done < 0 && errno == EINTR);
+    if (Done == Pid)
+      Exit = WIFEXITED(Status) ? WEXITSTATUS(Status) : 128 + WTERMSIG(Status);
+  }
+  sendAll(Conn, &Exit, sizeof(Exit));
+  _exit(0);
+}
+
+Error athens::serve(Session &S, const std::string &Path) {
+  auto Addr = socketAddress(Path);
+  if (!Addr)
+    return Addr.takeError();
+
+  int Listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (Listen < 0)
+    return errnoError("Couldn't create a socket");
+  auto CloseListen = make_scope_exit([&] { close(Listen); });
+
+  // Take over the socket of a server that's gone, not of one that's running
+  if (int Probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      Probe >= 0) {
+    if (connect(Probe, reinterpret_cast<sockaddr *>(&*Addr), sizeof(*Addr)) <
+            0 &&
+        errno == ECONNREFUSED)
+      unlink(Path.c_str());
+    close(Probe);
+  }
+  if (bind(Listen, reinterpret_cast<sockaddr *>(&*Addr), sizeof(*Addr)) < 0 ||
+      listen(Listen, SOMAXCONN) < 0)
+    return errnoError("Couldn't listen on " + Path);
+
+  // Nothing may be left in a buffer for every fork to write out again
+  outs().flush();
+  errs().flush();
+  flush();
+  fflush(nullptr);
+
+  // Connection handlers are reaped as they exit
+  signal(SIGCHLD, SIG_IGN);
+  for (;;) {
+    int Conn = accept(Listen, nullptr, nullptr);
+    if (Conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return errnoError("Couldn't accept a connection on " + Path);
+    }
+    if (fork() == 0) {
+      close(Listen);
+      // It waits for the fork running the program
+      signal(SIGCHLD, SIG_DFL);
+      handleConnection(S, Conn);
+    }
+    close(Conn);
+  }
+}
+
+Expected<int> athens::runOnServer(const std::string &SocketPath,
+                                  StringRef Source, Mode M) {
+  auto Addr = socketAddress(SocketPath);
+  if (!Addr)
+    return Addr.takeError();
+
+  int Conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (Conn < 0)
+    return errnoError("Couldn't create a socket");
+  auto CloseConn = make_scope_exit([&] { close(Conn); });
+  if (connect(Conn, reinterpret_cast<sockaddr *>(&*Addr), sizeof(*Addr)) < 0)
+    return errnoError("Couldn't connect to " + SocketPath);
+
+  Request Req = {ProtocolVersion, uint32_t(M), Source.size()};
+  int Fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  FdControl Control;
+  iovec IOV = {&Req, sizeof(Req)};
+  msghdr Msg{};
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control.Buf;
+  Msg.msg_controllen = sizeof(Control.Buf);
+  cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+  C->cmsg_level = SOL_SOCKET;
+  C->cmsg_type = SCM_RIGHTS;
+  C->cmsg_len = CMSG_LEN(sizeof(Fds));
+  memcpy(CMSG_DATA(C), Fds, sizeof(Fds));
+
+  ssize_t N;
+  do
+    N = sendmsg(Conn, &Msg, MSG_NOSIGNAL);
+  while (N < 0 && errno == EINTR);
+  if (N < 0 ||
+      !sendAll(Conn, reinterpret_cast<char *>(&Req) + N, sizeof(Req) - N) ||
+      !sendAll(Conn, Source.data(), Source.size()))
+    return errnoError("Couldn't send the program to " + SocketPath);
+
+  int32_t Exit;
+  if (!readAll(Conn, &Exit, sizeof(Exit)))
+    return createStringError(inconvertibleErrorCode(),
+                             "The server at %s didn't run the program",
+                             SocketPath.c_str());
+  return Exit;
+}
@@ -0,0 +1,1202 @@
+#include "session.h"
+#include "athens_lex_rules.h"
+#include "resolve.h"
+#include "snapshot.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <optional>
+#include <thread>
+
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/TargetParser/Host.h"
+
+using namespace llvm;
+using frontend::lex::TokenKind;
+
+namespace athens {
+
+static void printIfVerbose(bool verbose, const char *str) {
+  if (verbose)
+    std::cerr << str;
+}
+
+Expected<std::unique_ptr<Session>> Session::create(SessionOptions Opts) {
+  // The native target only has to be set up once per process, no matter how
+  // many sessions there are or which thread creates them.
+  static std::once_flag TargetInitialized;
+  std::call_once(TargetInitialized, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+  });
+
+  if (Opts.threads)
+    athens_set_threads(Opts.threads);
+  if (Opts.outputFd >= 0)
+    athens_set_output_fd(Opts.outputFd);
+  athens_memo_configure(Opts.memoCapacity, Opts.memoEviction);
+  if (!Opts.profileGenerate.empty())
+    writeProfileAtExit(Opts.profileGenerate);
+
+  // The JIT finds the vector library's functions like the C library's
+  if (Opts.vecLib != VectorLibrary::None) {
+    const char *Lib = Opts.vecLib == VectorLibrary::LibMVec
+                          ? "libmvec.so.1"
+                          : "libsleefgnuabi.so";
+    std::string Err;
+    if (sys::DynamicLibrary::LoadLibraryPermanently(Lib, &Err))
+      return createStringError(inconvertibleErrorCode(), "Couldn't load %s: %s",
+                               Lib, Err.c_str());
+  }
+
+  std::unique_ptr<ProfileData> Profile;
+  if (!Opts.profileUse.empty()) {
+    auto PD = ProfileData::read(Opts.profileUse);
+    if (!PD)
+      return PD.takeError();
+    Profile = std::move(*PD);
+  }
+
+  auto JIT = orc::KaleidoscopeJIT::Create(
+      Opts.forkable, orc::ExecutorAddr::fromPtr(&athens_not_linked));
+  if (!JIT)
+    return JIT.takeError();
+
+  return std::unique_ptr<Session>(
+      new Session(Opts, std::move(*JIT), std::move(Profile)));
+}
+
+Session::Session(SessionOptions Opts, std::unique_ptr<orc::KaleidoscopeJIT> JIT,
+                 std::unique_ptr<ProfileData> Profile)
+    : Opts(Opts), TheJIT(std::move(JIT)), Profile(std::move(Profile)),
+      Evaluator(FunctionProtos, Opts.evalFuel),
+      // Interpreted calls wouldn't be counted
+      Interp(FunctionProtos,
+             Opts.jobs == 1 && !Opts.parallelTopLevel &&
+                     Opts.profileGenerate.empty()
+                 ? Opts.interpretThreshold
+                 : 0,
+             {.Compile =
+                  [this](std::shared_ptr<FunctionAST> Fn,
+                         std::shared_ptr<ASTContext> Ctx) {
+                    return compileDefinition(std::move(Fn), std::move(Ctx),
+                                             Mode::Run);
+                  },
+              .Entry =
+                  [this](Symbol Name, bool /*Extern*/) {
+                    return interpreterEntry(Name);
+                  }}),
+      CG(FunctionProtos, Symbols, InlineBodies, codegenOptions()) {
+  registerAthensGrammar(Registry);
+  // E.g. definitions failing to link as the next lookup links them
+  TheJIT->getExecutionSession().setErrorReporter(
+      [](Error Err) { error::logError(toString(std::move(Err)).c_str()); });
+  CG.ConstEval = &Evaluator;
+  CG.Profile = this->Profile.get();
+
+  // Make the module, which holds all the code.
+  CG.initializeModuleAndManagers(TheJIT->getDataLayout());
+}
+
+// Resolving right after parsing reports unknown variables before any IR is
+// built for the function.
+static bool resolveNames(FunctionAST &Fn,
+                         const frontend::lex::SymbolTable &Symbols,
+                         ASTContext &Ctx) {
+  Resolver R(Symbols, Ctx);
+  return Fn.resolve(R);
+}
+
+bool Session::logIfError(Error Err) {
+  if (!Err)
+    return false;
+  error::logError(toString(std::move(Err)).c_str());
+  return true;
+}
+
+void Session::printIR(Function *FnIR, const char *Heading, Mode M) {
+  if (M == Mode::EmitLLVMIR) {
+    FnIR->print(outs());
+  }
+
+  if (Opts.verbose) {
+    fprintf(stderr, "%s:\n", Heading);
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+  }
+}
+
+bool Session::addDefinition(orc::ThreadSafeModule TSM,
+                            const PrototypeAST *Proto) {
+  if (!Proto)
+    return !logIfError(TheJIT->addModule(std::move(TSM)));
+
+  // Its function goes behind the JIT's stub, callers compiled before a
+  // redefinition call the new one (unless they inlined the old one)
+  std::string Name(Symbols.str(Proto->getName()));
+  TSM.withModuleDo([&](Module &M) {
+    if (Function *F = M.getFunction(Name))
+      F->setName(Name + orc::KaleidoscopeJIT::BodySuffix);
+  });
+  auto RT = TheJIT->redefine(Name);
+  if (!RT)
+    return !logIfError(RT.takeError());
+  if (logIfError(TheJIT->addModule(std::move(TSM), *RT)))
+    return false;
+  return finishDefinition(*Proto, *RT);
+}
+
+bool Session::finishDefinition(const PrototypeAST &Proto,
+                               orc::ResourceTrackerSP RT) {
+  // The results of the definition it replaces go with it
+  auto [It, New] = MemoTables.try_emplace(Proto.getName(), -1);
+  if (It->second >= 0)
+    athens_memo_free(It->second);
+  It->second = Proto.getMemoTable();
+  if (Proto.getMemoTable() >= 0 &&
+      logIfError(TheJIT->defineAbsolute(
+          (Symbols.str(Proto.getName()) + MemoTableSuffix).str(),
+          Proto.getMemoTable(), std::move(RT))))
+    return false;
+
+  // Calls of a redefined function go to the removed definition until the
+  // new one is linked, e.g. from the interpreter
+  return New || !logIfError(TheJIT->linkDefinitions());
+}
+
+bool Session::runTopLevel(orc::ThreadSafeModule TSM,
+                          std::vector<double> *Results) {
+  // Create a ResourceTracker to track JITted memory allocated to our
+  // anonymous expression -- that way we can free it after executing.
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+
+  if (logIfError(TheJIT->addModule(std::move(TSM), RT)))
+    return false;
+
+  // Search the JIT for the __anon_expr symbol.
+  auto ExprSymbol = TheJIT->lookup("__anon_expr");
+  if (!ExprSymbol) {
+    logIfError(ExprSymbol.takeError());
+    return false;
+  }
+
+  // Get the symbol's address and cast it to the right type (takes no
+  // arguments, returns a double) so we can call it as a native function.
+  double (*FP)() = ExprSymbol->toPtr<double (*)()>();
+  printResult(FP(), Results);
+
+  // Delete the anonymous expression module from the JIT.
+  return !logIfError(RT->remove());
+}
+
+void Session::printResult(double Result, std::vector<double> *Results) {
+  flush();
+  fprintf(stderr, "%f\n", Result);
+  if (Results)
+    Results->push_back(Result);
+}
+
+Interpreter::NativeEntry Session::interpreterEntry(Symbol Name) {
+  std::string EntryName = (Symbols.str(Name) + InterpreterEntrySuffix).str();
+  auto EntrySymbol = TheJIT->lookup(EntryName);
+
+  // An extern's is added the first time it's called from the interpreter,
+  // in a module of its own (CG's may be halfway through an item). So is the
+  // one of a definition loaded from a snapshot saved without it.
+  if (!EntrySymbol) {
+    consumeError(EntrySymbol.takeError());
+    CodeGen EntryCG(FunctionProtos, Symbols, InlineBodies, codegenOptions());
+    EntryCG.initializeModuleAndManagers(TheJIT->getDataLayout());
+    EntryCG.emitInterpreterEntry(*EntryCG.getFunction(Name));
+    if (!addDefinition(EntryCG.takeModule()))
+      return nullptr;
+    EntrySymbol = TheJIT->lookup(EntryName);
+  }
+
+  if (!EntrySymbol) {
+    logIfError(EntrySymbol.takeError());
+    return nullptr;
+  }
+  return EntrySymbol->toPtr<Interpreter::NativeEntry>();
+}
+
+bool Session::compileDefinition(std::shared_ptr<FunctionAST> FnAST,
+                                std::shared_ptr<ASTContext> Ctx, Mode M) {
+  // Code compiled against the definition it replaces calls it the same way
+  const PrototypeAST &Proto = FnAST->getProto();
+  auto PI = FunctionProtos.find(Proto.getName());
+  if (MemoTables.count(Proto.getName()) && PI != FunctionProtos.end() &&
+      (PI->second->getArgTypes() != Proto.getArgTypes() ||
+       PI->second->getReturnType() != Proto.getReturnType())) {
+    error::logError(("Redefinition of " + Symbols.str(Proto.getName()) +
+                     " with other argument or return types")
+                        .str()
+                        .c_str());
+    return false;
+  }
+
+  if (!emitDefinition(*FnAST, Ctx, M))
+    return false;
+  return keepCompiled(std::move(FnAST), std::move(Ctx));
+}
+
+bool Session::keepCompiled(std::shared_ptr<FunctionAST> FnAST,
+                           std::shared_ptr<ASTContext> Ctx) {
+  Symbol Name = FnAST->getProto().getName();
+  auto [It, New] = Compiled.try_emplace(Name);
+  It->second = {std::move(FnAST), std::move(Ctx), NextCompiled++};
+  return New || recompileCallers(Name);
+}
+
+bool Session::recompileCallers(Symbol Name) {
+  // Everything calling it, directly or through others
+  DenseSet<Symbol> Stale = {Name};
+  for (bool Grew = true; Grew;) {
+    Grew = false;
+    for (auto &[Caller, Def] : Compiled)
+      if (!Stale.count(Caller) &&
+          any_of(Def.Fn->getCallees(),
+                 [&](const CalleeRef &C) { return Stale.count(C.Name); })) {
+        Stale.insert(Caller);
+        Grew = true;
+      }
+  }
+  Stale.erase(Name);
+
+  // Callees before their callers, which inline them
+  std::vector<std::pair<uint64_t, Symbol>> Callers;
+  for (Symbol Caller : Stale)
+    Callers.push_back({Compiled[Caller].Order, Caller});
+  llvm::sort(Callers);
+
+  bool Ok = true;
+  for (auto &[Order, Caller] : Callers) {
+    CompiledDefinition Def = Compiled[Caller];
+    Ok &= emitDefinition(*Def.Fn, Def.Ctx, Mode::Run);
+    Interp.compiled(Caller);
+  }
+  return Ok;
+}
+
+bool Session::emitDefinition(FunctionAST &FnAST,
+                             std::shared_ptr<ASTContext> Ctx, Mode M) {
+  // The JIT has to have what it calls, it may only have been interpreted
+  // so far
+  if (!Interp.compileCallees(FnAST))
+    return false;
+
+  auto *FnIR = FnAST.codegen(CG);
+  if (!FnIR)
+    return false;
+
+  // It compiled, make it known to the items that follow
+  const PrototypeAST &Proto = FnAST.getProto();
+  if (auto Bitcode = CG.exportInlineBody(*FnIR))
+    InlineBodies[Proto.getName()] = std::move(*Bitcode);
+  else
+    InlineBodies.erase(Proto.getName());
+  auto &Known = FunctionProtos[Proto.getName()] =
+      std::make_unique<PrototypeAST>(Proto);
+  Evaluator.define(*Known, FnAST.getBody(), CG.SlotTypes, std::move(Ctx));
+
+  printIR(FnIR, "Read function definition", M);
+  if (Interp.enabled())
+    CG.emitInterpreterEntry(*FnIR);
+  bool Ok = addDefinition(CG.takeModule(), Known.get());
+  CG.initializeModuleAndManagers(TheJIT->getDataLayout());
+  return Ok;
+}
+
+bool Session::handleDefinition(Parser &P, Mode M) {
+  // The definition's AST is freed in one go once nothing refers to it, the
+  // evaluator and the interpreter keep the ones they can run, the session
+  // the compiled ones
+  auto Ctx = std::make_shared<ASTContext>();
+  auto FnAST = P.parseDefinition(*Ctx);
+  if (!FnAST || !resolveNames(*FnAST, Symbols, *Ctx))
+    return false;
+  return define(std::move(FnAST), std::move(Ctx), M);
+}
+
+bool Session::define(std::unique_ptr<FunctionAST> FnAST,
+                     std::shared_ptr<ASTContext> Ctx, Mode M) {
+  // Most definitions typed into the REPL are called a few times at most,
+  // they're only compiled once they turn out to be hot (unless their IR is
+  // wanted)
+  std::string OperatorName;
+  unsigned Precedence = 0;
+  if (FnAST->getProto().isBinaryOp()) {
+    OperatorName = FnAST->getProto().getOperatorName();
+    Precedence = FnAST->getProto().getBinaryPrecedence();
+  }
+  if (M == Mode::Run && Interp.canInterpret(*FnAST, /*TopLevel=*/false)) {
+    if (!Interp.defer(std::move(FnAST), std::move(Ctx)))
+      return false;
+  } else {
+    Symbol Name = FnAST->getProto().getName();
+    if (!compileDefinition(std::move(FnAST), std::move(Ctx), M))
+      return false;
+    Interp.compiled(Name);
+  }
+
+  // If this is a user defined binary operator, install it
+  if (!OperatorName.empty())
+    installBinaryOperator(Registry, OperatorName, Precedence);
+  return true;
+}
+
+bool Session::handleExtern(Parser &P, Mode M) {
+  auto ProtoAST = P.parseExtern();
+  if (!ProtoAST)
+    return false;
+  return declareExtern(std::move(ProtoAST), M);
+}
+
+bool Session::declareExtern(std::unique_ptr<PrototypeAST> ProtoAST, Mode M) {
+  auto *FnIR = ProtoAST->codegen(CG);
+  if (!FnIR)
+    return false;
+
+  printIR(FnIR, "Read extern", M);
+  Interp.declared(ProtoAST->getName());
+  FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+  return true;
+}
+
+bool Session::handleTopLevelExpression(Parser &P,
+                                       std::vector<double> *Results) {
+  // Evaluate a top-level expression into an anonymous function.
+  ASTContext Ctx;
+  auto FnAST = P.parseTopLevelExpr(Ctx);
+  if (!FnAST || !resolveNames(*FnAST, Symbols, Ctx))
+    return false;
+  return runExpression(*FnAST, Results);
+}
+
+bool Session::runExpression(FunctionAST &FnAST, std::vector<double> *Results) {
+  // Interpreting it takes a fraction of the time compiling it would
+  if (Interp.canInterpret(FnAST, /*TopLevel=*/true)) {
+    auto V = Interp.run(FnAST);
+    if (!V)
+      return false;
+    printResult(*V, Results);
+    return true;
+  }
+
+  // A constant (e.g. a call of effect-free functions on literals) needs no
+  // compiling
+  if (auto V = Evaluator.evaluate(FnAST)) {
+    printResult(V->toDouble(), Results);
+    return true;
+  }
+
+  if (!Interp.compileCallees(FnAST) || !FnAST.codegen(CG))
+    return false;
+
+  auto TSM = CG.takeModule();
+  CG.initializeModuleAndManagers(TheJIT->getDataLayout());
+  return runTopLevel(std::move(TSM), Results);
+}
+
+/// top ::= definition | external | expression | ';'
+bool Session::runLocked(frontend::lex::CharStream &CS, Mode M,
+                        std::vector<double> *Results) {
+  if (Opts.jobs != 1 || Opts.parallelTopLevel)
+    return runParallelLocked(CS, M, Results);
+
+  AthensLexRules Rules;
+  frontend::lex::Lexer Lexer(CS, Rules, &Symbols);
+  frontend::parse::TokenStream Tokens(Lexer, Registry.maxLookahead());
+  Parser P(Tokens, Registry, Symbols, Diag);
+
+  bool Ok = true;
+  while (!Tokens.is(TokenKind::Eof)) {
+    bool ItemOk = true;
+    switch (Tokens.current().kind) {
+    case TokenKind::Semicolon: // ignore top-level semicolons.
+      (void)Tokens.consume();
+      break;
+    case TokenKind::KwFuncDef:
+      ItemOk = handleDefinition(P, M);
+      break;
+    case TokenKind::KwExtern:
+      ItemOk = handleExtern(P, M);
+      break;
+    default:
+      ItemOk = handleTopLevelExpression(P, Results);
+      break;
+    }
+
+    if (!ItemOk) {
+      Ok = false;
+      // Skip token for error recovery.
+      if (!Tokens.is(TokenKind::Eof))
+        (void)Tokens.consume();
+    }
+  }
+  return Ok;
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel mode
+//===----------------------------------------------------------------------===//
+
+/// ParallelItem - One top-level item of a program compiled in parallel mode,
+/// from its AST to the module holding its IR.
+struct ParallelItem {
+  enum ItemKind { Definition, Extern, Expression } Kind = Expression;
+  std::unique_ptr<FunctionAST> Fn;     // Definition, Expression
+  std::unique_ptr<PrototypeAST> Proto; // Extern
+  Function *FnIR = nullptr;
+  orc::ThreadSafeModule TSM;
+  std::optional<SmallVector<char, 0>> InlineBody; // Definition
+  std::vector<ValueType> SlotTypes;               // Definition
+  bool Failed = false;
+  // Errors reported while parsing/compiling it, printed in source order
+  std::string Errors;
+  // The tokens it was parsed from
+  std::span<const frontend::lex::Token> Tokens;
+};
+
+/// ParallelChunk - A run of tokens that can be parsed on its own, it holds
+/// one or more top-level items (a definition's body may be followed by an
+/// expression without a ';' in between).
+struct ParallelChunk {
+  std::span<const frontend::lex::Token> Tokens;
+  // Shared with the evaluator if it keeps one of the definitions
+  std::shared_ptr<ASTContext> Ctx = std::make_shared<ASTContext>();
+  std::vector<ParallelItem> Items;
+};
+
+// Every 'def'/'extern' starts a chunk and every ';' ends one. Neither can
+// appear inside an expression, so no item straddles two chunks.
+static std::vector<std::span<const frontend::lex::Token>>
+splitTopLevel(std::span<const frontend::lex::Token> Tokens) {
+  std::vector<std::span<const frontend::lex::Token>> Chunks;
+  std::size_t Start = 0;
+  for (std::size_t I = 0; I < Tokens.size(); ++I) {
+    switch (Tokens[I].kind) {
+    case TokenKind::KwFuncDef:
+    case TokenKind::KwExtern:
+      if (I > Start)
+        Chunks.push_back(Tokens.subspan(Start, I - Start));
+      Start = I;
+      break;
+    case TokenKind::Semicolon:
+      Chunks.push_back(Tokens.subspan(Start, I + 1 - Start));
+      Start = I + 1;
+      break;
+    default:
+      break;
+    }
+  }
+  if (Start < Tokens.size())
+    Chunks.push_back(Tokens.subspan(Start));
+  return Chunks;
+}
+
+void Session::parseItems(std::span<const frontend::lex::Token> Tokens,
+                         ASTContext &Ctx, std::vector<ParallelItem> &Items) {
+  frontend::parse::TokenStream Stream(Tokens, Registry.maxLookahead());
+  Parser P(Stream, Registry, Symbols, Diag);
+  // Where the stream is in Tokens
+  auto Position = [&] {
+    if (Stream.is(TokenKind::Eof))
+      return Tokens.size();
+    std::size_t Offset = Stream.current().source_loc.start_offset;
+    auto It = partition_point(Tokens, [&](const frontend::lex::Token &Tok) {
+      return Tok.source_loc.start_offset < Offset;
+    });
+    return std::size_t(It - Tokens.begin());
+  };
+
+  while (!Stream.is(TokenKind::Eof)) {
+    if (Stream.match(TokenKind::Semicolon))
+      continue;
+
+    ParallelItem Item;
+    std::size_t Start = Position();
+    {
+      error::ErrorCapture Capture(Item.Errors);
+      switch (Stream.current().kind) {
+      case TokenKind::KwFuncDef:
+        Item.Kind = ParallelItem::Definition;
+        Item.Fn = P.parseDefinition(Ctx);
+        Item.Failed = !Item.Fn || !resolveNames(*Item.Fn, Symbols, Ctx);
+        break;
+      case TokenKind::KwExtern:
+        Item.Kind = ParallelItem::Extern;
+        Item.Proto = P.parseExtern();
+        Item.Failed = !Item.Proto;
+        break;
+      default:
+        Item.Kind = ParallelItem::Expression;
+        Item.Fn = P.parseTopLevelExpr(Ctx);
+        Item.Failed = !Item.Fn || !resolveNames(*Item.Fn, Symbols, Ctx);
+        break;
+      }
+
+      // Skip token for error recovery.
+      if (Item.Failed && !Stream.is(TokenKind::Eof))
+        (void)Stream.consume();
+    }
+    Item.Tokens = Tokens.subspan(Start, Position() - Start);
+    Items.push_back(std::move(Item));
+  }
+}
+
+void Session::codegenItem(ParallelItem &Item) {
+  if (Item.Failed)
+    return;
+
+  // Each item gets its own context/module, nothing is shared between the
+  // workers but the (read only) FunctionProtos.
+  error::ErrorCapture Capture(Item.Errors);
+  CodeGen ItemCG(FunctionProtos, Symbols, InlineBodies, codegenOptions());
+  ItemCG.Profile = Profile.get();
+  ItemCG.initializeModuleAndManagers(TheJIT->getDataLayout());
+  ItemCG.ConstEval = &Evaluator;
+
+  if (Item.Kind == ParallelItem::Extern)
+    Item.FnIR = Item.Proto->codegen(ItemCG);
+  else
+    Item.FnIR = Item.Fn->codegen(ItemCG);
+
+  if (!Item.FnIR) {
+    Item.Failed = true;
+    return;
+  }
+  if (Item.Kind == ParallelItem::Definition) {
+    Item.InlineBody = ItemCG.exportInlineBody(*Item.FnIR);
+    Item.SlotTypes = std::move(ItemCG.SlotTypes);
+  }
+  Item.TSM = ItemCG.takeModule();
+}
+
+void Session::splitProgram(frontend::lex::CharStream &CS,
+                           std::vector<frontend::lex::Token> &Tokens,
+                           std::vector<ParallelChunk> &Chunks) {
+  // Lex everything up front. The tokens' lexemes point into CS, so they stay
+  // valid for the whole run.
+  AthensLexRules Rules;
+  frontend::lex::Lexer Lexer(CS, Rules, &Symbols);
+  for (auto Tok = Lexer.next(); Tok.kind != TokenKind::Eof; Tok = Lexer.next())
+    Tokens.push_back(Tok);
+
+  // Operator precedences have to be known before anything is parsed
+  installBinaryOperators(Registry, Tokens);
+
+  auto Spans = splitTopLevel(Tokens);
+  Chunks.resize(Spans.size());
+  for (std::size_t I = 0; I < Spans.size(); ++I)
+    Chunks[I].Tokens = Spans[I];
+}
+
+bool Session::runParallelLocked(frontend::lex::CharStream &CS, Mode M,
+                                std::vector<double> *Results) {
+  std::vector<frontend::lex::Token> Tokens;
+  std::vector<ParallelChunk> Chunks;
+  splitProgram(CS, Tokens, Chunks);
+
+  DefaultThreadPool Pool(hardware_concurrency(Opts.jobs));
+
+  for (auto &Chunk : Chunks)
+    Pool.async([this, &Chunk] {
+      parseItems(Chunk.Tokens, *Chunk.Ctx, Chunk.Items);
+    });
+  Pool.wait();
+
+  // Every function of the program can be called from any item, so all the
+  // prototypes go in before generating code (a later one wins, like
+  // redefining does in sequential mode).
+  for (auto &Chunk : Chunks)
+    for (auto &Item : Chunk.Items) {
+      if (Item.Failed || Item.Kind == ParallelItem::Expression)
+        continue;
+      const PrototypeAST &Proto =
+          Item.Kind == ParallelItem::Extern ? *Item.Proto : Item.Fn->getProto();
+      FunctionProtos[Proto.getName()] = std::make_unique<PrototypeAST>(Proto);
+    }
+
+  for (auto &Chunk : Chunks)
+    for (auto &Item : Chunk.Items)
+      Pool.async([this, &Item] { codegenItem(Item); });
+  Pool.wait();
+
+  // Back to source order for everything the user can observe. Expressions
+  // that can run concurrently are collected until something that can't.
+  bool Ok = true;
+  std::vector<ParallelItem *> Batch;
+  for (auto &Chunk : Chunks)
+    for (auto &Item : Chunk.Items) {
+      if (M == Mode::Run && Opts.parallelTopLevel && !Item.Failed &&
+          Item.Kind == ParallelItem::Expression && isSelfContained(*Item.Fn)) {
+        Batch.push_back(&Item);
+        continue;
+      }
+      Ok &= runTopLevelBatch(Batch, Pool, Results);
+      Batch.clear();
+
+      fputs(Item.Errors.c_str(), stderr);
+      if (Item.Failed) {
+        Ok = false;
+        continue;
+      }
+
+      switch (Item.Kind) {
+      case ParallelItem::Definition:
+        // Later runs can inline it, the items of this run were compiled
+        // concurrently against the bodies known before it started.
+        if (Item.InlineBody)
+          InlineBodies[Item.Fn->getProto().getName()] =
+              std::move(*Item.InlineBody);
+        else
+          InlineBodies.erase(Item.Fn->getProto().getName());
+        // Its prototype went in before its codegen gave it a memo table and
+        // its effects
+        FunctionProtos[Item.Fn->getProto().getName()] =
+            std::make_unique<PrototypeAST>(Item.Fn->getProto());
+        Evaluator.define(Item.Fn->getProto(), Item.Fn->getBody(),
+                         Item.SlotTypes, Chunk.Ctx);
+        if (isSelfContained(*Item.Fn))
+          SelfContained.insert(Item.Fn->getProto().getName());
+        else
+          SelfContained.erase(Item.Fn->getProto().getName());
+        printIR(Item.FnIR, "Read function definition", M);
+        Ok &= addDefinition(std::move(Item.TSM), &Item.Fn->getProto()) &&
+              keepCompiled(std::move(Item.Fn), Chunk.Ctx);
+        break;
+      case ParallelItem::Extern:
+        SelfContained.erase(Item.Proto->getName());
+        printIR(Item.FnIR, "Read extern", M);
+        break;
+      case ParallelItem::Expression:
+        // Compiled along with the rest, but the definitions before it in
+        // this run may make it a constant after all
+        if (auto V = Evaluator.evaluate(*Item.Fn))
+          printResult(V->toDouble(), Results);
+        else
+          Ok &= runTopLevel(std::move(Item.TSM), Results);
+        break;
+      }
+    }
+  Ok &= runTopLevelBatch(Batch, Pool, Results);
+  return Ok;
+}
+
+bool Session::runTopLevelBatch(ArrayRef<ParallelItem *> Batch,
+                               ThreadPoolInterface &Pool,
+                               std::vector<double> *Results) {
+  struct TopLevelRun : AthensCapture {
+    double (*FP)() = nullptr;
+    orc::ResourceTrackerSP RT;
+    std::optional<double> Value;
+    // The errors adding it to the JIT reported, the runtime error it ran
+    // into
+    std::string Errors, RuntimeError;
+    std::promise<void> Done;
+  };
+  std::vector<TopLevelRun> Runs(Batch.size());
+
+  // They're all in the JIT at the same time, each under a name of its own
+  for (std::size_t I = 0; I < Batch.size(); ++I) {
+    ParallelItem &Item = *Batch[I];
+    TopLevelRun &Run = Runs[I];
+    if (auto V = Evaluator.evaluate(*Item.Fn)) {
+      Run.Value = V->toDouble();
+      continue;
+    }
+
+    error::ErrorCapture Capture(Run.Errors);
+    std::string Name = ("__anon_expr." + Twine(I)).str();
+    Item.FnIR->setName(Name);
+    Run.RT = TheJIT->getMainJITDylib().createResourceTracker();
+    if (logIfError(TheJIT->addModule(std::move(Item.TSM), Run.RT)))
+      continue;
+    auto ExprSymbol = TheJIT->lookup(Name);
+    if (!ExprSymbol) {
+      logIfError(ExprSymbol.takeError());
+      continue;
+    }
+    Run.FP = ExprSymbol->toPtr<double (*)()>();
+  }
+
+  // A runtime error is reported once everything before it was, the thread
+  // that ran into it waits for the exit
+  auto Fatal = [](AthensCapture &Capture, const char *Message) {
+    auto &Run = static_cast<TopLevelRun &>(Capture);
+    Run.RuntimeError = Message;
+    Run.Done.set_value();
+    for (;;)
+      std::this_thread::sleep_for(std::chrono::hours(1));
+  };
+  for (TopLevelRun &Run : Runs) {
+    Run.Fatal = Fatal;
+    if (Run.FP)
+      Pool.async([&Run] {
+        athens_capture_output(&Run);
+        Run.Value = Run.FP();
+        athens_capture_output(nullptr);
+        Run.Done.set_value();
+      });
+  }
+
+  bool Ok = true;
+  for (std::size_t I = 0; I < Batch.size(); ++I) {
+    TopLevelRun &Run = Runs[I];
+    if (Run.FP)
+      Run.Done.get_future().wait();
+    fputs(Batch[I]->Errors.c_str(), stderr);
+    fputs(Run.Errors.c_str(), stderr);
+    athens_print(Run.Output.data(), Run.Output.size());
+    // The runs after it may still be going, and can't be stopped
+    if (!Run.RuntimeError.empty())
+      athens_fatal_now(Run.RuntimeError.c_str());
+    if (Run.Value)
+      printResult(*Run.Value, Results);
+    else
+      Ok = false;
+  }
+  Pool.wait();
+
+  for (TopLevelRun &Run : Runs)
+    if (Run.RT)
+      Ok &= !logIfError(Run.RT->remove());
+  return Ok;
+}
+
+bool Session::isSelfContained(const FunctionAST &Fn) const {
+  // The runtime's functions that print, what they print is kept in order
+  static constexpr StringLiteral OutputFunctions[] = {"putchard", "printd",
+                                                      "printstr", "flush"};
+
+  for (const CalleeRef &C : Fn.getCallees()) {
+    if (C.Name == Fn.getProto().getName() || SelfContained.count(C.Name))
+      continue;
+    auto PI = FunctionProtos.find(C.Name);
+    if (PI == FunctionProtos.end()) {
+      // An operator that isn't overloaded is built in
+      if (C.Overloadable)
+        continue;
+      return false;
+    }
+    const PrototypeAST &Callee = *PI->second;
+    StringRef Name = Symbols.str(C.Name);
+    if (!Callee.isExtern() ||
+        !(Callee.isPure() || isMathFunction(Callee, Name) ||
+          is_contained(OutputFunctions, Name)))
+      return false;
+  }
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Watch mode
+//===----------------------------------------------------------------------===//
+
+// What an item's code depends on besides the definitions it calls: its
+// tokens and how operators parse
+static hash_code hashItem(const ParallelItem &Item, hash_code Operators) {
+  hash_code H = Operators;
+  for (const frontend::lex::Token &Tok : Item.Tokens)
+    H = hash_combine(H, Tok.kind, StringRef(Tok.lexeme));
+  return H;
+}
+
+UpdateResult Session::update(std::string_view Source, Mode M) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  frontend::lex::CharStream CS(Source);
+  std::vector<frontend::lex::Token> Tokens;
+  std::vector<ParallelChunk> Chunks;
+  splitProgram(CS, Tokens, Chunks);
+  for (auto &Chunk : Chunks)
+    parseItems(Chunk.Tokens, *Chunk.Ctx, Chunk.Items);
+
+  // A precedence changing changes how every definition using the operator
+  // parses, so all of them are hashed with the precedences
+  hash_code Operators = hash_value(0);
+  for (auto &Chunk : Chunks)
+    for (auto &Item : Chunk.Items)
+      if (!Item.Failed && Item.Kind == ParallelItem::Definition &&
+          Item.Fn->getProto().isBinaryOp())
+        Operators = hash_combine(
+            Operators, StringRef(Item.Fn->getProto().getOperatorName()),
+            Item.Fn->getProto().getBinaryPrecedence());
+
+  // Code compiled before calls the new definitions through the JIT's
+  // stubs, so they have to be called the same way. Externs are called
+  // directly.
+  std::vector<std::pair<ParallelItem *, hash_code>> Changed;
+  DenseSet<Symbol> Names;
+  bool AllParsed = true;
+  for (auto &Chunk : Chunks)
+    for (auto &Item : Chunk.Items) {
+      AllParsed &= !Item.Failed;
+      if (Item.Failed || Item.Kind == ParallelItem::Expression)
+        continue;
+      const PrototypeAST &Proto =
+          Item.Kind == ParallelItem::Extern ? *Item.Proto : Item.Fn->getProto();
+      Names.insert(Proto.getName());
+      hash_code Hash = hashItem(Item, Operators);
+      auto Old = Watched.Hashes.find(Proto.getName());
+      if (Old != Watched.Hashes.end() && Old->second == Hash)
+        continue;
+      Changed.push_back({&Item, Hash});
+      auto PI = FunctionProtos.find(Proto.getName());
+      if (Old == Watched.Hashes.end() || PI == FunctionProtos.end())
+        continue;
+      if (Proto.isExtern() || PI->second->isExtern() ||
+          (MemoTables.count(Proto.getName()) &&
+           (PI->second->getArgTypes() != Proto.getArgTypes() ||
+            PI->second->getReturnType() != Proto.getReturnType())))
+        return UpdateResult::Incompatible;
+    }
+
+  // Calls of a removed definition would still find it. Which ones are gone
+  // is only known once all items parse, a syntax error doesn't start over.
+  if (AllParsed)
+    for (auto &Entry : Watched.Hashes)
+      if (!Names.count(Entry.first))
+        return UpdateResult::Incompatible;
+
+  bool Ok = true;
+  auto NextChanged = Changed.begin();
+  Watched.Expressions.clear();
+  for (auto &Chunk : Chunks)
+    for (auto &Item : Chunk.Items) {
+      fputs(Item.Errors.c_str(), stderr);
+      if (Item.Failed) {
+        Ok = false;
+        continue;
+      }
+      if (Item.Kind == ParallelItem::Expression) {
+        Watched.Expressions.push_back({Chunk.Ctx, std::move(Item.Fn)});
+        continue;
+      }
+      if (NextChanged == Changed.end() || NextChanged->first != &Item)
+        continue;
+      hash_code Hash = (NextChanged++)->second;
+
+      Symbol Name = Item.Kind == ParallelItem::Extern
+                        ? Item.Proto->getName()
+                        : Item.Fn->getProto().getName();
+      bool ItemOk = Item.Kind == ParallelItem::Extern
+                        ? declareExtern(std::move(Item.Proto), M)
+                        : define(std::move(Item.Fn), Chunk.Ctx, M);
+      // A failed one is compiled again next time even if it doesn't change,
+      // its old code (if any) is what later ones have to match
+      Watched.Hashes[Name] = ItemOk ? Hash : hash_code();
+      Ok &= ItemOk;
+    }
+
+  if (Opts.verbose)
+    fprintf(stderr, "%zu definitions and externs changed\n", Changed.size());
+  return Ok ? UpdateResult::Updated : UpdateResult::Failed;
+}
+
+bool Session::runExpressions(std::vector<double> *Results) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  bool Ok = true;
+  for (auto &[Ctx, FnAST] : Watched.Expressions)
+    Ok &= runExpression(*FnAST, Results);
+  return Ok;
+}
+
+bool Session::run(std::string_view Source, Mode M,
+                  std::vector<double> *Results) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  frontend::lex::CharStream CS(Source);
+  return runLocked(CS, M, Results);
+}
+
+bool Session::runFile(const std::string &Path, Mode M,
+                      std::vector<double> *Results) {
+  std::ifstream in(Path);
+  if (!in.is_open()) {
+    std::string msg = "could not open " + Path + "\n";
+    printIfVerbose(Opts.verbose, msg.c_str());
+    return false;
+  }
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  frontend::lex::CharStream CS(in);
+  bool Ok = runLocked(CS, M, Results);
+
+  std::string msg = "\n" + Path + " loaded.\n\n";
+  printIfVerbose(Opts.verbose, msg.c_str());
+  return Ok;
+}
+
+// Input is complete once it ends with ';' (ignoring trailing whitespace)
+static bool endsWithSemicolon(std::string_view Input) {
+  while (!Input.empty() &&
+         std::isspace(static_cast<unsigned char>(Input.back())))
+    Input.remove_suffix(1);
+  return !Input.empty() && Input.back() == ';';
+}
+
+void Session::runRepl(std::istream &In, Mode M) {
+  {
+    // A snapshot has what's defined from here on, and the objects it's
+    // linked from
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &[Name, Proto] : FunctionProtos)
+      Preloaded.insert(Name);
+    TheJIT->setObjectTransform([this](std::unique_ptr<MemoryBuffer> Obj)
+                                   -> Expected<std::unique_ptr<MemoryBuffer>> {
+      recordObject(*Obj);
+      return Obj;
+    });
+  }
+
+  fprintf(stderr, "Welcome to Athens!\n> ");
+
+  std::string Pending, Line;
+  while (std::getline(In, Line)) {
+    // Commands take a line of their own
+    if (Pending.empty() && StringRef(Line).ltrim().starts_with(":")) {
+      runCommand(StringRef(Line).trim());
+      fprintf(stderr, "> ");
+      continue;
+    }
+
+    bool BlankLine = Line.find_first_not_of(" \t\r") == std::string::npos;
+    Pending += Line;
+    Pending += '\n';
+
+    if (!BlankLine && !endsWithSemicolon(Pending))
+      continue;
+
+    run(Pending, M);
+    Pending.clear();
+    fprintf(stderr, "> ");
+  }
+
+  if (!Pending.empty())
+    run(Pending, M);
+}
+
+void Session::runCommand(StringRef Command) {
+  auto [Name, Arg] = Command.split(' ');
+  Arg = Arg.trim();
+  if ((Name == ":save" || Name == ":load") && Arg.empty())
+    error::logError((Name + " takes a file name").str().c_str());
+  else if (Name == ":save")
+    saveSnapshot(Arg.str());
+  else if (Name == ":load")
+    loadSnapshot(Arg.str());
+  else if (Name == ":mem")
+    printMemoryUsage(errs());
+  else
+    error::logError(("Unknown command " + Name).str().c_str());
+}
+
+std::string Session::snapshotTarget() const {
+  return sys::getProcessTriple() + " " + sys::getHostCPUName().str() + " " +
+         TheJIT->getDataLayout().getStringRepresentation();
+}
+
+void Session::recordObject(const MemoryBuffer &Obj) {
+  auto File = object::ObjectFile::createObjectFile(Obj.getMemBufferRef());
+  if (!File) {
+    consumeError(File.takeError());
+    return;
+  }
+
+  auto Contents = std::make_shared<const std::string>(Obj.getBuffer().str());
+  char Prefix = TheJIT->getDataLayout().getGlobalPrefix();
+  std::lock_guard<std::mutex> Lock(ObjectsMutex);
+  for (const object::SymbolRef &Sym : (*File)->symbols()) {
+    auto Flags = Sym.getFlags();
+    auto Name = Sym.getName();
+    if (!Flags || !Name) {
+      consumeError(Flags.takeError());
+      consumeError(Name.takeError());
+      continue;
+    }
+    if (!(*Flags & object::SymbolRef::SF_Global) ||
+        (*Flags & object::SymbolRef::SF_Undefined))
+      continue;
+    if (Prefix)
+      Name->consume_front(StringRef(&Prefix, 1));
+    Objects[*Name] = Contents;
+  }
+}
+
+bool Session::saveSnapshot(const std::string &Path) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  // The code points at this process' counters
+  if (!Opts.profileGenerate.empty()) {
+    error::logError("Can't save a snapshot of code generating a profile");
+    return false;
+  }
+
+  // Everything it has is compiled
+  if (!Interp.compileDeferred())
+    return false;
+
+  std::vector<const PrototypeAST *> Protos;
+  for (auto &[Name, Proto] : FunctionProtos)
+    if (!Preloaded.count(Name))
+      Protos.push_back(Proto.get());
+  llvm::sort(Protos, [&](const PrototypeAST *A, const PrototypeAST *B) {
+    return Symbols.str(A->getName()) < Symbols.str(B->getName());
+  });
+
+  Snapshot S;
+  S.Target = snapshotTarget();
+  S.Instrumented = !Opts.profileGenerate.empty();
+  for (const PrototypeAST *Proto : Protos) {
+    SnapshotEntry &E = S.Entries.emplace_back();
+    E.Name = std::string(Symbols.str(Proto->getName()));
+    for (Symbol Arg : Proto->getArgs())
+      E.Args.emplace_back(Symbols.str(Arg));
+    E.ArgTypes.assign(Proto->getArgTypes().begin(),
+                      Proto->getArgTypes().end());
+    E.RetType = Proto->getReturnType();
+    if (Proto->isUnaryOp() || Proto->isBinaryOp())
+      E.OperatorName = Proto->getOperatorName().str();
+    E.Precedence = Proto->getBinaryPrecedence();
+    E.Pure = Proto->isPure();
+    E.Extern = Proto->isExtern();
+    E.Effects = Proto->getEffects();
+    if (E.Extern)
+      continue;
+
+    E.Memoized = Proto->getMemoTable() >= 0;
+    E.SelfContained = SelfContained.count(Proto->getName());
+    auto BI = InlineBodies.find(Proto->getName());
+    if (BI != InlineBodies.end())
+      E.InlineBody.assign(BI->second.begin(), BI->second.end());
+
+    // Looking it up links it, if nothing has so far
+    auto Sym = TheJIT->lookup(E.Name);
+    if (!Sym) {
+      logIfError(Sym.takeError());
+      return false;
+    }
+    std::lock_guard<std::mutex> ObjectsLock(ObjectsMutex);
+    auto OI = Objects.find(E.Name + orc::KaleidoscopeJIT::BodySuffix.str());
+    if (OI == Objects.end()) {
+      error::logError(
+          ("Couldn't find the object file of " + E.Name).c_str());
+      return false;
+    }
+    E.Object = *OI->second;
+  }
+  return !logIfError(S.write(Path));
+}
+
+bool Session::loadSnapshot(const std::string &Path) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  auto S = Snapshot::read(Path);
+  if (!S)
+    return !logIfError(S.takeError());
+  if (S->Target != snapshotTarget()) {
+    error::logError((Path + " was saved on another target: " + S->Target)
+                        .c_str());
+    return false;
+  }
+  if (S->Instrumented) {
+    error::logError((Path + " has code generating a profile").c_str());
+    return false;
+  }
+
+  bool Ok = true;
+  for (SnapshotEntry &E : S->Entries) {
+    Symbol Name = Symbols.intern(E.Name);
+    if (FunctionProtos.count(Name)) {
+      error::logError((E.Name + " is already defined").c_str());
+      Ok = false;
+      continue;
+    }
+
+    std::vector<Symbol> Args;
+    for (const std::string &Arg : E.Args)
+      Args.push_back(Symbols.intern(Arg));
+    auto Proto = std::make_unique<PrototypeAST>(
+        Name, std::move(Args), E.ArgTypes, E.RetType, E.OperatorName,
+        E.Precedence, E.Pure);
+    Proto->setEffects(E.Effects);
+    if (E.Extern) {
+      Proto->setExtern();
+      Interp.declared(Name);
+      FunctionProtos[Name] = std::move(Proto);
+      continue;
+    }
+
+    // A table of its own, like a new definition gets
+    if (E.Memoized)
+      Proto->setMemoTable(athens_memo_new(E.Args.size()));
+    auto RT = TheJIT->redefine(E.Name);
+    if (!RT) {
+      logIfError(RT.takeError());
+      Ok = false;
+      continue;
+    }
+    if (logIfError(TheJIT->addObjectFile(
+            MemoryBuffer::getMemBufferCopy(E.Object, E.Name), *RT)) ||
+        !finishDefinition(*Proto, *RT)) {
+      Ok = false;
+      continue;
+    }
+
+    if (!E.InlineBody.empty())
+      InlineBodies[Name].assign(E.InlineBody.begin(), E.InlineBody.end());
+    if (E.SelfContained)
+      SelfContained.insert(Name);
+    if (Proto->isBinaryOp())
+      installBinaryOperator(Registry, E.OperatorName, E.Precedence);
+    Interp.compiled(Name);
+    FunctionProtos[Name] = std::move(Proto);
+  }
+  return Ok;
+}
+
+void Session::printModule(raw_ostream &OS) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  CG.TheModule->print(OS, nullptr);
+}
+
+void Session::printMemoStats(raw_ostream &OS) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (auto &[Name, Proto] : FunctionProtos) {
+    if (Proto->getMemoTable() < 0)
+      continue;
+    int64_t Hits, Misses;
+    athens_memo_stats(Proto->getMemoTable(), &Hits, &Misses);
+    OS << "memo " << Symbols.str(Name) << ": " << Hits << " hits, " << Misses
+       << " misses\n";
+  }
+}
+
+void Session::printMemoryUsage(raw_ostream &OS) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto JIT = TheJIT->getMemoryUsage();
+  uint64_t InlineBytes = 0;
+  for (auto &[Name, Bitcode] : InlineBodies)
+    InlineBytes += Bitcode.size();
+  uint64_t MemoBytes = 0;
+  for (auto &[Name, Table] : MemoTables)
+    if (Table >= 0)
+      MemoBytes += athens_memo_bytes(Table);
+  OS << "JIT: " << JIT.CodeBytes << " bytes of code, " << JIT.DataBytes
+     << " bytes of data in " << JIT.SlabBytes << " bytes of slabs\n"
+     << "modules: " << JIT.Definitions << " definitions, " << JIT.Unlinked
+     << " of them not compiled yet\n"
+     << "IR: " << InlineBytes << " bytes of bitcode to inline "
+     << InlineBodies.size() << " functions\n"
+     << "memo tables: " << MemoBytes << " bytes\n";
+}
+
+} // namespace athens
@@ -0,0 +1,188 @@
+#include "snapshot.h"
+
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <cstdint>
+
+using namespace llvm;
+using namespace athens;
+
+// With its null terminator
+static constexpr char Magic[] = "ATHSNAP";
+static constexpr uint32_t Version = 3;
+
+namespace {
+/// Writer - Appends little endian fields to a buffer.
+class Writer {
+public:
+  explicit Writer(std::string &Buf) : Buf(Buf) {}
+
+  void u8(uint8_t V) { Buf.push_back(char(V)); }
+  void u32(uint32_t V) {
+    for (unsigned I = 0; I != 4; ++I)
+      u8(uint8_t(V >> (8 * I)));
+  }
+  void u64(uint64_t V) {
+    for (unsigned I = 0; I != 8; ++I)
+      u8(uint8_t(V >> (8 * I)));
+  }
+  void str(StringRef S) {
+    u32(uint32_t(S.size()));
+    Buf.append(S.data(), S.size());
+  }
+
+private:
+  std::string &Buf;
+};
+
+enum EntryFlags : uint8_t {
+  Pure = 1 << 0,
+  Extern = 1 << 1,
+  Memoized = 1 << 2,
+  SelfContained = 1 << 3,
+};
+
+enum EffectFlags : uint8_t {
+  DoesNotAccessMemory = 1 << 0,
+  OnlyReadsMemory = 1 << 1,
+  DoesNotThrow = 1 << 2,
+  WillReturn = 1 << 3,
+  Speculatable = 1 << 4,
+};
+} // namespace
+
+static void writeEntry(Writer &W, const SnapshotEntry &E) {
+  W.str(E.Name);
+  W.u32(uint32_t(E.Args.size()));
+  for (size_t I = 0; I != E.Args.size(); ++I) {
+    W.str(E.Args[I]);
+    W.u8(uint8_t(E.ArgTypes[I]));
+  }
+  W.u8(uint8_t(E.RetType));
+  W.str(E.OperatorName);
+  W.u32(E.Precedence);
+  W.u8((E.Pure ? Pure : 0) | (E.Extern ? Extern : 0) |
+       (E.Memoized ? Memoized : 0) | (E.SelfContained ? SelfContained : 0));
+  const FunctionEffects &Fx = E.Effects;
+  W.u8((Fx.DoesNotAccessMemory ? DoesNotAccessMemory : 0) |
+       (Fx.OnlyReadsMemory ? OnlyReadsMemory : 0) |
+       (Fx.DoesNotThrow ? DoesNotThrow : 0) |
+       (Fx.WillReturn ? WillReturn : 0) |
+       (Fx.Speculatable ? Speculatable : 0));
+  W.str(E.InlineBody);
+  W.str(E.Object);
+}
+
+Error Snapshot::write(const std::string &Path) const {
+  std::string Buf;
+  Writer W(Buf);
+  Buf.append(Magic, sizeof(Magic));
+  W.u32(Version);
+  W.str(Target);
+  W.u8(Instrumented);
+  W.u32(uint32_t(Entries.size()));
+  for (const SnapshotEntry &E : Entries) {
+    std::string Contents;
+    Writer EW(Contents);
+    writeEntry(EW, E);
+    W.str(Contents);
+    W.u64(xxHash64(Contents));
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC);
+  if (!EC) {
+    OS << Buf;
+    OS.close();
+    EC = OS.error();
+  }
+  if (EC)
+    return createStringError(EC, "Couldn't write the snapshot %s: %s",
+                             Path.c_str(), EC.message().c_str());
+  return Error::success();
+}
+
+static bool isValueType(uint8_t T) { return T <= uint8_t(ValueType::Array); }
+
+static bool readEntry(StringRef Contents, SnapshotEntry &E) {
+  DataExtractor D(Contents, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+  DataExtractor::Cursor C(0);
+  auto Str = [&] { return D.getBytes(C, D.getU32(C)).str(); };
+
+  E.Name = Str();
+  uint32_t NumArgs = D.getU32(C);
+  for (uint32_t I = 0; C && I != NumArgs; ++I) {
+    E.Args.push_back(Str());
+    uint8_t T = D.getU8(C);
+    if (!isValueType(T))
+      return false;
+    E.ArgTypes.push_back(ValueType(T));
+  }
+  uint8_t RetType = D.getU8(C);
+  E.RetType = ValueType(RetType);
+  E.OperatorName = Str();
+  E.Precedence = D.getU32(C);
+  uint8_t Flags = D.getU8(C);
+  E.Pure = Flags & Pure;
+  E.Extern = Flags & Extern;
+  E.Memoized = Flags & Memoized;
+  E.SelfContained = Flags & SelfContained;
+  uint8_t Fx = D.getU8(C);
+  E.Effects.DoesNotAccessMemory = Fx & DoesNotAccessMemory;
+  E.Effects.OnlyReadsMemory = Fx & OnlyReadsMemory;
+  E.Effects.DoesNotThrow = Fx & DoesNotThrow;
+  E.Effects.WillReturn = Fx & WillReturn;
+  E.Effects.Speculatable = Fx & Speculatable;
+  E.InlineBody = Str();
+  E.Object = Str();
+
+  bool Ok = C && isValueType(RetType) && D.eof(C) && !E.Name.empty() &&
+            E.Extern == E.Object.empty();
+  consumeError(C.takeError());
+  return Ok;
+}
+
+Expected<Snapshot> Snapshot::read(const std::string &Path) {
+  auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!Buf)
+    return createStringError(Buf.getError(),
+                             "Couldn't read the snapshot %s: %s",
+                             Path.c_str(), Buf.getError().message().c_str());
+  auto Malformed = [&](const char *What) {
+    return createStringError(inconvertibleErrorCode(), "%s: %s", Path.c_str(),
+                             What);
+  };
+
+  StringRef Data = (*Buf)->getBuffer();
+  if (!Data.starts_with(StringRef(Magic, sizeof(Magic))))
+    return Malformed("not an athens snapshot");
+  DataExtractor D(Data, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+  DataExtractor::Cursor C(sizeof(Magic));
+  if (D.getU32(C) != Version) {
+    consumeError(C.takeError());
+    return Malformed("snapshot of another version of athens");
+  }
+
+  Snapshot S;
+  S.Target = D.getBytes(C, D.getU32(C)).str();
+  S.Instrumented = D.getU8(C);
+  uint32_t NumEntries = D.getU32(C);
+  for (uint32_t I = 0; C && I != NumEntries; ++I) {
+    StringRef Contents = D.getBytes(C, D.getU32(C));
+    uint64_t Hash = D.getU64(C);
+    if (!C)
+      break;
+    SnapshotEntry &E = S.Entries.emplace_back();
+    if (Hash != xxHash64(Contents) || !readEntry(Contents, E))
+      return Malformed("corrupt snapshot");
+  }
+  if (!C || !D.eof(C)) {
+    consumeError(C.takeError());
+    return Malformed("truncated snapshot");
+  }
+  return S;
+}
@@ -0,0 +1,249 @@
+#include "typecheck.h"
+#include "error.h"
+
+using namespace llvm;
+
+static ValueType join(ValueType A, ValueType B) {
+  return A == ValueType::Int && B == ValueType::Int ? ValueType::Int
+                                                    : ValueType::Double;
+}
+
+TypeInference::TypeInference(const FunctionProtoMap &FunctionProtos,
+                             const PrototypeAST &Self, unsigned NumSlots)
+    : FunctionProtos(FunctionProtos), Self(Self),
+      SlotTypes(NumSlots, ValueType::Int) {
+  // Arguments take the first slots, in order
+  llvm::copy(Self.getArgTypes(), SlotTypes.begin());
+}
+
+bool TypeInference::run(ExprAST *Body) {
+  ValueType BodyTy;
+  do {
+    Changed = false;
+    BodyTy = Body->infer(*this);
+  } while (Changed && !Failed);
+
+  return !Failed && expect(Self.getReturnType(), BodyTy);
+}
+
+void TypeInference::store(unsigned Slot, ValueType Ty) {
+  // Arguments keep their declared type, stores into them convert
+  if (Slot < Self.getArgs().size())
+    return;
+
+  // Assignments are checked against the slot's type first, so an array only
+  // gets here from a var's initializer
+  if (Ty == ValueType::Array || SlotTypes[Slot] == ValueType::Int) {
+    Changed |= SlotTypes[Slot] != Ty;
+    SlotTypes[Slot] = Ty;
+  }
+}
+
+bool TypeInference::expect(ValueType Expected, ValueType Got) {
+  if ((Expected == ValueType::Array) == (Got == ValueType::Array))
+    return true;
+
+  // The first error is enough, the rest are usually caused by it
+  if (!Failed)
+    error::logError(Expected == ValueType::Array
+                        ? "Expected an array, got a number"
+                        : "Expected a number, got an array");
+  Failed = true;
+  return false;
+}
+
+void TypeInference::call(const PrototypeAST &Callee,
+                         ArrayRef<ValueType> ArgTypes) {
+  CallsFunctions = true;
+
+  // Wrong argument counts are reported by codegen
+  for (auto [Param, Arg] : zip(Callee.getArgTypes(), ArgTypes))
+    expect(Param, Arg);
+
+  // Memoizing a function is only right if everything it calls could be
+  // memoized too
+  if (Self.isPure() && !Callee.isPure()) {
+    if (!Failed)
+      error::logError("A pure function can only call pure functions");
+    Failed = true;
+  }
+}
+
+const PrototypeAST *TypeInference::lookup(Symbol Name) const {
+  if (Name == Self.getName())
+    return &Self;
+  auto FI = FunctionProtos.find(Name);
+  return FI != FunctionProtos.end() ? FI->second.get() : nullptr;
+}
+
+ValueType ExprAST::infer(TypeInference &TI) {
+  switch (getKind()) {
+  case EK_Number:
+    return Ty = cast<NumberExprAST>(this)->infer(TI);
+  case EK_Variable:
+    return Ty = cast<VariableExprAST>(this)->infer(TI);
+  case EK_Var:
+    return Ty = cast<VarExprAST>(this)->infer(TI);
+  case EK_Binary:
+    return Ty = cast<BinaryExprAST>(this)->infer(TI);
+  case EK_Unary:
+    return Ty = cast<UnaryExprAST>(this)->infer(TI);
+  case EK_If:
+    return Ty = cast<IfExprAST>(this)->infer(TI);
+  case EK_For:
+    return Ty = cast<ForExprAST>(this)->infer(TI);
+  case EK_Parfor:
+    return Ty = cast<ParforExprAST>(this)->infer(TI);
+  case EK_Call:
+    return Ty = cast<CallExprAST>(this)->infer(TI);
+  case EK_Array:
+    return Ty = cast<ArrayExprAST>(this)->infer(TI);
+  case EK_Index:
+    return Ty = cast<IndexExprAST>(this)->infer(TI);
+  case EK_Length:
+    return Ty = cast<LengthExprAST>(this)->infer(TI);
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+ValueType NumberExprAST::infer(TypeInference &) {
+  return IsInt ? ValueType::Int : ValueType::Double;
+}
+
+ValueType VariableExprAST::infer(TypeInference &TI) {
+  return TI.getSlotType(Slot);
+}
+
+ValueType VarExprAST::infer(TypeInference &TI) {
+  // Uninitialized variables start out as (int) 0
+  for (auto &Binding : VarNames)
+    if (Binding.Init)
+      TI.store(Binding.Slot, Binding.Init->infer(TI));
+
+  return Body->infer(TI);
+}
+
+ValueType BinaryExprAST::infer(TypeInference &TI) {
+  ValueType L = LHS->infer(TI);
+  ValueType R = RHS->infer(TI);
+
+  if (Op == BuiltinOp::Assign) {
+    // Elements are doubles, assigning one gives the double stored
+    if (isa<IndexExprAST>(LHS)) {
+      TI.expect(ValueType::Double, R);
+      return ValueType::Double;
+    }
+
+    unsigned Slot = cast<VariableExprAST>(LHS)->getSlot();
+    TI.expect(TI.getSlotType(Slot), R);
+    TI.store(Slot, R);
+    return TI.getSlotType(Slot);
+  }
+
+  // User-defined and overloaded operators are calls
+  if (const PrototypeAST *P = TI.lookup(OpFn)) {
+    TI.call(*P, {L, R});
+    return P->getReturnType();
+  }
+
+  if (Op == BuiltinOp::Seq)
+    return R;
+
+  // Everything else is arithmetic or logic on numbers
+  TI.expect(ValueType::Double, L);
+  TI.expect(ValueType::Double, R);
+
+  switch (Op) {
+  case BuiltinOp::Add:
+  case BuiltinOp::Sub:
+  case BuiltinOp::Mul:
+    return join(L, R);
+  case BuiltinOp::Div:
+    return ValueType::Double;
+  default:
+    // Comparisons and logic give 0 or 1
+    return ValueType::Int;
+  }
+}
+
+ValueType UnaryExprAST::infer(TypeInference &TI) {
+  ValueType OperandTy = Operand->infer(TI);
+
+  if (const PrototypeAST *P = TI.lookup(OpFn)) {
+    TI.call(*P, OperandTy);
+    return P->getReturnType();
+  }
+  TI.expect(ValueType::Double, OperandTy);
+  return Op == BuiltinOp::Not ? ValueType::Int : ValueType::Double;
+}
+
+ValueType IfExprAST::infer(TypeInference &TI) {
+  TI.expect(ValueType::Double, Cond->infer(TI));
+  ValueType ThenTy = Then->infer(TI);
+  ValueType ElseTy = Else->infer(TI);
+
+  // Either both branches give an array or neither does
+  if (ThenTy == ValueType::Array || ElseTy == ValueType::Array) {
+    TI.expect(ThenTy, ElseTy);
+    return ValueType::Array;
+  }
+  return join(ThenTy, ElseTy);
+}
+
+ValueType ForExprAST::infer(TypeInference &TI) {
+  ValueType StartTy = Start->infer(TI);
+  TI.expect(ValueType::Double, StartTy);
+  TI.store(Slot, StartTy);
+  TI.expect(ValueType::Double, End->infer(TI));
+  if (Step) {
+    ValueType StepTy = Step->infer(TI);
+    TI.expect(ValueType::Double, StepTy);
+    TI.store(Slot, StepTy);
+  }
+  Body->infer(TI);
+
+  // for expr returns 0.0 for now
+  return ValueType::Double;
+}
+
+ValueType ParforExprAST::infer(TypeInference &TI) {
+  // The counter is always an int, it's never assigned
+  TI.expect(ValueType::Int, Start->infer(TI));
+  TI.expect(ValueType::Int, End->infer(TI));
+
+  ValueType BodyTy = Body->infer(TI);
+  if (Reduce != BuiltinOp::None)
+    TI.expect(ValueType::Double, BodyTy);
+
+  // The reduction is done in doubles
+  return ValueType::Double;
+}
+
+ValueType CallExprAST::infer(TypeInference &TI) {
+  SmallVector<ValueType, 4> ArgTypes;
+  for (auto *Arg : Args)
+    ArgTypes.push_back(Arg->infer(TI));
+
+  // Unknown callees are reported by codegen
+  const PrototypeAST *P = TI.lookup(Callee);
+  if (!P)
+    return ValueType::Double;
+  TI.call(*P, ArgTypes);
+  return P->getReturnType();
+}
+
+ValueType ArrayExprAST::infer(TypeInference &TI) {
+  TI.expect(ValueType::Double, Size->infer(TI));
+  return ValueType::Array;
+}
+
+ValueType IndexExprAST::infer(TypeInference &TI) {
+  TI.expect(ValueType::Array, Array->infer(TI));
+  TI.expect(ValueType::Double, Index->infer(TI));
+  return ValueType::Double;
+}
+
+ValueType LengthExprAST::infer(TypeInference &TI) {
+  TI.expect(ValueType::Array, Array->infer(TI));
+  return ValueType::Int;
+}
@@ -0,0 +1,119 @@
+#include "watch.h"
+#include "runtime.h"
+
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace athens;
+
+// Editors may write a file in a few steps, a change is run once the
+// directory has been quiet for this long
+static constexpr int SettleMillis = 50;
+
+static Error errnoError(const Twine &What) {
+  int Errno = errno;
+  return createStringError(std::error_code(Errno, std::generic_category()),
+                           "%s: %s", What.str().c_str(), strerror(Errno));
+}
+
+/// Wait until the file Name in the directory Fd watches was written or
+/// replaced, and the directory settled.
+static Error waitForChange(int Fd, StringRef Name) {
+  alignas(inotify_event) char Buf[4096];
+  bool Changed = false;
+  for (;;) {
+    pollfd P = {Fd, POLLIN, 0};
+    int Ready = poll(&P, 1, Changed ? SettleMillis : -1);
+    if (Ready < 0 && errno == EINTR)
+      continue;
+    if (Ready < 0)
+      return errnoError("Couldn't wait for changes");
+    if (Ready == 0)
+      return Error::success();
+
+    ssize_t N = read(Fd, Buf, sizeof(Buf));
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return errnoError("Couldn't read changes");
+    for (char *E = Buf; E < Buf + N;) {
+      auto *Event = reinterpret_cast<inotify_event *>(E);
+      if (Event->len && StringRef(Event->name) == Name)
+        Changed = true;
+      E += sizeof(inotify_event) + Event->len;
+    }
+  }
+}
+
+/// Run the top-level expressions of S's last update in a fork, and wait
+/// for it.
+static void runExpressions(Session &S) {
+  // Nothing may be left in a buffer for the fork to write out again
+  outs().flush();
+  errs().flush();
+  flush();
+  fflush(nullptr);
+
+  pid_t Pid = fork();
+  if (Pid == 0)
+    std::exit(S.runExpressions() ? 0 : 1);
+  if (Pid < 0) {
+    logAllUnhandledErrors(errnoError("Couldn't run the program"), errs());
+    return;
+  }
+  int Status;
+  while (waitpid(Pid, &Status, 0) < 0 && errno == EINTR)
+    ;
+}
+
+Error athens::watch(
+    function_ref<Expected<std::unique_ptr<Session>>()> NewSession,
+    const std::string &Path, Mode M) {
+  int Fd = inotify_init1(IN_CLOEXEC);
+  if (Fd < 0)
+    return errnoError("Couldn't watch " + Path);
+  auto CloseFd = make_scope_exit([&] { close(Fd); });
+  StringRef Dir = sys::path::parent_path(Path);
+  if (inotify_add_watch(Fd, Dir.empty() ? "." : Dir.str().c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    return errnoError("Couldn't watch " + Path);
+
+  auto S = NewSession();
+  if (!S)
+    return S.takeError();
+  for (;;) {
+    auto Source = MemoryBuffer::getFile(Path, /*IsText=*/true);
+    if (!Source) {
+      errs() << "Couldn't read " << Path << ": " << Source.getError().message()
+             << "\n";
+    } else {
+      if ((*S)->update((*Source)->getBuffer(), M) ==
+          UpdateResult::Incompatible) {
+        errs() << "A prototype changed or was removed, starting over\n";
+        S->reset();
+        S = NewSession();
+        if (!S)
+          return S.takeError();
+        (*S)->update((*Source)->getBuffer(), M);
+      }
+      runExpressions(**S);
+    }
+
+    errs() << "Watching " << Path << " for changes\n";
+    if (auto Err = waitForChange(Fd, sys::path::filename(Path)))
+      return Err;
+  }
+}
@@ -16,6 +16,7 @@ namespace frontend::lex {
 class CharStream {
 public:
   explicit CharStream(std::istream &in);
+  explicit CharStream(std::string_view source);
 
   ~CharStream() = default;
 
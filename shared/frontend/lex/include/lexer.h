@@ -2,6 +2,7 @@
 
 #include "char_stream.h"
 #include "lex_language_rules.h"
+#include "symbol_table.h"
 #include "trivia.h"
 #include <vector>
 
@@ -16,7 +17,10 @@ namespace frontend::lex {
  * */
 class Lexer {
 public:
-  Lexer(CharStream &cs, const ILexLanguageRules &langLexConfig);
+  // With a SymbolTable, identifiers are interned as they're lexed (see
+  // Token::symbol), so later stages never have to hash/copy their spelling.
+  Lexer(CharStream &cs, const ILexLanguageRules &langLexConfig,
+        SymbolTable *symbols = nullptr);
 
   Token next();
   const std::vector<TriviaPiece> &leadingTrivia() const;
@@ -25,12 +29,15 @@ private:
   void consumeTrivia();
   Token lexIdentifierOrKeyword();
   Token lexNumber();
+  Token lexRationalTail(std::size_t startPos, std::size_t startLine,
+                        std::size_t startCol);
   Token lexPunctOrInvalid();
   bool consumeCommentMaybe();
 
   // state
   CharStream &cs_;
   const ILexLanguageRules &langLexConfig_;
+  SymbolTable *symbols_;
   std::vector<TriviaPiece> trivia_;
 };
 } // namespace frontend::lex
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace frontend::lex {
+
+// Symbol is a handle to an interned string (identifier, function name etc).
+// Two symbols from the same SymbolTable are equal iff their strings are, so
+// comparing/hashing them is an integer operation.
+class Symbol {
+public:
+  constexpr Symbol() = default;
+  constexpr explicit Symbol(std::uint32_t id) : id_(id) {}
+
+  constexpr std::uint32_t id() const { return id_; }
+  // default constructed symbols don't name anything
+  constexpr bool valid() const { return id_ != 0; }
+  constexpr explicit operator bool() const { return valid(); }
+
+  friend constexpr bool operator==(Symbol, Symbol) = default;
+  friend constexpr auto operator<=>(Symbol, Symbol) = default;
+
+private:
+  std::uint32_t id_{0};
+};
+
+// SymbolTable interns strings into Symbols. Interned text is copied once into
+// an arena owned by the table and never moves, so views returned by str() stay
+// valid for the table's lifetime.
+//
+// intern/str can be called from several threads at once (e.g. parser workers
+// interning operator function names), lookups of already interned strings
+// only take a shared lock.
+class SymbolTable {
+public:
+  SymbolTable();
+
+  // no copy/move, Symbols and views point into this table
+  SymbolTable(const SymbolTable &) = delete;
+  SymbolTable &operator=(const SymbolTable &) = delete;
+
+  Symbol intern(std::string_view text);
+
+  // Symbol for text if it's been interned already, invalid Symbol otherwise
+  Symbol find(std::string_view text) const;
+
+  std::string_view str(Symbol sym) const;
+
+  std::size_t size() const;
+
+private:
+  std::string_view save(std::string_view text);
+
+  mutable std::shared_mutex mutex_;
+  // keys view into the arena
+  std::unordered_map<std::string_view, Symbol> ids_;
+  // id -> text, index 0 is the invalid symbol
+  std::vector<std::string_view> strings_;
+
+  // bump arena for the interned text
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  char *cursor_{nullptr};
+  std::size_t left_{0};
+};
+
+} // namespace frontend::lex
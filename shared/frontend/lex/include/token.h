@@ -1,6 +1,7 @@
 #pragma once
 
 #include "source_loc.h"
+#include "symbol_table.h"
 #include <string_view>
 #include <variant>
 
@@ -17,6 +18,8 @@ enum class TokenKind {
 
   LParen,
   RParen,
+  LBracket,
+  RBracket,
   Comma,
   Semicolon,
   Plus,
@@ -29,6 +32,14 @@ enum class TokenKind {
   Greater,
   GreaterEqual,
   LogicNot,
+  EqualEqual,
+  NotEqual,
+  LogicAnd,
+  LogicOr,
+  Colon,
+  // Any other operator character the language lets through (e.g. for
+  // user-defined operators), the lexeme tells which one it is.
+  Operator,
 
   KwFuncDef,
   KwExtern,
@@ -36,6 +47,7 @@ enum class TokenKind {
   KwThen,
   KwElse,
   KwFor,
+  KwParfor,
   KwIn,
   KwBinaryOp,
   KwUnaryOp,
@@ -43,13 +55,15 @@ enum class TokenKind {
 
 };
 
-using LiteralValue = std::variant<std::monostate, long long>;
+using LiteralValue = std::variant<std::monostate, long long, double>;
 
 struct Token {
   TokenKind kind{TokenKind::Invalid};
   std::string_view lexeme;
   SourceLoc source_loc{};
   LiteralValue literal{};
+  // Identifiers' interned spelling, only if the lexer was given a SymbolTable
+  Symbol symbol{};
 };
 
 } // namespace frontend::lex
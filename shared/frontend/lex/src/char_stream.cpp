@@ -9,6 +9,8 @@ CharStream::CharStream(std::istream &in) {
                         std::istreambuf_iterator<char>());
 }
 
+CharStream::CharStream(std::string_view source) : buffer_(source) {}
+
 char CharStream::peek() const {
   // eof check
   if (cursor_ >= buffer_.size())
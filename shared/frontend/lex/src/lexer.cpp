@@ -12,8 +12,9 @@
 
 namespace frontend::lex {
 
-Lexer::Lexer(CharStream &cs, const ILexLanguageRules &langLexConfig)
-    : cs_(cs), langLexConfig_(langLexConfig) {}
+Lexer::Lexer(CharStream &cs, const ILexLanguageRules &langLexConfig,
+             SymbolTable *symbols)
+    : cs_(cs), langLexConfig_(langLexConfig), symbols_(symbols) {}
 
 // invariant: next always consumes at least one char unless EOF
 //
@@ -46,7 +47,9 @@ Token Lexer::next() {
   if (langLexConfig_.isIdentStart(c)) {
     return lexIdentifierOrKeyword();
     // maybe a number?
-  } else if (std::isdigit(static_cast<unsigned char>(c))) {
+  } else if (std::isdigit(static_cast<unsigned char>(c)) ||
+             (c == '.' && langLexConfig_.allowRationalLiteral() &&
+              std::isdigit(static_cast<unsigned char>(cs_.peek2())))) {
     return lexNumber();
   } else {
     // then it must be punctuation or invalid
@@ -247,12 +250,14 @@ Token Lexer::lexIdentifierOrKeyword() {
                    .end_line = endLine,
                    .end_column = endCol,
                },
-               LiteralValue{}};
+               LiteralValue{},
+               symbols_ ? symbols_->intern(lexeme) : Symbol{}};
 }
 
 // lexNumber lexes a numeric stream
 // returns TokenKind::InvalidNumber if something's off
-// Otherwise returns TokenKind::Integer
+// Otherwise returns TokenKind::Integer, or TokenKind::Float for a rational
+// literal (e.g. 0.05, .5, 3.) if the language allows them
 Token Lexer::lexNumber() {
   const std::size_t startPos = cs_.position();
   const std::size_t startLine = cs_.line();
@@ -262,6 +267,9 @@ Token Lexer::lexNumber() {
     cs_.consumeOne();
   }
 
+  if (langLexConfig_.allowRationalLiteral() && cs_.peek() == '.')
+    return lexRationalTail(startPos, startLine, startCol);
+
   const std::size_t endPos = cs_.position();
   const std::size_t endLine = cs_.line();
   const std::size_t endCol = cs_.column();
@@ -303,6 +311,38 @@ Token Lexer::lexNumber() {
                literal};
 }
 
+// lexRationalTail lexes the '.' and fraction digits of a rational literal
+// whose integral part (possibly empty) started at startPos.
+Token Lexer::lexRationalTail(std::size_t startPos, std::size_t startLine,
+                             std::size_t startCol) {
+  cs_.consumeOne(); // '.'
+  while (!cs_.eof() && std::isdigit(static_cast<unsigned char>(cs_.peek()))) {
+    cs_.consumeOne();
+  }
+
+  const std::size_t endPos = cs_.position();
+  const SourceLoc loc{
+      .start_offset = startPos,
+      .end_offset = endPos,
+      .start_line = startLine,
+      .start_column = startCol,
+      .end_line = cs_.line(),
+      .end_column = cs_.column(),
+  };
+
+  const std::string_view lexeme = cs_.view(startPos, endPos);
+
+  double parsed = 0;
+  const auto parseRes =
+      std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), parsed);
+  if (parseRes.ec != std::errc{} ||
+      parseRes.ptr != lexeme.data() + lexeme.size()) {
+    return Token{TokenKind::InvalidNumber, lexeme, loc, LiteralValue{}};
+  }
+
+  return Token{TokenKind::Float, lexeme, loc, LiteralValue{parsed}};
+}
+
 // lexPunctOrInvalid lexes punctuation
 // returns std::optional<TokenKing> (so it can be invalid)j
 Token Lexer::lexPunctOrInvalid() {
@@ -0,0 +1,67 @@
+#include "../include/symbol_table.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+namespace frontend::lex {
+
+// identifiers are short, one chunk holds a few hundred of them
+static constexpr std::size_t kChunkSize = 4096;
+
+SymbolTable::SymbolTable() { strings_.emplace_back(); }
+
+Symbol SymbolTable::intern(std::string_view text) {
+  {
+    std::shared_lock lock(mutex_);
+    auto it = ids_.find(text);
+    if (it != ids_.end())
+      return it->second;
+  }
+
+  std::unique_lock lock(mutex_);
+  // someone else might have interned it in between the locks
+  auto it = ids_.find(text);
+  if (it != ids_.end())
+    return it->second;
+
+  std::string_view saved = save(text);
+  Symbol sym(static_cast<std::uint32_t>(strings_.size()));
+  strings_.push_back(saved);
+  ids_.emplace(saved, sym);
+  return sym;
+}
+
+Symbol SymbolTable::find(std::string_view text) const {
+  std::shared_lock lock(mutex_);
+  auto it = ids_.find(text);
+  return it != ids_.end() ? it->second : Symbol{};
+}
+
+std::string_view SymbolTable::str(Symbol sym) const {
+  std::shared_lock lock(mutex_);
+  return sym.id() < strings_.size() ? strings_[sym.id()] : std::string_view{};
+}
+
+std::size_t SymbolTable::size() const {
+  std::shared_lock lock(mutex_);
+  return strings_.size() - 1;
+}
+
+std::string_view SymbolTable::save(std::string_view text) {
+  if (text.size() > left_) {
+    std::size_t size = std::max(kChunkSize, text.size());
+    chunks_.push_back(std::make_unique<char[]>(size));
+    cursor_ = chunks_.back().get();
+    left_ = size;
+  }
+
+  if (!text.empty())
+    std::memcpy(cursor_, text.data(), text.size());
+  std::string_view saved(cursor_, text.size());
+  cursor_ += text.size();
+  left_ -= text.size();
+  return saved;
+}
+
+} // namespace frontend::lex
@@ -29,7 +29,7 @@ public:
 
     while (true) {
       const auto &lookahead = ctx_.tokenStream.current();
-      const auto *infixEntry = registry_.findInfixHandler(lookahead.kind);
+      const auto *infixEntry = registry_.findInfixHandler(lookahead);
       if (!infixEntry)
         break;
 
@@ -2,6 +2,11 @@
 
 #include "handler_types.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 
 namespace frontend::parse {
@@ -22,6 +27,21 @@ public:
     infix_[kind] = InfixEntry<BuilderT>{precedence, std::move(handler)};
   }
 
+  // Register an infix operator by its spelling rather than its TokenKind, for
+  // languages with user-defined operators that all lex to the same kind.
+  // Spelling entries take priority over kind entries.
+  void setInfixOperator(std::string_view spelling, int precedence,
+                        InfixExprHandler<BuilderT> handler) {
+    infixOps_.insert_or_assign(
+        std::string(spelling),
+        InfixEntry<BuilderT>{precedence, std::move(handler)});
+  }
+
+  void removeInfixOperator(std::string_view spelling) {
+    if (auto it = infixOps_.find(spelling); it != infixOps_.end())
+      infixOps_.erase(it);
+  }
+
   void setStmt(frontend::lex::TokenKind kind, StmtHandler<BuilderT> handler) {
     stmt_[kind] = std::move(handler);
   }
@@ -30,6 +50,17 @@ public:
     item_[kind] = std::move(handler);
   }
 
+  // Handlers that peek(n) past the current token declare it here, so the
+  // TokenStream lookahead ring can be sized for the whole grammar up front.
+  void requireLookahead(std::size_t depth) {
+    maxLookahead_ = std::max(maxLookahead_, depth);
+  }
+
+  std::size_t maxLookahead() const {
+    return fallback_ ? std::max(maxLookahead_, fallback_->maxLookahead())
+                     : maxLookahead_;
+  }
+
   const PrefixExprHandler<BuilderT> *
   findPrefixHandler(frontend::lex::TokenKind kind) const {
     if (auto it = prefix_.find(kind); it != prefix_.end())
@@ -46,6 +77,14 @@ public:
     return fallback_ ? fallback_->findInfixHandler(kind) : nullptr;
   }
 
+  const InfixEntry<BuilderT> *
+  findInfixHandler(const frontend::lex::Token &tok) const {
+    if (const auto *entry = findInfixOperator(tok.lexeme))
+      return entry;
+
+    return findInfixHandler(tok.kind);
+  }
+
   const StmtHandler<BuilderT> *
   findStmtHandler(frontend::lex::TokenKind kind) const {
     if (auto it = stmt_.find(kind); it != stmt_.end())
@@ -63,11 +102,21 @@ public:
   }
 
 private:
+  const InfixEntry<BuilderT> *
+  findInfixOperator(std::string_view spelling) const {
+    if (auto it = infixOps_.find(spelling); it != infixOps_.end())
+      return &it->second;
+
+    return fallback_ ? fallback_->findInfixOperator(spelling) : nullptr;
+  }
+
   const ParserRegistry *fallback_;
+  std::size_t maxLookahead_{0};
 
   std::unordered_map<frontend::lex::TokenKind, PrefixExprHandler<BuilderT>>
       prefix_;
   std::unordered_map<frontend::lex::TokenKind, InfixEntry<BuilderT>> infix_;
+  std::map<std::string, InfixEntry<BuilderT>, std::less<>> infixOps_;
   std::unordered_map<frontend::lex::TokenKind, StmtHandler<BuilderT>> stmt_;
   std::unordered_map<frontend::lex::TokenKind, ItemHandler<BuilderT>> item_;
 };
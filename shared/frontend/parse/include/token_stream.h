@@ -3,8 +3,11 @@
 #include "../../lex/include/lexer.h"
 #include "diagnostics.h"
 
-#include <deque>
+#include <cassert>
+#include <cstddef>
 #include <initializer_list>
+#include <memory>
+#include <span>
 #include <string_view>
 #include <vector>
 
@@ -13,13 +16,41 @@ namespace frontend::parse {
 // TokenStream is the driver for lexer
 // Parser uses TokenStream API, and TokenStream calls lexer's methods (e.g.
 // next()) only when needed.
+//
+// Lookahead lives in a fixed-capacity ring (power-of-two sized, so wrapping is
+// a mask). The ring is sized once at construction from the deepest peek the
+// grammar needs, and each slot keeps its own trivia vector around, so once the
+// trivia vectors have grown to fit, lexing/consuming doesn't allocate at all.
+//
+// A TokenStream can also replay tokens that were lexed up front (e.g. one
+// top-level item out of a pre-scanned file). Replayed tokens carry no trivia,
+// and once the span runs out the stream yields Eof.
 class TokenStream {
 public:
-  explicit TokenStream(frontend::lex::Lexer &lexer) : lexer_(lexer) {}
+  // Most grammars only look at the current token and maybe one after it.
+  static constexpr std::size_t kDefaultMaxLookahead = 1;
+
+  explicit TokenStream(frontend::lex::Lexer &lexer,
+                       std::size_t maxLookahead = kDefaultMaxLookahead)
+      : lexer_(&lexer), maxLookahead_(maxLookahead),
+        capacity_(ringCapacityFor(maxLookahead)), mask_(capacity_ - 1),
+        slots_(std::make_unique<Slot[]>(capacity_)) {}
+
+  // The tokens must outlive the stream (and their lexemes the CharStream they
+  // were lexed from).
+  explicit TokenStream(std::span<const frontend::lex::Token> tokens,
+                       std::size_t maxLookahead = kDefaultMaxLookahead)
+      : replay_(tokens), maxLookahead_(maxLookahead),
+        capacity_(ringCapacityFor(maxLookahead)), mask_(capacity_ - 1),
+        slots_(std::make_unique<Slot[]>(capacity_)) {}
+
+  // no copy/move, handed out references point into the ring
+  TokenStream(const TokenStream &) = delete;
+  TokenStream &operator=(const TokenStream &) = delete;
 
   const frontend::lex::Token &peek(std::size_t lookahead = 0) {
     fillUntil(lookahead);
-    return tokens_[lookahead];
+    return slot(lookahead).token;
   }
 
   const frontend::lex::Token &current() { return peek(0); }
@@ -27,19 +58,22 @@ public:
   const std::vector<frontend::lex::TriviaPiece> &
   leadingTrivia(std::size_t lookahead = 0) {
     fillUntil(lookahead);
-    return trivia_[lookahead];
+    return slot(lookahead).trivia;
   }
 
   bool is(frontend::lex::TokenKind kind, std::size_t lookahead = 0) {
     return peek(lookahead).kind == kind;
   }
 
-  frontend::lex::Token consume() {
+  // Returns the consumed token in place. The reference stays valid until the
+  // stream is advanced again (next consume), callers that need to keep the
+  // token longer should copy it (Token is a small trivially copyable struct).
+  const frontend::lex::Token &consume() {
     fillUntil(0);
-    frontend::lex::Token tok = tokens_.front();
-    tokens_.pop_front();
-    trivia_.pop_front();
-    return tok;
+    const Slot &s = slots_[head_];
+    head_ = (head_ + 1) & mask_;
+    --count_;
+    return s.token;
   }
 
   bool match(frontend::lex::TokenKind kind) {
@@ -70,18 +104,68 @@ public:
     return false;
   }
 
+  std::size_t maxLookahead() const { return maxLookahead_; }
+
 private:
+  struct Slot {
+    frontend::lex::Token token;
+    std::vector<frontend::lex::TriviaPiece> trivia;
+  };
+
+  // peek(0..maxLookahead) needs maxLookahead + 1 live slots, and we keep one
+  // more on top so the token handed out by consume() isn't overwritten by a
+  // peek right after it.
+  static std::size_t ringCapacityFor(std::size_t maxLookahead) {
+    std::size_t cap = 1;
+    while (cap < maxLookahead + 2)
+      cap <<= 1;
+    return cap;
+  }
+
+  Slot &slot(std::size_t lookahead) {
+    return slots_[(head_ + lookahead) & mask_];
+  }
+
   void fillUntil(std::size_t lookahead) {
-    while (tokens_.size() <= lookahead) {
-      frontend::lex::Token tok = lexer_.next();
-      tokens_.push_back(tok);
-      trivia_.push_back(lexer_.leadingTrivia());
+    assert(lookahead <= maxLookahead_ &&
+           "peek beyond the lookahead this TokenStream was sized for");
+    while (count_ <= lookahead) {
+      Slot &s = slot(count_);
+      if (lexer_) {
+        s.token = lexer_->next();
+        // assign() reuses the slot's existing capacity
+        const auto &trivia = lexer_->leadingTrivia();
+        s.trivia.assign(trivia.begin(), trivia.end());
+      } else {
+        s.token = nextReplayed();
+        s.trivia.clear();
+      }
+      ++count_;
     }
   }
 
-  frontend::lex::Lexer &lexer_;
-  std::deque<frontend::lex::Token> tokens_;
-  std::deque<std::vector<frontend::lex::TriviaPiece>> trivia_;
+  frontend::lex::Token nextReplayed() {
+    if (replayPos_ < replay_.size())
+      return replay_[replayPos_++];
+
+    frontend::lex::Token eof;
+    eof.kind = frontend::lex::TokenKind::Eof;
+    if (!replay_.empty())
+      eof.source_loc = replay_.back().source_loc;
+    return eof;
+  }
+
+  // exactly one of these is the token source
+  frontend::lex::Lexer *lexer_{nullptr};
+  std::span<const frontend::lex::Token> replay_{};
+  std::size_t replayPos_{0};
+
+  std::size_t maxLookahead_;
+  std::size_t capacity_;
+  std::size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  std::size_t head_{0};
+  std::size_t count_{0};
 };
 
 } // namespace frontend::parse